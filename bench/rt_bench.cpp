@@ -0,0 +1,509 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arena.hpp>
+#include <bvh.hpp>
+#include <hitable_list.hpp>
+#include <image.hpp>
+#include <material.hpp>
+#include <path.hpp>
+#include <random.hpp>
+#include <ray.hpp>
+#include <render.hpp>
+#include <sampler.hpp>
+#include <scenes.hpp>
+#include <sphere.hpp>
+#include <vector.hpp>
+
+/*
+ * Benchmarks of the ray tracer: the hot functions one by one, the image
+ * writers, and whole renders of the two demo scenes for a growing number of
+ * threads. Results are written as JSON, progress goes to stderr.
+ */
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Settings {
+  std::string output;
+  std::string filter;
+  double min_time = 0.5;
+  std::uint32_t width = 400;
+  std::uint32_t height = 200;
+  unsigned spp = 4;
+  unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1U);
+};
+
+/*
+ * Timing of one benchmark. An op is what the benchmark counts: a ray, a
+ * scatter, a sample or an image
+ */
+struct Result {
+  std::string name;
+  std::string unit;
+  std::uint64_t ops;
+  double seconds;
+};
+
+/*
+ * Point of a thread scaling curve
+ */
+struct ScalingPoint {
+  std::string name;
+  unsigned threads;
+  std::uint64_t samples;
+  double seconds;
+};
+
+// Written by the benchmarks so that the work they time is not optimized away
+volatile float sink;
+
+double elapsed(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/*
+ * Run f(n), which performs n ops, with n doubling until a run takes at least
+ * min_time seconds, and keep that run
+ */
+template<typename F>
+Result measure(const Settings& settings, const std::string& name,
+               const std::string& unit, F&& f) {
+  std::uint64_t ops = 1;
+  while (true) {
+    const auto start = Clock::now();
+    f(ops);
+    const auto seconds = elapsed(start);
+    if (seconds >= settings.min_time || ops >= (1ULL << 40)) {
+      std::cerr << name << ": " << seconds * 1e9 / ops << " ns/" << unit << std::endl;
+      return Result{name, unit, ops, seconds};
+    }
+    ops *= 2;
+  }
+}
+
+/*
+ * Camera rays of the demo scenes, one per pixel of a small image
+ */
+std::vector<rt::Ray> camera_rays(std::uint32_t width, std::uint32_t height) {
+  const auto cam = rt::scene_camera(static_cast<float>(width) / height);
+  rt::Sampler sampler{rt::Random{1}};
+  std::vector<rt::Ray> rays;
+  rays.reserve(static_cast<std::size_t>(width) * height);
+  for (auto j = 0U ; j < height ; ++j) {
+    for (auto i = 0U ; i < width ; ++i) {
+      rays.push_back(cam.ray((i + sampler.uniform()) / width, (j + sampler.uniform()) / height,
+                             sampler));
+    }
+  }
+  return rays;
+}
+
+Result bench_hit(const Settings& settings, const std::string& name,
+                 const rt::Hitable& world, const std::vector<rt::Ray>& rays) {
+  return measure(settings, name, "ray", [&](std::uint64_t n) {
+    rt::Hit rec;
+    auto hits = 0U;
+    for (std::uint64_t k = 0 ; k < n ; ++k) {
+      hits += world.hit(rays[k % rays.size()], rt::RAY_T_MIN, FLT_MAX, rec);
+    }
+    sink = static_cast<float>(hits);
+  });
+}
+
+/*
+ * Trace whole paths from camera rays with the path kernel, the generic one
+ * or one compiled for the world
+ */
+Result bench_path(const Settings& settings, const std::string& name, const rt::Hitable& world,
+                  const rt::MaterialTable& materials, const rt::PathKernel& kernel,
+                  const std::vector<rt::Ray>& rays) {
+  return measure(settings, name, "path", [&](std::uint64_t n) {
+    rt::PathSettings path;
+    path.materials = &materials;
+    path.background = true;
+    rt::Sampler sampler{rt::Random{1}};
+    auto sum = 0.0f;
+    for (std::uint64_t k = 0 ; k < n ; ++k) {
+      sum += kernel.color(rays[k % rays.size()], world, path, sampler).x();
+    }
+    sink = sum;
+  });
+}
+
+/*
+ * Build lists of spheres, on the heap or in an arena, and tear them down.
+ * Lists have 10000 spheres, the size of a large scene in this tracer
+ */
+Result bench_build(const Settings& settings, const std::string& name, bool in_arena,
+                   rt::MaterialId material) {
+  return measure(settings, name, "sphere", [&](std::uint64_t n) {
+    const std::uint64_t list_size = 10000;
+    for (std::uint64_t done = 0 ; done < n ; done += list_size) {
+      rt::Arena arena;
+      rt::HitableList::HitablePtr spheres;
+      for (auto k = done ; k < std::min(n, done + list_size) ; ++k) {
+        spheres.push_back(rt::make_object<rt::Sphere>(in_arena ? &arena : nullptr,
+                                                      rt::Vector3f{static_cast<float>(k), 0, 0},
+                                                      0.5f, material));
+      }
+      sink = static_cast<float>(spheres.size());
+    }
+  });
+}
+
+/*
+ * Scatter a ray coming down on a hit facing up
+ */
+template<bool(*Scatter)(const rt::MaterialRecord&, const rt::Ray&, const rt::Hit&,
+                        rt::Vector3f&, rt::Ray&, rt::Sampler&)>
+Result bench_scatter(const Settings& settings, const std::string& name,
+                     const rt::MaterialRecord& material) {
+  return measure(settings, name, "scatter", [&](std::uint64_t n) {
+    rt::Sampler sampler{rt::Random{1}};
+    const rt::Ray ray{rt::Vector3f{-1, 1, 0.5}, rt::Vector3f{1, -1, -0.5}};
+    rt::Hit hit;
+    hit.t = 1;
+    hit.p = rt::Vector3f{0, 0, 0};
+    hit.normal = rt::Vector3f{0, 1, 0};
+    hit.material = 0;
+    rt::Vector3f attenuation;
+    rt::Ray scattered;
+    auto sum = 0.0f;
+    for (std::uint64_t k = 0 ; k < n ; ++k) {
+      Scatter(material, ray, hit, attenuation, scattered, sampler);
+      sum += scattered.dir().x() + attenuation.x();
+    }
+    sink = sum;
+  });
+}
+
+/*
+ * Numbers of a sampler of the given kind, 8 dimensions per sample, as a
+ * path of two bounces takes
+ */
+Result bench_sampler(const Settings& settings, const std::string& name, rt::SamplerKind kind) {
+  return measure(settings, name, "number", [&](std::uint64_t n) {
+    rt::Sampler sampler{kind, 1, 3, 5, rt::Random{1}};
+    auto sum = 0.0f;
+    for (std::uint64_t k = 0 ; k < n ; ++k) {
+      if (k % 8 == 0) {
+        sampler.start_sample(static_cast<std::uint32_t>(k / 8));
+      }
+      sum += sampler.uniform();
+    }
+    sink = sum;
+  });
+}
+
+/*
+ * Noisy gradient, about as compressible as a path traced image
+ */
+std::vector<std::uint8_t> test_image(std::uint32_t width, std::uint32_t height) {
+  rt::Random rng{1};
+  std::vector<std::uint8_t> image(static_cast<std::size_t>(width) * height * 3);
+  for (auto j = 0U ; j < height ; ++j) {
+    for (auto i = 0U ; i < width ; ++i) {
+      const auto base = (static_cast<std::size_t>(j) * width + i) * 3;
+      const auto noise = static_cast<int>(rng.uniform() * 16);
+      image[base] = static_cast<std::uint8_t>(i * 200 / width + noise);
+      image[base + 1] = static_cast<std::uint8_t>(j * 200 / height + noise);
+      image[base + 2] = static_cast<std::uint8_t>(128 + noise);
+    }
+  }
+  return image;
+}
+
+Result bench_writer(const Settings& settings, const std::string& name,
+                    const rt::FileWriter& writer, const std::vector<std::uint8_t>& image) {
+  return measure(settings, name, "image", [&](std::uint64_t n) {
+    for (std::uint64_t k = 0 ; k < n ; ++k) {
+      writer.write(image, settings.width, settings.height);
+    }
+  });
+}
+
+/*
+ * 1, 2, 4... up to max_threads, which is always the last point
+ */
+std::vector<unsigned> thread_counts(unsigned max_threads) {
+  std::vector<unsigned> counts;
+  for (auto t = 1U ; t < max_threads ; t *= 2) {
+    counts.push_back(t);
+  }
+  counts.push_back(max_threads);
+  return counts;
+}
+
+std::vector<ScalingPoint> bench_render(const Settings& settings, const std::string& name,
+                                       const rt::Hitable& world,
+                                       const rt::MaterialTable& materials, bool background) {
+  const auto cam = rt::scene_camera(static_cast<float>(settings.width) / settings.height);
+  const auto filepath = name + ".ppm";
+  const auto samples = static_cast<std::uint64_t>(settings.width) * settings.height * settings.spp;
+
+  std::vector<ScalingPoint> points;
+  for (const auto threads : thread_counts(settings.max_threads)) {
+    rt::RenderOptions options;
+    options.background = background;
+    options.threads = threads;
+    const auto start = Clock::now();
+    rt::render(settings.width, settings.height, world, materials, cam, settings.spp, filepath,
+               options);
+    const auto seconds = elapsed(start);
+    std::cerr << name << " " << threads << " threads: " << seconds << " s" << std::endl;
+    points.push_back(ScalingPoint{name, threads, samples, seconds});
+  }
+  std::remove(filepath.c_str());
+  return points;
+}
+
+void write_json(std::FILE* out, const Settings& settings,
+                const std::vector<Result>& results,
+                const std::vector<ScalingPoint>& scaling) {
+  std::fprintf(out, "{\n  \"context\": {\"hardware_threads\": %u, \"width\": %u, "
+               "\"height\": %u, \"spp\": %u},\n",
+               std::thread::hardware_concurrency(), settings.width, settings.height,
+               settings.spp);
+
+  std::fprintf(out, "  \"benchmarks\": [");
+  for (std::size_t k = 0 ; k < results.size() ; ++k) {
+    const auto& r = results[k];
+    std::fprintf(out, "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, "
+                 "\"seconds\": %.6g, \"ns_per_op\": %.6g, \"ops_per_sec\": %.6g}",
+                 k == 0 ? "" : ",", r.name.c_str(), r.unit.c_str(),
+                 static_cast<unsigned long long>(r.ops), r.seconds,
+                 r.seconds * 1e9 / r.ops, r.ops / r.seconds);
+  }
+  std::fprintf(out, "\n  ],\n");
+
+  // Speedups are relative to the single thread point of the same curve
+  std::fprintf(out, "  \"scaling\": [");
+  double base = 0;
+  for (std::size_t k = 0 ; k < scaling.size() ; ++k) {
+    const auto& p = scaling[k];
+    if (p.threads == 1) {
+      base = p.seconds;
+    }
+    const auto speedup = base / p.seconds;
+    std::fprintf(out, "%s\n    {\"name\": \"%s\", \"threads\": %u, \"seconds\": %.6g, "
+                 "\"samples_per_sec\": %.6g, \"speedup\": %.4g, \"efficiency\": %.4g}",
+                 k == 0 ? "" : ",", p.name.c_str(), p.threads, p.seconds,
+                 p.samples / p.seconds, speedup, speedup / p.threads);
+  }
+  std::fprintf(out, "\n  ]\n}\n");
+}
+
+} // Unnamed namespace
+
+int main(int argc, char** argv) {
+  Settings settings;
+  for (auto i = 1; i < argc; ++i) {
+    const std::string arg{argv[i]};
+    if (arg == "--output" && i + 1 < argc) {
+      settings.output = argv[++i];
+    } else if (arg == "--filter" && i + 1 < argc) {
+      settings.filter = argv[++i];
+    } else if (arg == "--min-time" && i + 1 < argc) {
+      settings.min_time = std::stod(argv[++i]);
+    } else if (arg == "--size" && i + 2 < argc) {
+      settings.width = static_cast<std::uint32_t>(std::stoul(argv[++i]));
+      settings.height = static_cast<std::uint32_t>(std::stoul(argv[++i]));
+    } else if (arg == "--spp" && i + 1 < argc) {
+      settings.spp = static_cast<unsigned>(std::stoul(argv[++i]));
+    } else if (arg == "--threads" && i + 1 < argc) {
+      settings.max_threads = std::max(static_cast<unsigned>(std::stoul(argv[++i])), 1U);
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--output FILE] [--filter NAME]"
+		<< " [--min-time SECONDS] [--size W H] [--spp N] [--threads MAX]"
+		<< std::endl;
+      return 1;
+    }
+  }
+  const auto selected = [&](const std::string& name) {
+    return name.find(settings.filter) != std::string::npos;
+  };
+
+  // Both scenes, built once. The registries own their textures and materials
+  rt::TextureRegistry textures{};
+  rt::MaterialRegistry materials{};
+  rt::Random rng{0};
+  auto lights_objects = rt::lights_scene(materials, textures);
+  auto random_objects = rt::random_scene(materials, textures, rng);
+  const auto random_set = rt::make_sphere_set(random_objects, true);
+  const rt::BVH lights{std::move(lights_objects)};
+  const rt::HitableList random_list{std::move(random_objects)};
+  // The BVH takes its objects too, so it gets a second copy of the scene
+  rt::TextureRegistry random_textures{};
+  rt::MaterialRegistry random_materials{};
+  rt::Random random_rng{0};
+  const rt::BVH random_bvh{rt::random_scene(random_materials, random_textures, random_rng)};
+  // And a list of it whose spheres are packed in an arena
+  rt::Arena arena;
+  rt::TextureRegistry arena_textures{&arena};
+  rt::MaterialRegistry arena_materials{};
+  rt::Random arena_rng{0};
+  const rt::HitableList arena_list{
+    rt::random_scene(arena_materials, arena_textures, arena_rng, &arena)};
+
+  std::vector<Result> results;
+  std::vector<ScalingPoint> scaling;
+  const auto rays = camera_rays(64, 32);
+
+  if (selected("sphere_hit")) {
+    const rt::Sphere sphere{rt::Vector3f{0, 0, -1}, 0.5, materials.get("ballsalmon")};
+    results.push_back(bench_hit(settings, "sphere_hit", sphere, rays));
+  }
+  if (selected("list_hit")) {
+    results.push_back(bench_hit(settings, "list_hit", random_list, rays));
+  }
+  if (selected("list_hit_arena")) {
+    results.push_back(bench_hit(settings, "list_hit_arena", arena_list, rays));
+  }
+  if (selected("bvh_hit")) {
+    results.push_back(bench_hit(settings, "bvh_hit", random_bvh, rays));
+  }
+  if (selected("sphere_set_hit")) {
+    results.push_back(bench_hit(settings, "sphere_set_hit", *random_set, rays));
+  }
+
+  if (selected("build_heap")) {
+    results.push_back(bench_build(settings, "build_heap", false, materials.get("ballsalmon")));
+  }
+  if (selected("build_arena")) {
+    results.push_back(bench_build(settings, "build_arena", true, materials.get("ballsalmon")));
+  }
+
+  if (selected("path_bvh")) {
+    results.push_back(bench_path(settings, "path_bvh", random_bvh, random_materials.table(),
+                                 rt::PathKernel{}, rays));
+  }
+  if (selected("path_bvh_static")) {
+    results.push_back(bench_path(settings, "path_bvh_static", random_bvh, random_materials.table(),
+                                 rt::static_path_kernel<rt::BVH, true, 50>(), rays));
+  }
+  if (selected("path_sphere_set")) {
+    results.push_back(bench_path(settings, "path_sphere_set", *random_set, materials.table(),
+                                 rt::PathKernel{}, rays));
+  }
+  if (selected("path_sphere_set_static")) {
+    results.push_back(bench_path(settings, "path_sphere_set_static", *random_set, materials.table(),
+                                 rt::static_path_kernel<rt::SphereSet, true, 50>(), rays));
+  }
+
+  const auto& table = materials.table();
+  if (selected("scatter_lambertian")) {
+    results.push_back(bench_scatter<rt::scatter_lambertian>(
+        settings, "scatter_lambertian", table[materials.get("ballsalmon")]));
+  }
+  if (selected("scatter_lambertian_checker")) {
+    results.push_back(bench_scatter<rt::scatter_lambertian>(
+        settings, "scatter_lambertian_checker", table[materials.get("floor")]));
+  }
+  if (selected("scatter_metal")) {
+    results.push_back(bench_scatter<rt::scatter_metal>(
+        settings, "scatter_metal", table[materials.get("mirror")]));
+  }
+  if (selected("scatter_dielectric")) {
+    results.push_back(bench_scatter<rt::scatter_dielectric>(
+        settings, "scatter_dielectric", table[materials.get("transparent")]));
+  }
+
+  if (selected("random_in_unit_sphere")) {
+    results.push_back(measure(settings, "random_in_unit_sphere", "sample", [&](std::uint64_t n) {
+      rt::Random rng{1};
+      auto sum = 0.0f;
+      for (std::uint64_t k = 0 ; k < n ; ++k) {
+        sum += rt::random_in_unit_sphere(rng).x();
+      }
+      sink = sum;
+    }));
+  }
+  if (selected("random_in_unit_disk")) {
+    results.push_back(measure(settings, "random_in_unit_disk", "sample", [&](std::uint64_t n) {
+      rt::Random rng{1};
+      auto sum = 0.0f;
+      for (std::uint64_t k = 0 ; k < n ; ++k) {
+        sum += rt::random_in_unit_disk(rng).x();
+      }
+      sink = sum;
+    }));
+  }
+  if (selected("sampler_random")) {
+    results.push_back(bench_sampler(settings, "sampler_random", rt::SamplerKind::Random));
+  }
+  if (selected("sampler_halton")) {
+    results.push_back(bench_sampler(settings, "sampler_halton", rt::SamplerKind::Halton));
+  }
+  if (selected("sampler_sobol")) {
+    results.push_back(bench_sampler(settings, "sampler_sobol", rt::SamplerKind::Sobol));
+  }
+  if (selected("sampler_blue_noise")) {
+    results.push_back(bench_sampler(settings, "sampler_blue_noise", rt::SamplerKind::BlueNoise));
+  }
+  // Normalize the camera ray directions, one after the other
+  if (selected("unit_vector")) {
+    results.push_back(measure(settings, "unit_vector", "vector", [&](std::uint64_t n) {
+      auto sum = 0.0f;
+      for (std::uint64_t k = 0 ; k < n ; ++k) {
+        sum += rt::unit_vector(rays[k % rays.size()].dir()).x();
+      }
+      sink = sum;
+    }));
+  }
+  if (selected("unit_vector_fast")) {
+    results.push_back(measure(settings, "unit_vector_fast", "vector", [&](std::uint64_t n) {
+      auto sum = 0.0f;
+      for (std::uint64_t k = 0 ; k < n ; ++k) {
+        sum += rt::unit_vector_fast(rays[k % rays.size()].dir()).x();
+      }
+      sink = sum;
+    }));
+  }
+
+  const auto image = test_image(settings.width, settings.height);
+  const std::string ppm_path{"rt_bench.ppm"};
+  const std::string png_path{"rt_bench.png"};
+  if (selected("ppm_write")) {
+    results.push_back(bench_writer(settings, "ppm_write", rt::PPMWriter{ppm_path}, image));
+  }
+  for (const auto threads : thread_counts(settings.max_threads)) {
+    const auto name = "png_write_" + std::to_string(threads) + "t";
+    if (selected(name)) {
+      rt::PNGOptions options;
+      options.threads = threads;
+      results.push_back(bench_writer(settings, name, rt::PNGWriter{png_path, options}, image));
+    }
+  }
+  std::remove(ppm_path.c_str());
+  std::remove(png_path.c_str());
+
+  if (selected("render_lights")) {
+    const auto points = bench_render(settings, "render_lights", lights, materials.table(), false);
+    scaling.insert(scaling.end(), points.begin(), points.end());
+  }
+  if (selected("render_random")) {
+    const auto points = bench_render(settings, "render_random", random_bvh, random_materials.table(),
+                                     true);
+    scaling.insert(scaling.end(), points.begin(), points.end());
+  }
+
+  if (settings.output.empty()) {
+    write_json(stdout, settings, results, scaling);
+  } else {
+    auto* out = std::fopen(settings.output.c_str(), "w");
+    if (out == nullptr) {
+      std::cerr << "Cannot write " << settings.output << std::endl;
+      return 1;
+    }
+    write_json(out, settings, results, scaling);
+    std::fclose(out);
+  }
+}
@@ -1,129 +1,384 @@
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
+#include <initializer_list>
 #include <iostream>
-#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include <bvh.hpp>
+#include <distributed.hpp>
 #include <hitable_list.hpp>
 #include <render.hpp>
-#include <camera.hpp>
-#include <vector.hpp>
-#include <sphere.hpp>
-#include <material.hpp>
-
-rt::HitableList random_world(rt::MaterialRegistry& materials,
-			     rt::TextureRegistry& textures) {
-  rt::HitableList::HitablePtr world_vector;
-  textures.register_texture<rt::CheckerTexture>("checker",
-						rt::Vector3f{0.2, 0.3, 0.1},
-						rt::Vector3f{0.9, 0.9, 0.9});
-
-  materials.register_lambertian("floor", textures.get("checker"));
-  // Floor
-  world_vector.push_back(std::make_unique<rt::Sphere>(rt::Vector3f{0, -1000, 0}, 1000.f,
-						      materials.get("floor")));
-
-  auto dis = std::uniform_real_distribution<float>{0.0, 1.0};
-  std::random_device device;
-
-  for(auto a = -11 ; a < 11 ; ++a) {
-    for(auto b= -11 ; b < 11 ; ++b) {
-      float choose_mat = dis(device);
-      rt::Vector3f center{a + 0.9f * dis(device), 0.2, b + 0.9f * dis(device)};
-
-      rt::Vector3f reference{4, 0.2, 0};
-      if ((center - reference).norm2() > 0.9) {
-	if (choose_mat < 0.8) {
-	  world_vector.push_back(
-	      std::make_unique<rt::Sphere>(center,
-					   0.2f,
-					   materials.generate_lambertial(textures)));
-	} else if (choose_mat < 0.95) {
-	  world_vector.push_back(
-	      std::make_unique<rt::Sphere>(center,
-					   0.2f,
-					   materials.generate_metal()));
-	} else {
-	  world_vector.push_back(
-	      std::make_unique<rt::Sphere>(center,
-					   0.2f,
-					   materials.generate_dielectric()));
-	}
-      }
+#include <random.hpp>
+#include <scene_file.hpp>
+#include <scenes.hpp>
+#include <stats.hpp>
+
+/*
+ * Set value to the choice named name
+ *
+ * \return false if no choice has that name
+ */
+template<typename T>
+bool parse_choice(const std::string& name,
+		  std::initializer_list<std::pair<const char*, T>> choices, T& value) {
+  for (const auto& choice : choices) {
+    if (name == choice.first) {
+      value = choice.second;
+      return true;
     }
   }
+  return false;
+}
 
-  world_vector.push_back(
-      std::make_unique<rt::Sphere>(rt::Vector3f{0, 1, 0},
-				   1.0f,
-				   materials.generate_dielectric()));
-  world_vector.push_back(
-      std::make_unique<rt::Sphere>(rt::Vector3f{-4, 1, 0},
-				   1.0f,
-				   materials.generate_lambertial(textures)));
-  world_vector.push_back(
-      std::make_unique<rt::Sphere>(rt::Vector3f{4, 1, 0},
-				   1.0f,
-				   materials.generate_metal()));
-
-  return rt::HitableList{std::move(world_vector)};
+/*
+ * Print the options, and return the exit status of a bad command line
+ */
+int usage(const char* program) {
+  std::cerr << "Usage: " << program << " [--seed N]"
+	    << " [--sampler random|halton|sobol|blue-noise] [--accel list|bvh|simd|simd-bvh]"
+	    << " [--packet 1|4|8|16]"
+	    << " [--tile N] [--threads N] [--backend omp|threads]"
+	    << " [--adaptive MIN_SPP MAX_SPP THRESHOLD]"
+	    << " [--spp N] [--scene all|lights|random]"
+	    << " [--progressive PASS_SPP] [--checkpoint SECONDS] [--resume]"
+	    << " [--depth MAX_DEPTH RR_DEPTH] [--light-sampling] [--engine path|wavefront]"
+	    << " [--wavefront-size PATHS] [--save-scene FILE] [--load-scene FILE]"
+	    << " [--size WIDTH HEIGHT] [--band ROWS] [--format png|ppm|pfm|exr] [--half]"
+	    << " [--denoise] [--aov normal|albedo|depth|material|samples]..."
+	    << " [--png-level 0-9] [--png-filter none|sub|up|average|paeth|adaptive]"
+	    << " [--stats] [--heatmap]"
+	    << " [--coordinator ADDRESS [--region N] [--region-timeout SECONDS]]"
+	    << " [--worker ADDRESS] [--batch FILE]"
+	    << std::endl;
+  return 1;
+}
+
+/*
+ * Wrap the objects in the requested acceleration structure
+ */
+std::unique_ptr<rt::Hitable> make_world(rt::HitableList::HitablePtr&& objects,
+					const std::string& accel) {
+  if (accel == "list") {
+    return std::make_unique<rt::HitableList>(std::move(objects));
+  }
+  if (accel == "simd" || accel == "simd-bvh") {
+    return rt::make_sphere_set(objects, accel == "simd-bvh");
+  }
+  return std::make_unique<rt::BVH>(std::move(objects));
+}
+
+/*
+ * Read the jobs of a batch file, one image per line:
+ *
+ *     OUTPUT WIDTH HEIGHT SPP FROM_X FROM_Y FROM_Z AT_X AT_Y AT_Z [VFOV [APERTURE [FOCUS]]]
+ *
+ * The camera looks from FROM to AT, with the field of view, aperture and
+ * focus distance of the demo camera unless given. Empty lines and lines
+ * starting with # are skipped
+ */
+std::vector<rt::RenderJob> load_jobs(const std::string& path) {
+  std::ifstream in{path};
+  if (!in) {
+    throw std::runtime_error{"Cannot read " + path};
+  }
+  std::vector<rt::RenderJob> jobs;
+  std::string line;
+  for (auto number = 1 ; std::getline(in, line) ; ++number) {
+    std::istringstream fields{line};
+    std::string output;
+    if (!(fields >> output) || output[0] == '#') {
+      continue;
+    }
+    std::uint32_t width, height, spp;
+    float from[3], at[3];
+    float vfov = 20, aperture = 0.1f, focus = 5;
+    if (!(fields >> width >> height >> spp >> from[0] >> from[1] >> from[2]
+	  >> at[0] >> at[1] >> at[2]) || width == 0 || height == 0 || spp == 0 ||
+	spp > UINT16_MAX) {
+      throw std::runtime_error{path + ":" + std::to_string(number) + ": invalid job"};
+    }
+    fields >> vfov >> aperture >> focus;
+    const rt::Camera cam{rt::Vector3f{from[0], from[1], from[2]},
+			 rt::Vector3f{at[0], at[1], at[2]}, rt::Vector3f{0, 1, 0},
+			 vfov, static_cast<float>(width) / height, aperture, focus};
+    jobs.push_back(rt::RenderJob{cam, width, height, static_cast<std::uint16_t>(spp), output});
+  }
+  return jobs;
 }
 
 int main(int argc, char** argv) {
   std::cout << "Ray tracing spheres" << std::endl;
 
-  // Texture registry
-  rt::TextureRegistry textures{};
-  textures.register_texture<rt::ConstantTexture>("green", rt::Vector3f{0.8, 0.8, 0});
-  textures.register_texture<rt::ConstantTexture>("salmon", rt::Vector3f{0.8, 0.3, 0.3});
+  rt::RenderOptions options;
+  std::string accel{"bvh"};
+  std::string scenes{"all"};
+  auto anti_alias_passes = 10U;
+  auto checkpoint = false;
+  auto stats = false;
+  auto heatmap = false;
+  std::string worker;
+  rt::DistributedOptions distributed;
+  std::string save_scene;
+  std::string format{"png"};
+  auto width = 800U;
+  auto height = 400U;
+  std::string load_scene;
+  std::string batch;
+  for (auto i = 1; i < argc; ++i) {
+    const std::string arg{argv[i]};
+    if (arg == "--seed" && i + 1 < argc) {
+      options.seed = std::stoull(argv[++i]);
+    } else if (arg == "--sampler" && i + 1 < argc) {
+      if (!parse_choice<rt::SamplerKind>(argv[++i], {{"random", rt::SamplerKind::Random},
+						     {"halton", rt::SamplerKind::Halton},
+						     {"sobol", rt::SamplerKind::Sobol},
+						     {"blue-noise", rt::SamplerKind::BlueNoise}},
+					 options.sampler)) {
+	return usage(argv[0]);
+      }
+    } else if (arg == "--accel" && i + 1 < argc) {
+      if (!parse_choice<std::string>(argv[++i], {{"list", "list"}, {"bvh", "bvh"},
+						 {"simd", "simd"}, {"simd-bvh", "simd-bvh"}},
+				     accel)) {
+	return usage(argv[0]);
+      }
+    } else if (arg == "--packet" && i + 1 < argc) {
+      options.packet_size = std::stoul(argv[++i]);
+    } else if (arg == "--tile" && i + 1 < argc) {
+      options.tile_size = std::stoul(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      options.threads = std::stoul(argv[++i]);
+    } else if (arg == "--backend" && i + 1 < argc) {
+      if (!parse_choice<rt::Backend>(argv[++i], {{"omp", rt::Backend::OpenMP},
+						 {"threads", rt::Backend::Threads}},
+				     options.backend)) {
+	return usage(argv[0]);
+      }
+    } else if (arg == "--adaptive" && i + 3 < argc) {
+      options.adaptive = true;
+      options.min_spp = std::stoul(argv[++i]);
+      options.max_spp = std::stoul(argv[++i]);
+      options.threshold = std::stof(argv[++i]);
+    } else if (arg == "--spp" && i + 1 < argc) {
+      anti_alias_passes = std::stoul(argv[++i]);
+    } else if (arg == "--scene" && i + 1 < argc) {
+      if (!parse_choice<std::string>(argv[++i], {{"all", "all"}, {"lights", "lights"},
+						 {"random", "random"}},
+				     scenes)) {
+	return usage(argv[0]);
+      }
+    } else if (arg == "--progressive" && i + 1 < argc) {
+      options.progressive = true;
+      options.pass_spp = std::stoul(argv[++i]);
+    } else if (arg == "--checkpoint" && i + 1 < argc) {
+      checkpoint = true;
+      options.checkpoint_interval = std::stof(argv[++i]);
+    } else if (arg == "--resume") {
+      options.resume = true;
+    } else if (arg == "--engine" && i + 1 < argc) {
+      if (!parse_choice<rt::Engine>(argv[++i], {{"path", rt::Engine::Path},
+						{"wavefront", rt::Engine::Wavefront}},
+				    options.engine)) {
+	return usage(argv[0]);
+      }
+    } else if (arg == "--wavefront-size" && i + 1 < argc) {
+      options.wavefront_size = std::stoul(argv[++i]);
+    } else if (arg == "--save-scene" && i + 1 < argc) {
+      save_scene = argv[++i];
+    } else if (arg == "--load-scene" && i + 1 < argc) {
+      load_scene = argv[++i];
+    } else if (arg == "--size" && i + 2 < argc) {
+      width = std::stoul(argv[++i]);
+      height = std::stoul(argv[++i]);
+    } else if (arg == "--format" && i + 1 < argc) {
+      if (!parse_choice<std::string>(argv[++i], {{"png", "png"}, {"ppm", "ppm"}, {"pfm", "pfm"},
+						 {"exr", "exr"}},
+				     format)) {
+	return usage(argv[0]);
+      }
+    } else if (arg == "--png-level" && i + 1 < argc) {
+      options.png.level = std::stoi(argv[++i]);
+    } else if (arg == "--png-filter" && i + 1 < argc) {
+      if (!parse_choice<rt::PNGFilter>(argv[++i], {{"none", rt::PNGFilter::None},
+						   {"sub", rt::PNGFilter::Sub},
+						   {"up", rt::PNGFilter::Up},
+						   {"average", rt::PNGFilter::Average},
+						   {"paeth", rt::PNGFilter::Paeth},
+						   {"adaptive", rt::PNGFilter::Adaptive}},
+				       options.png.filter)) {
+	return usage(argv[0]);
+      }
+    } else if (arg == "--denoise") {
+      options.denoise = true;
+    } else if (arg == "--aov" && i + 1 < argc) {
+      const std::string aov{argv[++i]};
+      auto k = 0U;
+      while (k < rt::AOV_KINDS && aov != rt::aov_name(static_cast<rt::AOV>(k))) {
+	++k;
+      }
+      if (k == rt::AOV_KINDS) {
+	return usage(argv[0]);
+      }
+      options.aovs.push_back(static_cast<rt::AOV>(k));
+    } else if (arg == "--half") {
+      options.half_float = true;
+    } else if (arg == "--band" && i + 1 < argc) {
+      options.band_rows = std::stoul(argv[++i]);
+    } else if (arg == "--light-sampling") {
+      options.light_sampling = true;
+    } else if (arg == "--depth" && i + 2 < argc) {
+      options.max_depth = std::stoi(argv[++i]);
+      options.rr_depth = std::stoi(argv[++i]);
+    } else if (arg == "--worker" && i + 1 < argc) {
+      worker = argv[++i];
+    } else if (arg == "--coordinator" && i + 1 < argc) {
+      distributed.address = argv[++i];
+    } else if (arg == "--region" && i + 1 < argc) {
+      distributed.region_size = std::stoul(argv[++i]);
+    } else if (arg == "--region-timeout" && i + 1 < argc) {
+      distributed.region_timeout = std::stof(argv[++i]);
+    } else if (arg == "--batch" && i + 1 < argc) {
+      batch = argv[++i];
+    } else if (arg == "--stats") {
+      stats = true;
+    } else if (arg == "--heatmap") {
+      heatmap = true;
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if ((stats || heatmap) && !rt::stats_enabled()) {
+    std::cerr << "--stats and --heatmap need a build with USE_STATS" << std::endl;
+    return 1;
+  }
+  if (options.packet_size != 1 && options.packet_size != 4 && options.packet_size != 8 &&
+      options.packet_size != 16) {
+    std::cerr << "--packet must be 1, 4, 8 or 16" << std::endl;
+    return 1;
+  }
+  // Sample counts are 16 bit
+  if (anti_alias_passes == 0 || anti_alias_passes > UINT16_MAX) {
+    std::cerr << "--spp must be between 1 and " << UINT16_MAX << std::endl;
+    return 1;
+  }
+
+  // Workers get everything else from the coordinator, and serve it until it
+  // has been gone for a while
+  if (!worker.empty()) {
+    try {
+      while (rt::run_worker(worker, options.threads)) {
+      }
+    } catch (const std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+  // Workers are sent the scene as a scene file, which holds a SphereSet
+  if (!distributed.address.empty()) {
+    accel = "simd-bvh";
+  }
 
-  // Register materials in the materials registry
+  // Spheres and textures are packed in one arena, freed at exit after every
+  // world that uses them
+  rt::Arena arena;
+  rt::TextureRegistry textures{&arena};
   rt::MaterialRegistry materials{};
-  materials.register_lambertian("ballgreen", textures.get("green"));
-  materials.register_lambertian("ballsalmon", textures.get("salmon"));
-  materials.register_metal("mirror", {0.8, 1, 0.5});
-  materials.register_metal("perfectmirror", {0.5, 0.5, 0.5});
-  materials.register_dielectric("transparent", 1.5);
-  materials.register_light("light", {2,2,2});
 
-  // Populate a world with Spheres
-  rt::HitableList::HitablePtr worldVector;
-  worldVector.push_back(std::make_unique<rt::Sphere>(rt::Vector3f{0.5, 2, -1}, 1,
-						     materials.get("light")));
+  // The random scene is generated from the same seed, so it is reproducible
+  // too. A scene file comes with its own materials, which random_materials
+  // points to, the registry's otherwise
+  const rt::MaterialTable* random_materials = &materials.table();
+  auto random_world = [&]() -> std::unique_ptr<rt::Hitable> {
+    if (!load_scene.empty()) {
+      auto scene = std::make_unique<rt::MappedScene>(load_scene);
+      random_materials = &scene->materials();
+      return scene;
+    }
+    rt::Random rng{options.seed};
+    auto objects = rt::random_scene(materials, textures, rng, &arena);
+    if (!save_scene.empty()) {
+      // Scene files hold a SphereSet, with its BVH unless a flat set is asked for
+      rt::save_scene(save_scene, *rt::make_sphere_set(objects, accel != "simd"),
+		     materials.table());
+    }
+    return make_world(std::move(objects), accel);
+  };
 
-  worldVector.push_back(std::make_unique<rt::Sphere>(rt::Vector3f{-1, 1.5, -1}, 0.5,
-						     materials.get("light")));
+  // Batches render every view of one world: the lights scene if asked for,
+  // the random one otherwise
+  if (!batch.empty()) {
+    std::vector<rt::RenderJob> jobs;
+    try {
+      jobs = load_jobs(batch);
+    } catch (const std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    try {
+      if (scenes == "lights") {
+	rt::render_batch(*make_world(rt::lights_scene(materials, textures, &arena), accel),
+			 materials.table(), jobs, options);
+      } else {
+	options.background = true;
+	const auto world = random_world();
+	rt::render_batch(*world, *random_materials, jobs, options);
+      }
+    } catch (const std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
 
-  worldVector.push_back(std::make_unique<rt::Sphere>(rt::Vector3f{0, 0, -1}, 0.5,
-						     materials.get("ballsalmon")));
+  const auto world = make_world(rt::lights_scene(materials, textures, &arena), accel);
 
-  worldVector.push_back(std::make_unique<rt::Sphere>(rt::Vector3f{1, 0, -1}, 0.25,
-						     materials.get("perfectmirror")));
+  // Render the world
+  const auto cam = rt::scene_camera(static_cast<float>(width) / height);
 
-  worldVector.push_back(std::make_unique<rt::Sphere>(rt::Vector3f{-1, 0.0, -1}, 0.5,
-						     materials.get("transparent")));
-  worldVector.push_back(std::make_unique<rt::Sphere>(rt::Vector3f{-1, 0.0, -1}, -0.45,
-						     materials.get("transparent")));
+  // Checkpoints, reports and heatmaps are named after the image they belong
+  // to. scene_file is the file the world was loaded from, if any
+  auto render = [&](const rt::Hitable& world, const rt::MaterialTable& world_materials,
+		    const std::string& filepath, const std::string& scene_file) {
+    const auto stem = filepath.substr(0, filepath.rfind('.'));
+    options.checkpoint = checkpoint ? filepath + ".ckpt" : "";
+    options.stats = stats ? stem + "_stats.json" : "";
+    options.heatmap = heatmap ? stem + "_heatmap.png" : "";
+    if (distributed.address.empty()) {
+      rt::render(width, height, world, world_materials, cam, anti_alias_passes, filepath,
+		 options);
+      return;
+    }
 
-  worldVector.push_back(std::make_unique<rt::Sphere>(rt::Vector3f{0, -100.5, -1}, 100,
-						     materials.get("ballgreen")));
+    auto scene = scene_file;
+    if (scene.empty()) {
+      scene = filepath + ".scene";
+      rt::save_scene(scene, dynamic_cast<const rt::SphereSet&>(world), world_materials);
+    }
+    rt::render_distributed(width, height, scene, cam, anti_alias_passes, filepath, options,
+			   distributed);
+    if (scene != scene_file) {
+      std::remove(scene.c_str());
+    }
+  };
 
-  const rt::HitableList world{std::move(worldVector)};
+  try {
+    if (scenes != "random") {
+      render(*world, materials.table(), "image." + format, "");
+    }
 
-  // Render the world
-  const rt::Vector3f lookfrom(0,2,4);
-  const rt::Vector3f lookat(0,0.40,0);
-  const float dist_to_focus{5.0f};
-  const float aperture{0.1f};
-  const rt::Vector3f vertical{0, 1, 0};
-
-  const auto width = 800U;
-  const auto height = 400U;
-  const auto ratio = static_cast<float>(width) / height;
-
-  const rt::Camera cam(lookfrom, lookat, vertical, 20, ratio,
-		       aperture, dist_to_focus);
-
-  const auto anti_alias_passes = 10U;
-  rt::render(width, height, world, cam, anti_alias_passes, "image.png");
-  rt::render(800, 400, random_world(materials, textures), cam,
-  	     anti_alias_passes, "image_scene.png", true);
+    if (scenes != "lights") {
+      options.background = true;
+      const auto random = random_world();
+      render(*random, *random_materials, "image_scene." + format, load_scene);
+    }
+  } catch (const std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
 }
@@ -0,0 +1,58 @@
+#ifndef AABB_HPP
+#define AABB_HPP
+
+#include <cfloat>
+
+#include <vector.hpp>
+
+namespace rt {
+
+/*!
+ * \brief Axis aligned bounding box
+ *
+ * A default constructed box is empty (inverted), so growing it by any point or
+ * box yields exactly that point or box.
+ */
+struct AABB {
+  AABB() : lower{FLT_MAX, FLT_MAX, FLT_MAX}, upper{-FLT_MAX, -FLT_MAX, -FLT_MAX} {}
+  AABB(const Vector3f& lo, const Vector3f& hi) : lower{lo}, upper{hi} {}
+
+  void grow(const Vector3f& p) {
+    for (auto i = 0 ; i < 3 ; ++i) {
+      lower[i] = fminf(lower[i], p[i]);
+      upper[i] = fmaxf(upper[i], p[i]);
+    }
+  }
+
+  void grow(const AABB& box) {
+    if (box.empty()) {
+      return;
+    }
+    grow(box.lower);
+    grow(box.upper);
+  }
+
+  bool empty() const {
+    return lower.x() > upper.x() || lower.y() > upper.y() || lower.z() > upper.z();
+  }
+
+  Vector3f centroid() const { return 0.5f * (lower + upper); }
+
+  /*!
+   * \brief Area of the box surface. Zero for empty boxes
+   */
+  float surface_area() const {
+    if (empty()) {
+      return 0;
+    }
+    const auto d = upper - lower;
+    return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+  }
+
+  Vector3f lower;
+  Vector3f upper;
+};
+
+} // namespace rt
+
+#endif // AABB_HPP
@@ -0,0 +1,53 @@
+#ifndef ALIGNED_ALLOCATOR_HPP
+#define ALIGNED_ALLOCATOR_HPP
+
+#include <cstdlib>
+#include <new>
+
+namespace rt {
+
+/*!
+ * \brief std::vector compatible allocator returning \p Alignment aligned memory
+ *
+ * Used for the structure of arrays storage that SIMD kernels load from
+ */
+template<typename T, std::size_t Alignment>
+struct AlignedAllocator {
+  using value_type = T;
+
+  template<typename U>
+  struct rebind {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+
+  AlignedAllocator() = default;
+
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>& /* other */) {}
+
+  T* allocate(std::size_t n) {
+    void* p = nullptr;
+    if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) {
+      throw std::bad_alloc{};
+    }
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, std::size_t /* n */) {
+    free(p);
+  }
+};
+
+template<typename T, typename U, std::size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) {
+  return true;
+}
+
+template<typename T, typename U, std::size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) {
+  return false;
+}
+
+} // namespace rt
+
+#endif // ALIGNED_ALLOCATOR_HPP
@@ -0,0 +1,128 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rt {
+
+/*!
+ * \brief Deleter of objects that may live in an Arena
+ *
+ * Heap objects are deleted, objects of an arena are left to it. It converts
+ * from std::default_delete, so the std::unique_ptr of std::make_unique can
+ * be stored in an ArenaPtr.
+ */
+struct ArenaDeleter {
+  ArenaDeleter() = default;
+  explicit ArenaDeleter(bool in_arena) : in_arena{in_arena} {}
+
+  template<typename U>
+  ArenaDeleter(const std::default_delete<U>& /* heap */) {}
+
+  template<typename T>
+  void operator()(T* p) const {
+    if (!in_arena) {
+      delete p;
+    }
+  }
+
+  bool in_arena = false;
+};
+
+template<typename T>
+using ArenaPtr = std::unique_ptr<T, ArenaDeleter>;
+
+/*!
+ * \brief Bump allocator that places objects one after the other in large
+ *        blocks, and destroys them all at once
+ *
+ * Blocks are aligned to cache lines and objects are packed in them with
+ * their natural alignment, so objects built one after the other (the
+ * spheres of a scene for instance) end up next to each other in memory,
+ * without the headers and scattering of heap allocations. Building an object
+ * costs a pointer bump, and the arena frees a whole block at a time instead
+ * of one object at a time.
+ *
+ * Objects are destroyed in the reverse order of their creation with the
+ * arena, which must outlive any pointer to them. An arena is not thread
+ * safe: scenes are built by one thread.
+ */
+class Arena {
+ public:
+  //! Alignment of the blocks, and the largest one objects can ask for
+  static constexpr std::size_t ALIGNMENT = 64;
+
+  /*!
+   * \param block_size Bytes of the blocks. Larger objects get a block of
+   *        their own
+   */
+  explicit Arena(std::size_t block_size = 64 * 1024);
+  ~Arena();
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  /*!
+   * \brief Build a T in the arena
+   */
+  template<typename T, typename... ARGS>
+  T* make(ARGS&&... args) {
+    static_assert(alignof(T) <= ALIGNMENT, "Over-aligned types are not supported");
+    auto* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<ARGS>(args)...);
+    // Nothing to run at teardown for trivial types
+    if (!std::is_trivially_destructible<T>::value) {
+      destructors_.push_back(Destructor{[](void* p) { static_cast<T*>(p)->~T(); }, object});
+    }
+    return object;
+  }
+
+  /*!
+   * \brief make(), as an ArenaPtr that leaves the object to the arena
+   */
+  template<typename T, typename... ARGS>
+  ArenaPtr<T> make_unique(ARGS&&... args) {
+    return ArenaPtr<T>{make<T>(std::forward<ARGS>(args)...), ArenaDeleter{true}};
+  }
+
+  /*!
+   * \brief Uninitialized memory for \p size bytes
+   *
+   * \param alignment Power of two, at most ALIGNMENT
+   */
+  void* allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t));
+
+  //! Bytes handed out so far, padding included
+  std::size_t used() const { return used_; }
+
+ private:
+  struct Destructor {
+    void (*destroy)(void*);
+    void* object;
+  };
+
+  std::size_t block_size_;
+  std::vector<void*> blocks_;
+  char* next_ = nullptr;
+  char* end_ = nullptr;
+  std::size_t used_ = 0;
+  std::vector<Destructor> destructors_;
+};
+
+/*!
+ * \brief Build a T in \p arena, or on the heap if there is none
+ */
+template<typename T, typename... ARGS>
+ArenaPtr<T> make_object(Arena* arena, ARGS&&... args) {
+  if (arena != nullptr) {
+    return arena->make_unique<T>(std::forward<ARGS>(args)...);
+  }
+  return ArenaPtr<T>{new T(std::forward<ARGS>(args)...)};
+}
+
+} // namespace rt
+
+#endif // ARENA_HPP
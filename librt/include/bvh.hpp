@@ -0,0 +1,237 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <cfloat>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <aabb.hpp>
+#include <hitable.hpp>
+#include <hitable_list.hpp>
+#include <packet.hpp>
+#include <ray.hpp>
+#include <stats.hpp>
+
+namespace rt {
+
+/*!
+ * \brief Node of a flattened bounding volume hierarchy (32 bytes)
+ *
+ * Nodes are stored depth first: the left child of an interior node is the
+ * node right after it, and \p offset is the index of the right child. For
+ * leaves \p offset is the first primitive and \p count the number of them.
+ */
+struct BVHNode {
+  float lower[3];
+  std::uint32_t offset;
+  float upper[3];
+  std::uint16_t count;
+  std::uint16_t axis;
+
+  bool leaf() const { return count > 0; }
+};
+
+//! Entries of the stacks of bvh_traverse() and bvh_traverse_packet()
+constexpr std::size_t BVH_STACK_SIZE = 64;
+//! Depth of the deepest leaves that fit these stacks, the root being at depth
+//! 0. build_bvh() never goes deeper, and stored hierarchies are checked
+constexpr std::size_t BVH_MAX_DEPTH = BVH_STACK_SIZE - 2;
+
+/*!
+ * \brief Build a BVH over a set of primitive bounds with binned SAH splits
+ *
+ * Near BVH_MAX_DEPTH, nodes are split at the median of their centroids
+ * instead, which is sure to stay within the limit.
+ *
+ * \param boxes Bounds of every primitive
+ * \param max_leaf_size Leaves bigger than this are always split when possible
+ * \param nodes Output. Flattened nodes, the root is the first one
+ * \param order Output. Primitive indices in leaf order; leaves reference
+ *        ranges of this vector
+ */
+void build_bvh(const std::vector<AABB>& boxes,
+               std::size_t max_leaf_size,
+               std::vector<BVHNode>& nodes,
+               std::vector<std::uint32_t>& order);
+
+/*!
+ * \brief Ordered, small stack traversal of a flattened BVH
+ *
+ * \p leaf is called as leaf(first, count, closest) for every leaf whose box
+ * is hit before \p closest, and returns true when it found a closer hit (after
+ * updating \p closest). Near children are visited first. With AnyHit, the
+ * traversal stops at the first leaf that reports a hit.
+ */
+template<bool AnyHit = false, typename Leaf>
+inline bool bvh_traverse(const BVHNode* nodes, const Ray& r,
+                         float t_min, float& closest, Leaf&& leaf) {
+  // Slab intervals are widened slightly so that rounding never culls a box
+  // that contains the closest hit
+  constexpr float ROBUST = 1.0f + 4 * FLT_EPSILON;
+
+  const float o[3] = {r.origin().x(), r.origin().y(), r.origin().z()};
+  const float inv[3] = {1.0f / r.dir().x(), 1.0f / r.dir().y(), 1.0f / r.dir().z()};
+  const bool negative[3] = {inv[0] < 0, inv[1] < 0, inv[2] < 0};
+
+  std::uint32_t stack[BVH_STACK_SIZE];
+  auto top = 0U;
+  auto current = 0U;
+  auto hit_anything = false;
+  // Counted locally, the thread counters are only touched once per ray
+  RT_STAT(std::uint64_t visited = 0);
+  while (true) {
+    const auto& node = nodes[current];
+    RT_STAT(++visited);
+    auto t0 = t_min;
+    auto t1 = closest;
+    for (auto a = 0 ; a < 3 ; ++a) {
+      auto tn = (node.lower[a] - o[a]) * inv[a];
+      auto tf = (node.upper[a] - o[a]) * inv[a];
+      if (negative[a]) {
+        std::swap(tn, tf);
+      }
+      tf *= ROBUST;
+      t0 = tn > t0 ? tn : t0;
+      t1 = tf < t1 ? tf : t1;
+    }
+
+    if (t0 <= t1) {
+      if (node.leaf()) {
+        hit_anything |= leaf(node.offset, node.count, closest);
+        if (AnyHit && hit_anything) {
+          break;
+        }
+      } else {
+        // Visit the child on the side the ray comes from first
+        if (negative[node.axis]) {
+          stack[top++] = current + 1;
+          current = node.offset;
+        } else {
+          stack[top++] = node.offset;
+          current = current + 1;
+        }
+        continue;
+      }
+    }
+    if (top == 0) {
+      break;
+    }
+    current = stack[--top];
+  }
+  RT_STAT(stats::local().bvh_nodes += visited);
+  return hit_anything;
+}
+
+/*!
+ * \brief Traversal of a flattened BVH shared by all the lanes of a packet
+ *
+ * A node is visited if any of the \p active lanes hits its box before its
+ * own closest distance. \p leaf is called as leaf(first, count, lanes) with
+ * the lanes that hit the leaf box, and must lower \p closest for the lanes
+ * that find closer hits. Children are ordered by the direction of the first
+ * lane that reaches them.
+ */
+template<typename Leaf>
+inline void bvh_traverse_packet(const BVHNode* nodes, const RayPacket& packet,
+                                std::uint32_t active, float t_min,
+                                const float* closest, Leaf&& leaf) {
+  constexpr float ROBUST = 1.0f + 4 * FLT_EPSILON;
+
+  float inv[3][MAX_PACKET_SIZE];
+  for (auto l = 0U ; l < packet.size ; ++l) {
+    inv[0][l] = 1.0f / packet.dx[l];
+    inv[1][l] = 1.0f / packet.dy[l];
+    inv[2][l] = 1.0f / packet.dz[l];
+  }
+  const float* origin[3] = {packet.ox, packet.oy, packet.oz};
+
+  struct Entry {
+    std::uint32_t node;
+    std::uint32_t lanes;
+  };
+  Entry stack[BVH_STACK_SIZE];
+  auto top = 0U;
+  stack[top++] = Entry{0, active};
+  RT_STAT(std::uint64_t visited = 0);
+  while (top > 0) {
+    const auto entry = stack[--top];
+    const auto& node = nodes[entry.node];
+    RT_STAT(++visited);
+
+    // Lanes of the parent that also hit this box
+    std::uint32_t lanes = 0;
+    for (auto l = 0U ; l < packet.size ; ++l) {
+      auto t0 = t_min;
+      auto t1 = closest[l];
+      for (auto a = 0 ; a < 3 ; ++a) {
+        const auto tl = (node.lower[a] - origin[a][l]) * inv[a][l];
+        const auto tu = (node.upper[a] - origin[a][l]) * inv[a][l];
+        const auto tn = inv[a][l] < 0 ? tu : tl;
+        const auto tf = (inv[a][l] < 0 ? tl : tu) * ROBUST;
+        t0 = tn > t0 ? tn : t0;
+        t1 = tf < t1 ? tf : t1;
+      }
+      lanes |= static_cast<std::uint32_t>(t0 <= t1) << l;
+    }
+    lanes &= entry.lanes;
+    if (lanes == 0) {
+      continue;
+    }
+
+    if (node.leaf()) {
+      leaf(node.offset, node.count, lanes);
+    } else {
+      const auto lane = static_cast<std::uint32_t>(__builtin_ctz(lanes));
+      if (inv[node.axis][lane] < 0) {
+        stack[top++] = Entry{entry.node + 1, lanes};
+        stack[top++] = Entry{node.offset, lanes};
+      } else {
+        stack[top++] = Entry{node.offset, lanes};
+        stack[top++] = Entry{entry.node + 1, lanes};
+      }
+    }
+  }
+  RT_STAT(stats::local().bvh_nodes += visited);
+}
+
+/*!
+ * \brief Bounding volume hierarchy over a collection of Hitables
+ *
+ * Drop-in replacement for HitableList: it takes ownership of the same objects
+ * and reports exactly the same closest hit, including ties, which resolve to
+ * the object that comes first in the original list. Objects without a
+ * bounding box are kept aside and tested linearly.
+ */
+class BVH final : public Hitable {
+ public:
+  explicit BVH(HitableList::HitablePtr&& objects, std::size_t max_leaf_size = 4);
+
+  virtual bool hit(const Ray& r, float t_min, float t_max, Hit& rec) const override;
+
+  virtual bool occluded(const Ray& r, float t_min, float t_max) const override;
+
+  virtual std::uint32_t hit_packet(const RayPacket& packet, std::uint32_t active,
+                                   float t_min, HitPacket& hits) const override;
+
+  virtual std::uint32_t occluded_packet(const RayPacket& packet, std::uint32_t active,
+                                        float t_min, const float* t_max) const override;
+
+  virtual bool bounding_box(AABB& box) const override;
+
+  virtual void collect_lights(const MaterialTable& materials,
+                              std::vector<SphereLight>& lights) const override;
+
+ private:
+  HitableList::HitablePtr objects_;
+  // Position of every object in the original list, used to break ties
+  std::vector<std::uint32_t> index_;
+  std::vector<BVHNode> nodes_;
+  HitableList::HitablePtr unbounded_;
+  std::vector<std::uint32_t> unbounded_index_;
+};
+
+} // namespace rt
+
+#endif // BVH_HPP
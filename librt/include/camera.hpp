@@ -3,6 +3,7 @@
 
 #include <vector.hpp>
 #include <ray.hpp>
+#include <sampler.hpp>
 
 namespace rt {
 class Camera {
@@ -33,8 +34,8 @@ class Camera {
     horizontal_span_ = 2 * half_width * focus_dist * u_;
     vertical_span_ = 2 * half_height * focus_dist * v_;
   }
-  Ray ray(float u, float v) const {
-    Vector3f rd = lens_radius_ * random_in_unit_disk();
+  Ray ray(float u, float v, Sampler& sampler) const {
+    Vector3f rd = lens_radius_ * sampler.in_unit_disk();
     Vector3f offset = u_ * rd.x() + v_ * rd.y();
     return Ray{origin_ + offset, lower_left_corner_ +
           u * horizontal_span_ + v * vertical_span_ - origin_ - offset};
@@ -0,0 +1,49 @@
+#ifndef DENOISE_HPP
+#define DENOISE_HPP
+
+#include <film.hpp>
+#include <scheduler.hpp>
+
+namespace rt {
+
+/*!
+ * \brief Parameters of denoise()
+ */
+struct DenoiseOptions {
+  //! Passes of the filter. Pass i reads pixels 2^i apart, so the filter
+  //! covers 2^(iterations + 2) - 3 pixels
+  int iterations = 5;
+  //! Luminance differences, in standard deviations of the noise, past which
+  //! neighbours stop counting
+  float sigma_luminance = 4;
+  //! Exponent of the cosine between normals. Larger values keep more edges
+  float sigma_normal = 128;
+  //! Depth differences, in multiples of what the depth gradient at the
+  //! pixel predicts, past which neighbours stop counting
+  float sigma_depth = 1;
+};
+
+/*!
+ * \brief Denoised copy of \p film, which must have a feature buffer
+ *
+ * An edge avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding
+ * A-Trous Wavelet Transform for fast Global Illumination Filtering", 2010),
+ * with the luminance weights of SVGF (Schied et al., 2017): every pass
+ * blurs with a 5x5 B3 spline kernel whose taps are spread further apart, and
+ * weighs neighbours down when their normal or depth differ, or when their
+ * luminance differs more than the noise of the pixels explains.
+ *
+ * The color is divided by the albedo before filtering and multiplied back
+ * after, so that textures stay sharp. The variance of a pixel comes from the
+ * luminance of its samples, or from its neighbours when they are not known
+ * (with the wavefront engine).
+ *
+ * Tiles of every pass are filtered in parallel on \p scheduler. The result
+ * keeps the sample counts of \p film, without features.
+ */
+Film denoise(const Film& film, const TileScheduler& scheduler,
+             const DenoiseOptions& options = DenoiseOptions{});
+
+} // namespace rt
+
+#endif // DENOISE_HPP
@@ -0,0 +1,84 @@
+#ifndef DISTRIBUTED_HPP
+#define DISTRIBUTED_HPP
+
+#include <cstdint>
+#include <string>
+
+#include <render.hpp>
+
+namespace rt {
+
+class Camera;
+
+/*!
+ * \brief How a frame is split between worker processes
+ */
+struct DistributedOptions {
+  //! Where the coordinator listens and workers connect: "unix:PATH" for a
+  //! Unix socket, "HOST:PORT" for TCP. The coordinator replaces a socket
+  //! left at PATH by one that was killed, but no other kind of file, nor
+  //! a socket something listens on
+  std::string address;
+  //! Side of the square regions handed to the workers, rounded down to a
+  //! multiple of RenderOptions::tile_size. Workers split them into tiles for
+  //! their own threads
+  std::uint32_t region_size = 64;
+  //! Regions sent to a worker before it returns the first one, so that it
+  //! never waits for the coordinator
+  unsigned queue_depth = 2;
+  //! Seconds a worker has to return a region, counted from when it was
+  //! sent the first of its queue or returned the previous one. Workers that
+  //! take longer are disconnected and their regions handed to the others.
+  //! 0 waits forever
+  float region_timeout = 600;
+};
+
+/*!
+ * \brief Render an image on worker processes (see run_worker) and write it
+ *        like render() does
+ *
+ * The coordinator listens on distributed.address and sends every worker
+ * that connects the job: the scene file \p scene, the camera and the
+ * options that affect sampling. It then hands out regions of the image, or
+ * with options.progressive regions of every pass of options.pass_spp
+ * samples, and adds the float results to its film. Workers can join at any
+ * time. When a worker dies, or its connection does, the regions it was
+ * working on go back to the queue for the others, and so do those of a
+ * worker that misses distributed.region_timeout. The call returns once
+ * every region is done, however long that takes.
+ *
+ * Regions get the random streams render() would give them, so the image is
+ * the same as a render() of the scene with the same options. Checkpoints,
+ * bands and statistics are not supported.
+ *
+ * \param scene Scene file written by save_scene()
+ * \throw std::runtime_error if the scene cannot be read or the address
+ *        cannot be listened on
+ */
+void render_distributed(std::uint32_t width,
+                        std::uint32_t height,
+                        const std::string& scene,
+                        const Camera& cam,
+                        std::uint16_t anti_alias,
+                        const std::string& filepath,
+                        const RenderOptions& options,
+                        const DistributedOptions& distributed);
+
+/*!
+ * \brief Render regions for the coordinator at \p address until it has
+ *        finished its frame
+ *
+ * Connecting is retried for \p wait seconds, so workers can be started
+ * before the coordinator, and serve one frame after another by calling this
+ * in a loop.
+ *
+ * \param threads Render threads, 0 means one per hardware thread
+ * \return false if no coordinator answered in time
+ * \throw std::runtime_error if the job the coordinator sent, or its scene,
+ *        is invalid
+ */
+bool run_worker(const std::string& address, unsigned threads = 0, float wait = 10);
+
+} // namespace rt
+
+#endif // DISTRIBUTED_HPP
@@ -0,0 +1,266 @@
+#ifndef FILM_HPP
+#define FILM_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <hitable.hpp>
+#include <vector.hpp>
+
+namespace rt {
+
+/*!
+ * \brief What the first hit of a sample looked like, for the denoiser and
+ *        the AOVs
+ *
+ * Films sum them over the samples of a pixel, like colors.
+ */
+struct Features {
+  //! Reflectance of the surface: white for lights, and for rays that miss
+  Vector3f albedo{0, 0, 0};
+  //! Unit normal of the surface, zero for rays that miss
+  Vector3f normal{0, 0, 0};
+  //! Distance from the camera, zero for rays that miss
+  float depth = 0;
+  //! Square of the (linear) luminance of the color of the sample, which
+  //! gives the variance of the pixel. Zero when it is not known
+  float luminance2 = 0;
+  //! Material of the surface, NO_MATERIAL for rays that miss. Sums keep the
+  //! smallest material of their samples, which does not depend on the order
+  //! they are added in
+  MaterialId material = NO_MATERIAL;
+
+  Features& operator+=(const Features& f) {
+    albedo += f.albedo;
+    normal += f.normal;
+    depth += f.depth;
+    luminance2 += f.luminance2;
+    material = std::min(material, f.material);
+    return *this;
+  }
+};
+
+//! Floats per pixel of the feature buffer of a Film. The material is stored
+//! plus one, 0 being NO_MATERIAL, which is exact up to 2^24 materials
+constexpr std::size_t FEATURE_CHANNELS = 9;
+
+/*!
+ * \brief Arbitrary output variables: per pixel data a render can write
+ *        besides the image, from the first hits of its samples
+ */
+enum class AOV : std::uint8_t {
+  //! Mean normal of the first hits, zero where every sample missed
+  Normal,
+  //! Mean albedo, as for the denoiser
+  Albedo,
+  //! Mean distance from the camera to the first hits, misses counting as 0
+  Depth,
+  //! Smallest MaterialId of the first hits, -1 if every sample missed. Ids
+  //! index the MaterialTable of the scene
+  Material,
+  //! Samples taken
+  Samples
+};
+
+constexpr std::size_t AOV_KINDS = 5;
+
+//! Lower case name of an AOV: "normal", "albedo", "depth", "material" or
+//! "samples"
+const char* aov_name(AOV aov);
+
+//! Values per pixel of an AOV: 3 for normals and albedos, 1 for the others
+std::size_t aov_channels(AOV aov);
+
+/*!
+ * \brief Float accumulation buffer: sum of the samples and sample count of
+ *        every pixel
+ *
+ * Rows are stored bottom up, like the images produced by render. A film may
+ * cover only a band of rows [first_row, first_row + height) of an image, or a
+ * rectangle that also starts at first_column, in which case pixels keep their
+ * coordinates in the image.
+ *
+ * A film can also sum the Features of the samples, once enable_features()
+ * is called.
+ */
+class Film {
+ public:
+  Film(std::uint32_t width, std::uint32_t height, std::uint32_t first_row = 0,
+       std::uint32_t first_column = 0)
+      : width_{width}, height_{height}, first_row_{first_row}, first_column_{first_column},
+        sum_(static_cast<std::size_t>(width) * height * 3, 0.0f),
+        samples_(static_cast<std::size_t>(width) * height, 0) {}
+
+  std::uint32_t width() const { return width_; }
+  std::uint32_t height() const { return height_; }
+  std::uint32_t first_row() const { return first_row_; }
+  std::uint32_t first_column() const { return first_column_; }
+
+  /*!
+   * \brief Accumulate the sum of \p samples samples into pixel (x, y)
+   */
+  void add(std::uint32_t x, std::uint32_t y, const Vector3f& sum, std::uint32_t samples) {
+    const auto pixel = index(x, y);
+    sum_[pixel * 3] += sum.x();
+    sum_[pixel * 3 + 1] += sum.y();
+    sum_[pixel * 3 + 2] += sum.z();
+    samples_[pixel] += samples;
+  }
+
+  /*!
+   * \brief Mean of the samples of pixel (x, y), black if it has none
+   */
+  Vector3f color(std::uint32_t x, std::uint32_t y) const {
+    const auto pixel = index(x, y);
+    Vector3f c{sum_[pixel * 3], sum_[pixel * 3 + 1], sum_[pixel * 3 + 2]};
+    if (samples_[pixel] > 0) {
+      c /= static_cast<float>(samples_[pixel]);
+    }
+    return c;
+  }
+
+  std::uint32_t samples(std::uint32_t x, std::uint32_t y) const {
+    return samples_[index(x, y)];
+  }
+
+  /*!
+   * \brief Allocate the feature buffer
+   */
+  void enable_features() {
+    features_.assign(samples_.size() * FEATURE_CHANNELS, 0.0f);
+  }
+
+  bool has_features() const { return !features_.empty(); }
+
+  /*!
+   * \brief Accumulate the sum of the features of samples of pixel (x, y),
+   *        which add() counts. Nothing happens without a feature buffer
+   */
+  void add_features(std::uint32_t x, std::uint32_t y, const Features& sum) {
+    const float channels[FEATURE_CHANNELS] = {
+      sum.albedo.x(), sum.albedo.y(), sum.albedo.z(),
+      sum.normal.x(), sum.normal.y(), sum.normal.z(), sum.depth, sum.luminance2,
+      sum.material == NO_MATERIAL ? 0.0f : static_cast<float>(sum.material) + 1};
+    add_feature_sums(x, y, channels);
+  }
+
+  /*!
+   * \brief add_features() for sums stored as in feature_sums(), such as the
+   *        FEATURE_CHANNELS values of a pixel of another film
+   */
+  void add_feature_sums(std::uint32_t x, std::uint32_t y, const float* sums) {
+    if (features_.empty()) {
+      return;
+    }
+    auto* f = &features_[index(x, y) * FEATURE_CHANNELS];
+    for (auto k = 0U ; k < FEATURE_CHANNELS - 1 ; ++k) {
+      f[k] += sums[k];
+    }
+    // Smallest material, 0 being none
+    const auto material = sums[FEATURE_CHANNELS - 1];
+    auto& smallest = f[FEATURE_CHANNELS - 1];
+    if (material > 0 && (smallest == 0 || material < smallest)) {
+      smallest = material;
+    }
+  }
+
+  /*!
+   * \brief Mean of the features of the samples of pixel (x, y)
+   */
+  Features features(std::uint32_t x, std::uint32_t y) const {
+    const auto pixel = index(x, y);
+    const auto* f = &features_[pixel * FEATURE_CHANNELS];
+    Features mean;
+    mean.albedo = Vector3f{f[0], f[1], f[2]};
+    mean.normal = Vector3f{f[3], f[4], f[5]};
+    mean.depth = f[6];
+    mean.luminance2 = f[7];
+    mean.material = f[8] > 0 ? static_cast<MaterialId>(f[8]) - 1 : NO_MATERIAL;
+    if (samples_[pixel] > 0) {
+      const auto n = static_cast<float>(samples_[pixel]);
+      mean.albedo /= n;
+      mean.normal /= n;
+      mean.depth /= n;
+      mean.luminance2 /= n;
+    }
+    return mean;
+  }
+
+  /*!
+   * \brief Raw buffers, in pixel order: the sums (3 floats per pixel) and
+   *        the sample counts
+   */
+  const std::vector<float>& sums() const { return sum_; }
+  const std::vector<std::uint32_t>& counts() const { return samples_; }
+  //! FEATURE_CHANNELS floats per pixel, empty without a feature buffer
+  const std::vector<float>& feature_sums() const { return features_; }
+
+  /*!
+   * \brief Store the aov_channels(aov) values of pixel (x, y) in \p values
+   *
+   * Every AOV but the sample count needs the feature buffer.
+   */
+  void aov(AOV aov, std::uint32_t x, std::uint32_t y, float* values) const;
+
+  /*!
+   * \brief 8 bit RGB image of the rows of the film, tonemapped with a sqrt
+   *        (gamma 2) and clamped to white
+   */
+  std::vector<std::uint8_t> to_rgb8() const;
+
+  /*!
+   * \brief Linear float RGB image of the rows of the film: the mean of the
+   *        samples, untouched
+   */
+  std::vector<float> to_rgbf() const;
+
+  /*!
+   * \brief Write the buffer and the progress of a progressive render
+   *
+   * The file is written next to \p path and renamed over it, so a job killed
+   * while checkpointing leaves the previous checkpoint intact.
+   *
+   * \param seed Seed of the render
+   * \param passes Completed passes. Together with the seed this is the
+   *        random state: the stream of every pixel and pass is derived from
+   *        them
+   * \param pass_spp Samples per pass, which low discrepancy samplers number
+   *        the samples of a pass from
+   *
+   * The feature buffer is saved with the colors if there is one.
+   */
+  void save(const std::string& path, std::uint64_t seed, std::uint32_t passes,
+            std::uint32_t pass_spp) const;
+
+  /*!
+   * \brief Read a checkpoint written by save()
+   *
+   * \param pass_spp Set to 0 for checkpoints of versions that did not store
+   *        it
+   * \return false if \p path does not exist
+   * \throw std::runtime_error if the file is not a checkpoint of this size,
+   *        or has no features (or other ones) and the film has a feature
+   *        buffer
+   */
+  bool load(const std::string& path, std::uint64_t& seed, std::uint32_t& passes,
+            std::uint32_t& pass_spp);
+
+ private:
+  std::size_t index(std::uint32_t x, std::uint32_t y) const {
+    return static_cast<std::size_t>(y - first_row_) * width_ + (x - first_column_);
+  }
+
+  std::uint32_t width_;
+  std::uint32_t height_;
+  std::uint32_t first_row_;
+  std::uint32_t first_column_;
+  std::vector<float> sum_;
+  std::vector<std::uint32_t> samples_;
+  std::vector<float> features_;
+};
+
+} // namespace rt
+
+#endif // FILM_HPP
@@ -1,25 +1,87 @@
 #ifndef HITTABLE_HPP
 #define HITTABLE_HPP
 
+#include <cstdint>
+#include <vector>
+
+#include <aabb.hpp>
 #include <vector.hpp>
 
 namespace rt {
 
-class Material;
-
 class Ray;
+struct RayPacket;
+struct HitPacket;
+struct SphereLight;
+class MaterialTable;
+
+/*!
+ * \brief Index of a material in the MaterialTable of the scene
+ */
+using MaterialId = std::uint32_t;
+
+//! MaterialId of nothing, for rays that hit nothing
+constexpr MaterialId NO_MATERIAL = ~MaterialId{0};
 
 struct Hit {
   float t;
   Vector3f p;
   Vector3f normal;
-  // TODO, don't use raw pointers
-  Material* material;
+  MaterialId material;
 };
 
 class Hitable {
  public:
   virtual bool hit(const Ray& r, float t_min, float t_ma, Hit& rec) const = 0;
+
+  /*!
+   * \brief Box enclosing the object, used by acceleration structures
+   *
+   * \return false if the object is unbounded (or does not know its bounds)
+   */
+  virtual bool bounding_box(AABB& /* box */) const { return false; }
+
+  /*!
+   * \brief Whether anything is hit in (t_min, t_max)
+   *
+   * Meant for shadow rays: any hit will do, so the search can stop at the
+   * first one. The default implementation looks for the closest hit.
+   */
+  virtual bool occluded(const Ray& r, float t_min, float t_max) const;
+
+  /*!
+   * \brief Closest hit of every lane of a packet
+   *
+   * Lanes that hit something closer than hits.t get hits.t and hits.hit
+   * updated. The default implementation traces the lanes one by one.
+   *
+   * \param active Bit mask of the lanes to trace
+   * \return Bit mask of the lanes that hit
+   */
+  virtual std::uint32_t hit_packet(const RayPacket& packet, std::uint32_t active,
+                                   float t_min, HitPacket& hits) const;
+
+  /*!
+   * \brief Lanes of a packet blocked by anything in (t_min, t_max[lane])
+   *
+   * Meant for shadow rays, which only need to know whether something is in
+   * the way. The default implementation tests the lanes one by one with
+   * occluded().
+   *
+   * \return Bit mask of the occluded lanes
+   */
+  virtual std::uint32_t occluded_packet(const RayPacket& packet, std::uint32_t active,
+                                        float t_min, const float* t_max) const;
+
+  /*!
+   * \brief Append the spheres of the object whose material, in
+   *        \p materials, emits light to \p lights, for light sampling (see
+   *        Lights). Objects that are not spheres add nothing
+   */
+  virtual void collect_lights(const MaterialTable& /* materials */,
+                              std::vector<SphereLight>& /* lights */) const {}
+
+  virtual ~Hitable() {}
 };
 }
 #endif // HITTABLE_HPP
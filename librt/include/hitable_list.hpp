@@ -4,17 +4,22 @@
 #include <vector>
 #include <memory>
 
+#include <arena.hpp>
 #include <hitable.hpp>
+#include <packet.hpp>
 #include <ray.hpp>
+#include <stats.hpp>
 
 namespace rt {
-class HitableList : public Hitable {
+class HitableList final : public Hitable {
  public:
-  using HitablePtr = std::vector<std::unique_ptr<Hitable>>;
+  //! Objects built with std::make_unique, or in an Arena that outlives them
+  using HitablePtr = std::vector<ArenaPtr<Hitable>>;
   
   explicit HitableList(HitablePtr&& objects) : objects_{std::move(objects)} {}
   
   virtual bool hit(const Ray& r, float t_min, float t_max, Hit& rec) const override {
+    RT_STAT(++stats::local().hit_calls);
     Hit tmp_hit;
     bool hit_anything = false;
     double closest = t_max;
@@ -27,8 +32,60 @@ class HitableList : public Hitable {
     }
     return hit_anything;
   }
+
+  virtual bool occluded(const Ray& r, float t_min, float t_max) const override {
+    RT_STAT(++stats::local().hit_calls);
+    for(auto& hitable : objects_) {
+      if (hitable->occluded(r, t_min, t_max)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  virtual std::uint32_t hit_packet(const RayPacket& packet, std::uint32_t active,
+                                   float t_min, HitPacket& hits) const override {
+    // One call per object for the whole packet
+    std::uint32_t mask = 0;
+    for(auto& hitable : objects_) {
+      mask |= hitable->hit_packet(packet, active, t_min, hits);
+    }
+    return mask;
+  }
+
+  virtual std::uint32_t occluded_packet(const RayPacket& packet, std::uint32_t active,
+                                        float t_min, const float* t_max) const override {
+    // Lanes leave the packet as soon as something blocks them
+    std::uint32_t occluded = 0;
+    for(auto& hitable : objects_) {
+      if (occluded == active) {
+        break;
+      }
+      occluded |= hitable->occluded_packet(packet, active & ~occluded, t_min, t_max);
+    }
+    return occluded;
+  }
+
+  virtual bool bounding_box(AABB& box) const override {
+    box = AABB{};
+    for(auto& hitable : objects_) {
+      AABB object_box;
+      if (!hitable->bounding_box(object_box)) {
+        return false;
+      }
+      box.grow(object_box);
+    }
+    return true;
+  }
+
+  virtual void collect_lights(const MaterialTable& materials,
+                              std::vector<SphereLight>& lights) const override {
+    for(auto& hitable : objects_) {
+      hitable->collect_lights(materials, lights);
+    }
+  }
  private:
-  std::vector<std::unique_ptr<Hitable>> objects_; 
+  HitablePtr objects_;
 };
 }
 #endif // HITTABLE_LIST_HPP
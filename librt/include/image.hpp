@@ -1,5 +1,13 @@
 #ifndef IMAGE_HPP
 #define IMAGE_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
 namespace rt {
     class ImageWriter {
     public:
@@ -26,12 +34,216 @@ namespace rt {
 		   std::size_t height) const override;
     };
 
+    /*!
+     * \brief Filter applied to the rows of a PNG image before compression
+     */
+    enum class PNGFilter {
+	None,
+	Sub,
+	Up,
+	Average,
+	Paeth,
+	//! Try the five filters on every row and keep the one whose output
+	//! looks most compressible, as libpng does by default
+	Adaptive
+    };
+
+    /*!
+     * \brief How PNG images are encoded
+     */
+    struct PNGOptions {
+	//! zlib compression level, from 0 (stored, fastest) to 9 (smallest)
+	int level = 6;
+	PNGFilter filter = PNGFilter::Adaptive;
+	//! Encoding threads, 0 means one per hardware thread
+	unsigned threads = 0;
+	//! Rows filtered and compressed together by one thread. 0 picks about
+	//! 256 KB worth of rows
+	std::uint32_t block_rows = 0;
+    };
+
     class PNGWriter : public FileWriter {
     public:
-	PNGWriter(const std::string& filepath) : FileWriter{filepath} {}	
+	PNGWriter(const std::string& filepath, const PNGOptions& options = PNGOptions{})
+	    : FileWriter{filepath}, options_{options} {}
 	void write(const std::vector<uint8_t>& buffer,
 		   std::size_t width,
 		   std::size_t height) const override;
-    };	
+    private:
+	PNGOptions options_;
+    };
+
+    /*!
+     * \brief Writes an image a few rows at a time, top row first
+     *
+     * Rows go to the file as they arrive, so the image never needs to be in
+     * memory as a whole. Buffers hold 3 bytes (RGB) per pixel.
+     */
+    class RowWriter {
+    public:
+	virtual void begin(std::size_t width, std::size_t height) = 0;
+	/*!
+	 * \brief Write \p count consecutive rows, the top one first
+	 */
+	virtual void write_rows(const std::uint8_t* rows, std::size_t count) = 0;
+	virtual void end() = 0;
+	virtual ~RowWriter() {}
+    };
+
+    class PPMRowWriter : public RowWriter {
+    public:
+	PPMRowWriter(const std::string& filepath) : filepath_{filepath} {}
+	void begin(std::size_t width, std::size_t height) override;
+	void write_rows(const std::uint8_t* rows, std::size_t count) override;
+	void end() override;
+    private:
+	std::string filepath_;
+	std::ofstream os_;
+	std::size_t width_ = 0;
+    };
+
+    /*!
+     * \brief PNG encoder that filters and compresses blocks of rows in
+     *        parallel
+     *
+     * Rows are buffered until every thread has a block. Each block is
+     * compressed as a separate piece of the zlib stream, primed with the last
+     * 32 KB of the data before it, and ends on a byte boundary (a sync flush),
+     * so the pieces are simply concatenated, one IDAT chunk each. The
+     * checksums of the blocks are combined into the one of the stream.
+     */
+    class PNGRowWriter : public RowWriter {
+    public:
+	PNGRowWriter(const std::string& filepath, const PNGOptions& options = PNGOptions{})
+	    : filepath_{filepath}, options_{options} {}
+	~PNGRowWriter();
+	void begin(std::size_t width, std::size_t height) override;
+	void write_rows(const std::uint8_t* rows, std::size_t count) override;
+	void end() override;
+    private:
+	void flush(bool last);
+	void write_chunk(const char* type, const std::vector<std::uint8_t>& data);
+
+	std::string filepath_;
+	PNGOptions options_;
+	std::ofstream os_;
+	std::size_t width_ = 0;
+	std::size_t block_rows_ = 0;
+	unsigned threads_ = 1;
+	// Rows waiting to be encoded, top first
+	std::vector<std::uint8_t> pending_;
+	// Last row encoded, which the Up, Average and Paeth filters refer to
+	std::vector<std::uint8_t> previous_;
+	// Last 32 KB of filtered data, that the next block may refer to
+	std::vector<std::uint8_t> dictionary_;
+	std::uint32_t adler_ = 1;
+	bool header_written_ = false;
+    };
+
+    /*!
+     * \brief Writes a linear (HDR) float RGB image a few rows at a time, top
+     *        row first
+     *
+     * Buffers hold 3 floats per pixel. Values are stored as they are, with no
+     * tonemapping and no clamping.
+     */
+    class HDRRowWriter {
+    public:
+	virtual void begin(std::size_t width, std::size_t height) = 0;
+	/*!
+	 * \brief Write \p count consecutive rows, the top one first
+	 */
+	virtual void write_rows(const float* rows, std::size_t count) = 0;
+	virtual void end() = 0;
+	virtual ~HDRRowWriter() {}
+    };
+
+    /*!
+     * \brief Portable float map (little endian, 32 bit floats)
+     */
+    class PFMRowWriter : public HDRRowWriter {
+    public:
+	PFMRowWriter(const std::string& filepath) : filepath_{filepath} {}
+	void begin(std::size_t width, std::size_t height) override;
+	void write_rows(const float* rows, std::size_t count) override;
+	void end() override;
+    private:
+	std::string filepath_;
+	std::ofstream os_;
+	std::size_t width_ = 0;
+	std::size_t height_ = 0;
+	std::size_t row_ = 0;
+	std::streamoff data_ = 0;
+    };
+
+    /*!
+     * \brief Channel of an EXR image besides its R, G and B
+     */
+    struct EXRChannel {
+	//! Full name, layer included, such as "normal.X"
+	std::string name;
+	//! Stored as 32 bit floats in half float files too, for values such as
+	//! ids and counts that halves would round
+	bool exact;
+    };
+
+    /*!
+     * \brief Uncompressed scan line OpenEXR, with 32 bit float or 16 bit half
+     *        float channels
+     *
+     * Extra channels follow R, G and B in the pixels of the rows, in the
+     * order they are given, so every pixel holds 3 floats plus one per extra
+     * channel.
+     */
+    class EXRRowWriter : public HDRRowWriter {
+    public:
+	EXRRowWriter(const std::string& filepath, bool half = false,
+		     std::vector<EXRChannel> channels = {})
+	    : filepath_{filepath}, half_{half}, extra_{std::move(channels)} {}
+	void begin(std::size_t width, std::size_t height) override;
+	void write_rows(const float* rows, std::size_t count) override;
+	void end() override;
+    private:
+	// Where the values of a channel are in the pixels of the rows, and
+	// where they go in a line of the file
+	struct Layout {
+	    std::size_t source;
+	    bool half;
+	    std::size_t offset;
+	};
+
+	std::string filepath_;
+	bool half_;
+	std::vector<EXRChannel> extra_;
+	std::ofstream os_;
+	std::size_t width_ = 0;
+	std::size_t row_ = 0;
+	std::vector<Layout> layout_;
+	std::vector<char> line_;
+    };
+
+    /*!
+     * \brief Whole image PFM writer. The buffer is stored bottom up
+     */
+    class PFMWriter {
+    public:
+	PFMWriter(const std::string& filepath) : filepath_{filepath} {}
+	void write(const std::vector<float>& buffer, std::size_t width, std::size_t height) const;
+    private:
+	std::string filepath_;
+    };
+
+    /*!
+     * \brief Whole image EXR writer. The buffer is stored bottom up
+     */
+    class EXRWriter {
+    public:
+	EXRWriter(const std::string& filepath, bool half = false)
+	    : filepath_{filepath}, half_{half} {}
+	void write(const std::vector<float>& buffer, std::size_t width, std::size_t height) const;
+    private:
+	std::string filepath_;
+	bool half_;
+    };
 }
 #endif // IMAGE_HPP
@@ -0,0 +1,88 @@
+#ifndef LIGHT_HPP
+#define LIGHT_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include <hitable.hpp>
+#include <vector.hpp>
+
+namespace rt {
+
+class MaterialTable;
+class Sampler;
+
+/*!
+ * \brief Sphere whose material emits light
+ */
+struct SphereLight {
+  Vector3f center;
+  //! Hollow spheres have a negative radius, like Sphere
+  float radius;
+  MaterialId material;
+};
+
+/*!
+ * \brief Direction toward a light drawn by Lights::sample()
+ */
+struct LightSample {
+  //! Unit direction
+  Vector3f dir;
+  //! Distance to the surface of the light along dir
+  float distance;
+  //! Radiance the light emits
+  Vector3f emitted;
+  //! Density of dir per unit solid angle, the choice of the light included
+  float pdf;
+};
+
+/*!
+ * \brief Emissive spheres of a world, sampled for next event estimation
+ *
+ * A light is picked uniformly, then a direction uniformly in the cone the
+ * sphere subtends from the shading point, so that every direction drawn
+ * reaches the light unless something is in the way.
+ */
+class Lights {
+ public:
+  Lights() = default;
+
+  /*!
+   * \brief Lights of \p world, whose materials are \p materials, which
+   *        must outlive the lights. See Hitable::collect_lights()
+   */
+  Lights(const Hitable& world, const MaterialTable& materials);
+
+  bool empty() const { return lights_.empty(); }
+  std::size_t size() const { return lights_.size(); }
+
+  /*!
+   * \brief Direction from \p p toward one of the lights, from the next 2
+   *        dimensions of \p sampler
+   *
+   * \return false if \p p is inside the light that was picked
+   */
+  bool sample(const Vector3f& p, Sampler& sampler, LightSample& sample) const;
+
+  /*!
+   * \brief Density with which sample() draws the direction from \p p to
+   *        \p hit, a hit on a light. 0 if the hit is on none of them
+   */
+  float pdf(const Vector3f& p, const Hit& hit) const;
+
+ private:
+  const MaterialTable* materials_ = nullptr;
+  std::vector<SphereLight> lights_;
+};
+
+/*!
+ * \brief Power heuristic (exponent 2) weight of a sample drawn with density
+ *        \p pdf, against another strategy of density \p other_pdf
+ */
+inline float power_heuristic(float pdf, float other_pdf) {
+  return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+} // namespace rt
+
+#endif // LIGHT_HPP
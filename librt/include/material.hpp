@@ -1,122 +1,153 @@
 #ifndef MATERIAL_HPP
 #define MATERIAL_HPP
 
+#include <cstdint>
 #include <map>
-#include <memory>
 #include <string>
+#include <vector>
 
+#include <hitable.hpp>
+#include <sampler.hpp>
 #include <vector.hpp>
 #include <texture.hpp>
 
 namespace rt {
 
-class Hit;
 class Ray;
 
 /*!
- * \brief Abstract representation of a material that can be associated with
- *        a object. Material is also used to decorate a Hit.
+ * \brief The closed set of materials
  */
-class Material {
- public:
-  /*!
-   * \brief Scatter an incoming Ray using Hit information, and attenuation vector
-   *
-   * \param ray The incoming Ray
-   * \param hit Information about the intersection between the Ray and a Hitable
-   * \param attenuation Vector representing the attenuation factor to be applied to each color
-   * \param scattered Output parameter. Ray generated by the scatter calculation
-   * \return
-   */
-  virtual bool scatter(const Ray& ray,
-		       const Hit& hit,
-		       Vector3f&  attenuation,
-		       Ray& scattered) const = 0;
-
-    virtual Vector3f emmitted() const {
-	return {0,0,0};
-    }
-
-  virtual ~Material(){};
+enum class MaterialKind : std::uint8_t {
+  //! A non reflecting (diffuse) material
+  Lambertian,
+  //! A perfect mirror
+  Metal,
+  //! A transparent material that both reflects and refracts
+  Dielectric,
+  //! An emitting material, that does not scatter
+  Light
 };
 
-class Light : public Material {
-public:
-  Light(const Vector3f& color) : color_{color} {}
-  bool scatter(const Ray& ray,
-	       const Hit& rec,
-	       Vector3f& attenuation,
-	       Ray& scattered) const final override {
-      return false;
-  }
+constexpr std::size_t MATERIAL_KINDS = static_cast<std::size_t>(MaterialKind::Light) + 1;
 
-  Vector3f emmitted() const final override {
-      return color_;
-  }
-private:
-    Vector3f color_;
+/*!
+ * \brief A material of any kind, as one flat record. Only the fields of its
+ *        kind are meaningful
+ */
+struct MaterialRecord {
+  MaterialKind kind;
+  //! Lambertian attenuation
+  TextureRecord albedo;
+  //! Metal attenuation, or Light emitted color
+  Vector3f color;
+  //! Dielectric refraction index
+  float ref_idx;
 };
 
 /*!
- * \brief A non reflecting material
+ * \brief Contiguous array of MaterialRecord, indexed by MaterialId
+ *
+ * Every scene has its own: a MaterialRegistry fills the table of the scenes
+ * it builds, and a MappedScene holds the materials of its file. Rendering
+ * takes the table along with the world, and adding records may move it, so
+ * materials must all be created before rendering starts.
  */
-class Lambertian : public Material {
+class MaterialTable {
  public:
-  /*!
-   * \brief Construct a new Lambertian material with the given attenuation vector
-   */
-  explicit Lambertian(Texture* a) : albedo_{a} {}
+  MaterialId add(const MaterialRecord& record) {
+    records_.push_back(record);
+    return static_cast<MaterialId>(records_.size() - 1);
+  }
+
+  const MaterialRecord& operator[](MaterialId id) const { return records_[id]; }
+  std::size_t size() const { return records_.size(); }
 
-  /*
-   * Generate a scattered Ray in a random direction. Given an intersection point a
-   * nd a normal with unit length, the scattered ray is calculated by moving the
-   * intersection point in the direction of the normal, for the length of the
-   * normal, and then moving it along a unit vector in a random direction.
-   */
-  bool scatter(const Ray& ray,
-	       const Hit& rec,
-	       Vector3f& attenuation,
-	       Ray& scattered) const final override;
  private:
-  Texture* albedo_;
+  std::vector<MaterialRecord> records_;
 };
 
-class Metal : public Material {
- public:
-  explicit Metal(const Vector3f& a) : albedo_{a}{}
+/*!
+ * \brief Scatter an incoming Ray using Hit information, and attenuation vector
+ *
+ * There is one function per kind, so that code that knows the kind (like
+ * the wavefront engine) calls it directly, and scatter() to switch on it.
+ *
+ * \param material Material of the hit, of the kind of the function
+ * \param ray The incoming Ray
+ * \param hit Information about the intersection between the Ray and a Hitable
+ * \param attenuation Vector representing the attenuation factor to be applied to each color
+ * \param scattered Output parameter. Ray generated by the scatter calculation
+ * \param sampler Sampler of the path, at the dimensions of the bounce
+ * \return false if the ray is absorbed
+ */
+bool scatter_lambertian(const MaterialRecord& material, const Ray& ray, const Hit& hit,
+			Vector3f& attenuation, Ray& scattered, Sampler& sampler);
+bool scatter_metal(const MaterialRecord& material, const Ray& ray, const Hit& hit,
+		   Vector3f& attenuation, Ray& scattered, Sampler& sampler);
+bool scatter_dielectric(const MaterialRecord& material, const Ray& ray, const Hit& hit,
+			Vector3f& attenuation, Ray& scattered, Sampler& sampler);
 
-  bool scatter(const Ray& ray,
-	       const Hit& rec,
-	       Vector3f& attenuation,
-	       Ray& scattered) const final override;
- private:
-  Vector3f albedo_;
-};
+/*!
+ * \brief scatter_lambertian() with directions drawn from the exact cosine
+ *        distribution around the normal, from 2 dimensions
+ *
+ * scatter_lambertian() offsets the normal by a point in the unit sphere
+ * rather than on it, which leans a little more toward the normal and has no
+ * simple density. Light sampling needs the density cos / pi of this one to
+ * weigh its samples against those of the lights.
+ */
+bool scatter_cosine(const MaterialRecord& material, const Ray& ray, const Hit& hit,
+		    Vector3f& attenuation, Ray& scattered, Sampler& sampler);
+
+inline bool scatter(const MaterialRecord& material, const Ray& ray, const Hit& hit,
+		    Vector3f& attenuation, Ray& scattered, Sampler& sampler) {
+  switch (material.kind) {
+    case MaterialKind::Lambertian:
+      return scatter_lambertian(material, ray, hit, attenuation, scattered, sampler);
+    case MaterialKind::Metal:
+      return scatter_metal(material, ray, hit, attenuation, scattered, sampler);
+    case MaterialKind::Dielectric:
+      return scatter_dielectric(material, ray, hit, attenuation, scattered, sampler);
+    default:
+      return false;
+  }
+}
+
+inline Vector3f emmitted(const MaterialRecord& material) {
+  if (material.kind == MaterialKind::Light) {
+    return material.color;
+  }
+  return {0, 0, 0};
+}
 
 /*!
- * \brief A non reflecting material
+ * \brief Whether hits on material \p id of \p materials emit light
  */
-class Dielectric : public Material {
- public:
-  /*!
-   * \brief Construct a new Lambertian material with the given attenuation vector
-   */
-  explicit Dielectric(float ri) : ref_idx_{ri} {}
+inline bool emits(const MaterialTable& materials, MaterialId id) {
+  return materials[id].kind == MaterialKind::Light;
+}
 
-  /*
-   * Generate a scattered Ray in a random direction. Given an intersection point a
-   * nd a normal with unit length, the scattered ray is calculated by moving the
-   * intersection point in the direction of the normal, for the length of the
-   * normal, and then moving it along a unit vector in a random direction.
-   */
-  bool scatter(const Ray& ray,
-	       const Hit& rec,
-	       Vector3f& attenuation,
-	       Ray& scattered) const final override;
- private:
-  float ref_idx_;
-};
+/*!
+ * \brief Reflectance of a material at a hit: the attenuation of diffuse and
+ *        metal surfaces, white for the others
+ */
+inline Vector3f albedo(const MaterialRecord& material, const Hit& hit) {
+  switch (material.kind) {
+    case MaterialKind::Lambertian:
+      return material.albedo.value(0, 0, hit.p);
+    case MaterialKind::Metal:
+      return material.color;
+    default:
+      return {1, 1, 1};
+  }
+}
 
+/*!
+ * \brief Named materials. Materials are created in the table of the
+ *        registry, which scenes built from it are rendered with, and the
+ *        registry hands out their ids
+ */
 class MaterialRegistry {
  public:
   MaterialRegistry() = default;
@@ -132,31 +163,22 @@ class MaterialRegistry {
   void register_light(const std::string& name,
 		      const Vector3f& color);
 
+  /*!
+   * \throw std::out_of_range if no material was registered with this name
+   */
+  MaterialId get(const std::string& name) const;
+
+  MaterialId generate_lambertial(rt::TextureRegistry& textures, Random& rng);
 
-  Material* get(const std::string& name);
+  MaterialId generate_metal(Random& rng);
 
-  Material* generate_lambertial(rt::TextureRegistry& textures) {
-    random_.push_back(std::make_unique<Lambertian>(textures.random_color()));
-    return random_.back().get();
-  }
+  MaterialId generate_dielectric();
 
-  Material* generate_metal() {
-    auto dis = std::uniform_real_distribution<float>{0.0, 1.0};
-    std::random_device device;
-    random_.push_back(
-	std::make_unique<Metal>(rt::Vector3f{0.5f * (1 + dis(device)),
-		0.5f * (1 + dis(device)),
-		0.5f * dis(device)}));
-    return random_.back().get();
-  }
+  const MaterialTable& table() const { return table_; }
 
-  Material* generate_dielectric() {
-    random_.push_back(std::make_unique<Dielectric>(1.5));
-    return random_.back().get();
-  }
  private:
-  std::map<std::string, std::unique_ptr<Material>> registry_;
-  std::vector<std::unique_ptr<Material>> random_;
+  MaterialTable table_;
+  std::map<std::string, MaterialId> registry_;
 };
 
 } // namespace rt
@@ -0,0 +1,81 @@
+#ifndef PACKET_HPP
+#define PACKET_HPP
+
+#include <cstdint>
+
+#include <hitable.hpp>
+#include <ray.hpp>
+#include <vector.hpp>
+
+namespace rt {
+
+/*!
+ * \brief Widest supported packet
+ */
+constexpr std::uint32_t MAX_PACKET_SIZE = 16;
+
+/*!
+ * \brief Up to 16 rays traced together, stored as a structure of arrays
+ *
+ * Packet queries take a bit mask of the lanes to trace; the other lanes are
+ * left untouched. Packets are meant for coherent rays (primary rays of a
+ * pixel block, shadow rays towards the same light) so that the traversal and
+ * the memory loads are shared by all the lanes.
+ */
+struct RayPacket {
+  alignas(64) float ox[MAX_PACKET_SIZE];
+  alignas(64) float oy[MAX_PACKET_SIZE];
+  alignas(64) float oz[MAX_PACKET_SIZE];
+  alignas(64) float dx[MAX_PACKET_SIZE];
+  alignas(64) float dy[MAX_PACKET_SIZE];
+  alignas(64) float dz[MAX_PACKET_SIZE];
+  //! Number of lanes in use: 4, 8 or 16
+  std::uint32_t size = 0;
+
+  void set(std::uint32_t lane, const Ray& r) {
+    ox[lane] = r.origin().x();
+    oy[lane] = r.origin().y();
+    oz[lane] = r.origin().z();
+    dx[lane] = r.dir().x();
+    dy[lane] = r.dir().y();
+    dz[lane] = r.dir().z();
+  }
+
+  Ray ray(std::uint32_t lane) const {
+    return Ray{Vector3f{ox[lane], oy[lane], oz[lane]}, Vector3f{dx[lane], dy[lane], dz[lane]}};
+  }
+};
+
+/*!
+ * \brief Per lane results of a packet query
+ *
+ * \p t is in/out: on entry it holds the t_max of every lane, and it is
+ * lowered as closer hits are found, exactly like the closest distance when
+ * testing a single ray against several objects.
+ */
+struct HitPacket {
+  alignas(64) float t[MAX_PACKET_SIZE];
+  Hit hit[MAX_PACKET_SIZE];
+
+  void reset(float t_max) {
+    for (auto& t_lane : t) {
+      t_lane = t_max;
+    }
+  }
+};
+
+/*!
+ * \brief Call \p f(lane) for every lane set in \p mask, lowest lane first
+ */
+template<typename F>
+inline void for_each_lane(std::uint32_t mask, F&& f) {
+  while (mask != 0) {
+    const auto lane = static_cast<std::uint32_t>(__builtin_ctz(mask));
+    f(lane);
+    mask &= mask - 1;
+  }
+}
+
+} // namespace rt
+
+#endif // PACKET_HPP
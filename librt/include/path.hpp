@@ -0,0 +1,276 @@
+#ifndef PATH_HPP
+#define PATH_HPP
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include <film.hpp>
+#include <hitable.hpp>
+#include <light.hpp>
+#include <material.hpp>
+#include <ray.hpp>
+#include <sampler.hpp>
+#include <stats.hpp>
+#include <vector.hpp>
+
+namespace rt {
+
+/*!
+ * \brief PathSettings fixed at compile time
+ *
+ * Path loops instantiated with it compare the depth against a constant and
+ * drop the background branch they never take. Only the Russian roulette
+ * depth is left to run time.
+ */
+template<bool Background, int MaxDepth>
+struct StaticPathSettings {
+  static constexpr bool background = Background;
+  static constexpr int max_depth = MaxDepth;
+  const MaterialTable* materials = nullptr;
+  int rr_depth = 5;
+  const Lights* lights = nullptr;
+};
+
+template<bool Background, int MaxDepth>
+constexpr bool StaticPathSettings<Background, MaxDepth>::background;
+
+template<bool Background, int MaxDepth>
+constexpr int StaticPathSettings<Background, MaxDepth>::max_depth;
+
+/*!
+ * \brief Light sample of direct_light() for the diffuse hit \p rec
+ *
+ * \return false if the sample cannot light \p rec, whatever is in the way
+ */
+inline bool sample_direct_light(const Hit& rec, const Lights& lights, Sampler& sampler,
+                                LightSample& light) {
+  return lights.sample(rec.p, sampler, light) && dot(rec.normal, light.dir) > 0;
+}
+
+/*!
+ * \brief Shadow ray toward \p light, tested in (RAY_T_MIN, shadow_t_max()),
+ *        which stops short of the light
+ */
+inline Ray shadow_ray(const Hit& rec, const LightSample& light) {
+  return Ray{rec.p, light.dir};
+}
+
+inline float shadow_t_max(const LightSample& light) {
+  return light.distance - RAY_T_MIN;
+}
+
+/*!
+ * \brief Light of a sample of sample_direct_light() whose shadow ray is
+ *        not blocked, weighted against the chance of the bounce finding it
+ */
+inline Vector3f unoccluded_light(const MaterialRecord& material, const Hit& rec,
+                                 const LightSample& light) {
+  // The BRDF albedo / pi times the cosine is albedo times the density of
+  // scatter_cosine()
+  const auto bounce_pdf = dot(rec.normal, light.dir) / static_cast<float>(M_PI);
+  return material.albedo.value(0, 0, rec.p) * light.emitted *
+      (bounce_pdf * power_heuristic(light.pdf, bounce_pdf) / light.pdf);
+}
+
+/*!
+ * \brief Light reaching the diffuse hit \p rec straight from one of
+ *        \p lights, weighted against the chance of the bounce finding it
+ *
+ * \param sampler Sampler of the path, at the light dimensions of the bounce
+ */
+template<typename World>
+Vector3f direct_light(const MaterialRecord& material, const Hit& rec, const World& world,
+                      const Lights& lights, Sampler& sampler) {
+  LightSample light;
+  if (!sample_direct_light(rec, lights, sampler, light)) {
+    return {0, 0, 0};
+  }
+  RT_STAT(++stats::local().rays);
+  if (world.occluded(shadow_ray(rec, light), RAY_T_MIN, shadow_t_max(light))) {
+    return {0, 0, 0};
+  }
+  return unoccluded_light(material, rec, light);
+}
+
+/*!
+ * \brief shade() for a world of type World, with settings of type Settings
+ *        (PathSettings or StaticPathSettings)
+ *
+ * Hits are tested through World::hit. When World is a final class, the
+ * calls are direct and can be inlined instead of going through the vtable.
+ *
+ * With settings.lights, diffuse bounces add the light of a sample of the
+ * lights (next event estimation), and lights that the scattered ray hits
+ * count as well: both are weighted with multiple importance sampling
+ * (Veach and Guibas, "Optimally Combining Sampling Techniques for Monte
+ * Carlo Rendering", 1995), so each dominates where it has less noise.
+ * The light sample of the first bounce can be taken and traced by the
+ * caller, see \p first_light in shade().
+ */
+template<typename World, typename Settings>
+Vector3f shade_path(const Ray& r, const Hit& first_hit, const World& world,
+                    const Settings& settings, Sampler& sampler,
+                    const Vector3f* first_light = nullptr) {
+  // Radiance gathered so far, and the product of the attenuations of the
+  // bounces, which scales whatever the path finds next
+  Vector3f radiance{0, 0, 0};
+  Vector3f throughput{1, 1, 1};
+
+  const auto& materials = *settings.materials;
+  const auto* lights = settings.lights;
+  // Density of the direction of the last bounce when it was diffuse and
+  // the lights were sampled there too, 0 otherwise
+  auto bounce_pdf = 0.0f;
+  Ray ray{r.origin(), r.dir()};
+  Hit rec = first_hit;
+  auto depth = 0;
+  for ( ; ; ++depth) {
+    const auto& material = materials[rec.material];
+    if (bounce_pdf > 0 && material.kind == MaterialKind::Light) {
+      radiance += power_heuristic(bounce_pdf, lights->pdf(ray.origin(), rec)) *
+          throughput * emmitted(material);
+    } else {
+      radiance += throughput * emmitted(material);
+    }
+
+    Ray scattered;
+    Vector3f attenuation;
+    if (depth >= settings.max_depth) {
+      break;
+    }
+    RT_STAT(++stats::local().scatter[static_cast<std::size_t>(material.kind)]);
+    if (lights != nullptr && material.kind == MaterialKind::Lambertian) {
+      if (depth == 0 && first_light != nullptr) {
+        radiance += throughput * *first_light;
+      } else {
+        sampler.start_bounce(depth, Sampler::LIGHT_DIMENSION);
+        radiance += throughput * direct_light(material, rec, world, *lights, sampler);
+      }
+      sampler.start_bounce(depth);
+      scatter_cosine(material, ray, rec, attenuation, scattered, sampler);
+      bounce_pdf = std::max(0.0f, dot(rec.normal, unit_vector(scattered.dir()))) /
+          static_cast<float>(M_PI);
+    } else {
+      sampler.start_bounce(depth);
+      if (!scatter(material, ray, rec, attenuation, scattered, sampler)) {
+        break;
+      }
+      bounce_pdf = 0;
+    }
+    throughput *= attenuation;
+
+    if (!russian_roulette(depth, settings, throughput, sampler)) {
+      break;
+    }
+
+    ray = std::move(scattered);
+    RT_STAT(++stats::local().rays);
+    if (!world.hit(ray, RAY_T_MIN, FLT_MAX, rec)) {
+      radiance += throughput * miss_color(ray, settings.background);
+      break;
+    }
+  }
+  // The path ends on its (depth + 1)th surface, or just after it
+  RT_STAT(stats::local().add_depth(depth + 1));
+  return radiance;
+}
+
+/*!
+ * \brief ray_color() for a world of type World, with settings of type
+ *        Settings, see shade_path()
+ */
+template<typename World, typename Settings>
+Vector3f trace_path(const Ray& r, const World& world, const Settings& settings,
+                    Sampler& sampler) {
+  Hit rec;
+  RT_STAT(++stats::local().rays);
+  if (world.hit(r, RAY_T_MIN, FLT_MAX, rec)) {
+    return shade_path(r, rec, world, settings, sampler);
+  }
+  RT_STAT(stats::local().add_depth(0));
+  return miss_color(r, settings.background);
+}
+
+/*!
+ * \brief Features of a camera ray \p r whose first hit is \p rec, on one of
+ *        \p materials
+ */
+inline Features hit_features(const MaterialTable& materials, const Ray& r, const Hit& rec) {
+  Features f;
+  f.albedo = albedo(materials[rec.material], rec);
+  f.normal = rec.normal;
+  f.depth = rec.t * r.dir().norm2();
+  f.material = rec.material;
+  return f;
+}
+
+/*!
+ * \brief Features of a camera ray that misses everything
+ */
+inline Features miss_features() {
+  Features f;
+  f.albedo = Vector3f{1, 1, 1};
+  return f;
+}
+
+/*!
+ * \brief Functions that take the samples of the path engine
+ *
+ * The default ones are ray_color() and shade(), which work with any world
+ * through the virtual interface. static_path_kernel() makes ones compiled for
+ * a world type and fixed settings.
+ */
+struct PathKernel {
+  using Color = Vector3f (*)(const Ray& r, const Hitable& world,
+                             const PathSettings& settings, Sampler& sampler);
+  using Shade = Vector3f (*)(const Ray& r, const Hit& rec, const Hitable& world,
+                             const PathSettings& settings, Sampler& sampler,
+                             const Vector3f* first_light);
+
+  Color color = ray_color;
+  Shade shade = rt::shade;
+};
+
+template<typename World, bool Background, int MaxDepth>
+Vector3f static_ray_color(const Ray& r, const Hitable& world, const PathSettings& settings,
+                          Sampler& sampler) {
+  return trace_path(r, static_cast<const World&>(world),
+                    StaticPathSettings<Background, MaxDepth>{settings.materials, settings.rr_depth,
+                                                             settings.lights},
+                    sampler);
+}
+
+template<typename World, bool Background, int MaxDepth>
+Vector3f static_shade(const Ray& r, const Hit& rec, const Hitable& world,
+                      const PathSettings& settings, Sampler& sampler,
+                      const Vector3f* first_light) {
+  return shade_path(r, rec, static_cast<const World&>(world),
+                    StaticPathSettings<Background, MaxDepth>{settings.materials, settings.rr_depth,
+                                                             settings.lights},
+                    sampler, first_light);
+}
+
+/*!
+ * \brief Path kernel for worlds of type World, which the world it is called
+ *        with must be, with the background and the depth limit fixed
+ */
+template<typename World, bool Background, int MaxDepth>
+PathKernel static_path_kernel() {
+  PathKernel kernel;
+  kernel.color = static_ray_color<World, Background, MaxDepth>;
+  kernel.shade = static_shade<World, Background, MaxDepth>;
+  return kernel;
+}
+
+/*!
+ * \brief Best kernel for \p world and \p settings: a static_path_kernel() if
+ *        the world is one of the final types of the library (HitableList,
+ *        BVH, SphereSet, MappedScene) and max_depth is DEFAULT_MAX_DEPTH, the
+ *        default one otherwise. Both give the same colors
+ */
+PathKernel path_kernel(const Hitable& world, const PathSettings& settings);
+
+} // namespace rt
+
+#endif // PATH_HPP
@@ -0,0 +1,83 @@
+#ifndef RANDOM_HPP
+#define RANDOM_HPP
+
+#include <cstdint>
+
+namespace rt {
+
+/*!
+ * \brief Small, fast and seedable pseudo random number generator (xoshiro128+)
+ *
+ * The generator state is 16 bytes and producing a number is a handful of
+ * shifts and xors, so it is cheap enough to be used on every sample. There is
+ * no global state: every thread, pixel or path owns its own instance. Streams
+ * derived from the same seed with for_stream() are independent of each other,
+ * which is what makes renders reproducible whatever the thread count.
+ *
+ * It models UniformRandomBitGenerator, so it can also be plugged into the
+ * standard library distributions.
+ */
+class Random {
+ public:
+  using result_type = std::uint32_t;
+
+  /*!
+   * \brief Initialize the state from a 64 bit seed
+   */
+  explicit Random(std::uint64_t seed = 0) {
+    for (auto& s : s_) {
+      s = static_cast<std::uint32_t>(splitmix64(seed) >> 32);
+    }
+  }
+
+  /*!
+   * \brief Generator for stream number \p stream of \p seed
+   *
+   * Used to give each pixel (or path) its own deterministic sequence
+   */
+  static Random for_stream(std::uint64_t seed, std::uint64_t stream) {
+    std::uint64_t state = seed;
+    return Random{splitmix64(state) ^ (stream * 0xD1B54A32D192ED03ULL)};
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT32_MAX; }
+
+  /*!
+   * \brief Next 32 random bits
+   */
+  result_type operator()() {
+    const auto result = s_[0] + s_[3];
+    const auto t = s_[1] << 9;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = (s_[3] << 11) | (s_[3] >> 21);
+    return result;
+  }
+
+  /*!
+   * \brief Uniformly distributed float in [0, 1)
+   *
+   * The low bits of xoshiro128+ are weak, only the top 24 are used
+   */
+  float uniform() {
+    return static_cast<float>((*this)() >> 8) * (1.0f / 16777216.0f);
+  }
+
+ private:
+  static std::uint64_t splitmix64(std::uint64_t& state) {
+    auto z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  std::uint32_t s_[4];
+};
+
+} // namespace rt
+
+#endif // RANDOM_HPP
@@ -1,15 +1,17 @@
 #ifndef RAY_HPP
 #define RAY_HPP
 
-#include <random>
-
+#include <algorithm>
 #include <cfloat>
 #include <hitable.hpp>
+#include <sampler.hpp>
 #include <vector.hpp>
 
-
 namespace rt {
 
+class Lights;
+class MaterialTable;
+
 /*
  * \brief A ray is essentially a straing line with a defined origin and direction
  *
@@ -50,7 +52,92 @@ class Ray {
   Vector3f dir_;
 };
 
-Vector3f ray_color(const rt::Ray& r, const Hitable& world, int depth, bool background);
+/*!
+ * \brief Rays start this far from their origin, to avoid self intersections
+ */
+constexpr float RAY_T_MIN = 0.001f;
+
+/*!
+ * \brief Bounces after which paths are cut unless told otherwise
+ */
+constexpr int DEFAULT_MAX_DEPTH = 50;
+
+/*!
+ * \brief Parameters of the path tracing loop
+ */
+struct PathSettings {
+  //! Materials the hits of the world refer to. Must be set to trace paths
+  const MaterialTable* materials = nullptr;
+  //! Bounces after which a path is cut
+  int max_depth = DEFAULT_MAX_DEPTH;
+  //! Bounces after which Russian roulette may terminate a path. Values of
+  //! max_depth or more disable it
+  int rr_depth = 5;
+  //! Use the sky gradient for rays that miss everything, black otherwise
+  bool background = false;
+  //! Lights sampled at every diffuse bounce (next event estimation), null
+  //! to only find lights when a bounce happens to hit them
+  const Lights* lights = nullptr;
+};
+
+/*!
+ * \brief Russian roulette after the bounce at \p depth
+ *
+ * Past rr_depth bounces a path survives with a probability that follows its
+ * throughput, and survivors are weighted up by the inverse of that
+ * probability. This keeps the estimate unbiased while dropping the paths that
+ * would contribute little.
+ *
+ * \return false if the path is terminated
+ */
+template<typename Settings>
+bool russian_roulette(int depth, const Settings& settings, Vector3f& throughput,
+                      Sampler& sampler) {
+  if (depth + 1 < settings.rr_depth) {
+    return true;
+  }
+  sampler.start_bounce(depth, Sampler::ROULETTE_DIMENSION);
+  const auto survive = std::min(std::max({throughput.x(), throughput.y(), throughput.z()}),
+                                0.95f);
+  if (sampler.uniform() >= survive) {
+    return false;
+  }
+  throughput /= survive;
+  return true;
+}
+
+/*!
+ * \brief Color carried back by a Ray traced through the world
+ */
+Vector3f ray_color(const rt::Ray& r, const Hitable& world, const PathSettings& settings,
+                   Sampler& sampler);
+
+/*!
+ * \brief Color carried back by a Ray whose closest hit is already known
+ *
+ * Lets packet tracing intersect the first segment of many paths together and
+ * continue each one on its own.
+ *
+ * \param first_light Light that the light sample of the first bounce brings
+ *        to \p rec, when the caller already took that sample (from the light
+ *        dimensions of the bounce) and traced its shadow ray, null otherwise
+ */
+Vector3f shade(const rt::Ray& r, const Hit& rec, const Hitable& world,
+               const PathSettings& settings, Sampler& sampler,
+               const Vector3f* first_light = nullptr);
+
+/*!
+ * \brief Color of a Ray that escaped the world
+ */
+inline Vector3f miss_color(const rt::Ray& r, bool background) {
+  if (!background) {
+    return {0,0,0};
+  } else {
+    Vector3f unit_dir = unit_vector(r.dir());
+    float t = 0.5 * (unit_dir.y() + 1.0);
+    return (1.0 - t) * rt::Vector3f{1.0, 1.0, 1.0} + t * rt::Vector3f{0.5, 0.7, 1.0};
+  }
+}
 
 }
 
@@ -1,21 +1,270 @@
 #ifndef RENDER_HPP
 #define RENDER_HPP
 
+#include <cstdint>
 #include <string>
+#include <type_traits>
+#include <vector>
+
+#include <camera.hpp>
+#include <denoise.hpp>
+#include <image.hpp>
+#include <path.hpp>
+#include <sampler.hpp>
+#include <scheduler.hpp>
 
 namespace rt {
 
 class Hitable;
-class Camera;
-    
-void render(std::uint16_t width,
-	    std::uint16_t height,
+class Film;
+
+/*!
+ * \brief How paths are traced
+ */
+enum class Engine {
+  //! Every sample follows its path to the end before the next one starts
+  Path,
+  //! Paths advance together one bounce at a time, see WavefrontTracer
+  Wavefront
+};
+
+/*!
+ * \brief Knobs that control how an image is rendered
+ */
+struct RenderOptions {
+  //! Use the sky gradient for rays that miss everything, black otherwise
+  bool background = false;
+  //! Bounces after which a path is cut
+  int max_depth = DEFAULT_MAX_DEPTH;
+  //! Bounces after which paths are subject to Russian roulette. Values of
+  //! max_depth or more disable it
+  int rr_depth = 5;
+  //! Sample the emissive spheres of the world at every diffuse bounce
+  //! (next event estimation), combined with the lights paths hit through
+  //! multiple importance sampling. Much less noise from small lights, but
+  //! diffuse bounces then follow the exact cosine distribution, so images
+  //! differ from renders without it
+  bool light_sampling = false;
+  //! Path tracing engine. The wavefront engine ignores packet_size and
+  //! adaptive sampling
+  Engine engine = Engine::Path;
+  //! Paths the wavefront engine keeps in flight per worker thread
+  std::size_t wavefront_size = 1 << 14;
+  //! Seed of the per pixel random streams. Same seed, same image, whatever
+  //! the number of threads
+  std::uint64_t seed = 0;
+  //! How the samples of a pixel are placed. The wavefront engine always
+  //! uses independent random samples
+  SamplerKind sampler = SamplerKind::Random;
+  //! Primary rays of a block of pixels traced together as a packet, along
+  //! with the shadow rays of their first bounce: 1 (no packets), 4, 8 or 16
+  std::uint32_t packet_size = 1;
+  //! Side of the square tiles the image is split into for scheduling
+  std::uint32_t tile_size = 16;
+  //! Worker threads, 0 means one per hardware thread
+  unsigned threads = 0;
+  //! Threading backend of the tile scheduler
+  Backend backend = default_backend();
+
+  //! Sample each pixel until its estimate is good enough instead of taking
+  //! exactly anti_alias samples. anti_alias is then the average budget of
+  //! every tile: flat regions stop early and leave their samples to the
+  //! noisy ones, which keep sampling up to max_spp
+  bool adaptive = false;
+  std::uint32_t min_spp = 8;
+  std::uint32_t max_spp = 256;
+  //! Adaptive sampling stops once the 95% confidence interval of the pixel
+  //! luminance (after the sqrt tonemap) is narrower than this, in [0, 1] units
+  float threshold = 0.01f;
+
+  //! Render in passes of pass_spp samples per pixel into a float
+  //! accumulation buffer, instead of all the samples of a tile at once.
+  //! Adaptive sampling is not used in progressive renders
+  bool progressive = false;
+  std::uint32_t pass_spp = 1;
+  //! Progressive renders save the accumulation buffer and their progress to
+  //! this file (and refresh the output image) every checkpoint_interval
+  //! seconds and when they finish. Empty disables checkpoints
+  std::string checkpoint;
+  float checkpoint_interval = 60;
+  //! Continue from the checkpoint if it exists. The render then adds
+  //! samples until every pixel has anti_alias of them, so a finished render
+  //! can be resumed with a higher anti_alias to refine it
+  bool resume = false;
+
+  //! Render the image in bands of this many rows, top band first, and write
+  //! every band as soon as it is done. Only one band is in memory at a time,
+  //! whatever the size of the image. 0 renders the whole image at once.
+  //! Progressive renders, which need the whole image, ignore it
+  std::uint32_t band_rows = 0;
+
+  //! The image format follows the extension of the output path: .png (also
+  //! for paths without one) and .ppm get the tonemapped 8 bit image, .pfm
+  //! and .exr the linear float values. Renders refuse other extensions with
+  //! a std::runtime_error before they start. EXR files are stored as 16 bit
+  //! half floats if set
+  bool half_float = false;
+  //! Encoding of PNG images
+  PNGOptions png;
+
+  //! Denoise images before writing them (see denoise()), guided by the
+  //! albedo, normal and depth of the first hit of every sample, which the
+  //! render then captures. Band renders are not denoised
+  bool denoise = false;
+  DenoiseOptions denoiser;
+
+  //! Arbitrary output variables written along with the image, from the
+  //! first hits of the same samples (see AOV). EXR images get them as
+  //! layers, named after the AOV (normal.X, albedo.R, depth.Z, material.id,
+  //! samples.count). Other formats get an image of every AOV next to the
+  //! image, with the name of the AOV before the extension: image.png comes
+  //! with image.normal.png... 8 bit images show normals mapped to [0, 1],
+  //! depths in [0, depth_range] from black to white, a color per material
+  //! and the sample counts as gray levels
+  std::vector<AOV> aovs;
+  //! Depth shown white in 8 bit depth images. 0 takes the farthest hit of
+  //! the image, or of every band in band renders
+  float depth_range = 0;
+
+  //! Write the counters of the render (see stats.hpp) to this JSON file.
+  //! Empty writes nothing. Only builds with USE_STATS count anything, others
+  //! ignore it
+  std::string stats;
+  //! Write the time spent on every pixel as a heatmap image to this file,
+  //! under the same condition. The times of the whole image are kept, even
+  //! when rendering in bands
+  std::string heatmap;
+};
+
+void render(std::uint32_t width,
+	    std::uint32_t height,
 	    const Hitable& world,
+	    const MaterialTable& materials,
 	    const Camera& cam,
 	    std::uint16_t anti_alias,
 	    const std::string& filepath,
 	    bool background = false);
-    
+
+/*!
+ * \brief Render an image of \p world, whose hits refer to \p materials, to
+ *        \p filepath
+ *
+ * The path engine takes its samples with path_kernel(), which is compiled
+ * for the type of the world when it is one of the library's.
+ */
+void render(std::uint32_t width,
+	    std::uint32_t height,
+	    const Hitable& world,
+	    const MaterialTable& materials,
+	    const Camera& cam,
+	    std::uint16_t anti_alias,
+	    const std::string& filepath,
+	    const RenderOptions& options);
+
+/*!
+ * \brief render() with the samples of the path engine taken by \p kernel,
+ *        which must accept \p world and \p options. The wavefront engine
+ *        has its own loop and ignores it
+ */
+void render(std::uint32_t width,
+	    std::uint32_t height,
+	    const Hitable& world,
+	    const MaterialTable& materials,
+	    const Camera& cam,
+	    std::uint16_t anti_alias,
+	    const std::string& filepath,
+	    const RenderOptions& options,
+	    const PathKernel& kernel);
+
+/*!
+ * \brief render() with the path loop compiled for worlds of type World, and
+ *        for the background and depth limit given as template arguments
+ *
+ * World must be a final class for hits to skip the vtable. The background
+ * and max_depth of \p options are replaced by Background and MaxDepth:
+ *
+ *     rt::render<true, 50>(width, height, bvh, materials, cam, spp, "image.png", options);
+ */
+template<bool Background, int MaxDepth, typename World>
+void render(std::uint32_t width,
+	    std::uint32_t height,
+	    const World& world,
+	    const MaterialTable& materials,
+	    const Camera& cam,
+	    std::uint16_t anti_alias,
+	    const std::string& filepath,
+	    RenderOptions options = RenderOptions{}) {
+  static_assert(std::is_base_of<Hitable, World>::value, "Worlds are Hitables");
+  options.background = Background;
+  options.max_depth = MaxDepth;
+  render(width, height, world, materials, cam, anti_alias, filepath, options,
+         static_path_kernel<World, Background, MaxDepth>());
+}
+
+/*!
+ * \brief Write a film to \p filepath, in the format its extension selects,
+ *        as render() writes its images: denoised with options.denoise, if
+ *        the film has a feature buffer, and with the AOVs of options.aovs,
+ *        which need it too except for the sample count
+ */
+void write_film(const Film& film, const std::string& filepath, const RenderOptions& options);
+
+/*!
+ * \brief Add spp samples of pass \p pass to every pixel of \p region of a
+ *        width x height image, without writing anything
+ *
+ * The samples are the same render() takes for those pixels in that pass, so
+ * regions rendered separately (by other processes for instance) and added
+ * to one film give the image render() writes. \p film must cover the region.
+ * Progressive options only matter in that they disable adaptive sampling.
+ * If \p film has a feature buffer, the features of the samples are added to
+ * it as well.
+ */
+void render_region(std::uint32_t width,
+		   std::uint32_t height,
+		   const Hitable& world,
+		   const MaterialTable& materials,
+		   const Camera& cam,
+		   const Tile& region,
+		   std::uint32_t pass,
+		   std::uint32_t spp,
+		   const RenderOptions& options,
+		   Film& film);
+
+/*!
+ * \brief One image of a batch: a view of the world and where to write it
+ */
+struct RenderJob {
+  Camera cam;
+  std::uint32_t width;
+  std::uint32_t height;
+  std::uint16_t anti_alias;
+  std::string filepath;
+};
+
+/*!
+ * \brief Render every job of \p jobs from one world, as render() would with
+ *        the same options, but as a single stream of tiles
+ *
+ * The worker threads are started once for the whole batch and take the tiles
+ * of the jobs in order, so the next image starts while the last tiles of the
+ * previous one are being traced. Finished images are written by a thread of
+ * their own while the workers render the next ones. At most \p max_frames
+ * images are in memory, rendering or waiting to be written; workers wait for
+ * the writer before starting more.
+ *
+ * Progressive, band, checkpoint and stats options are ignored: every image is
+ * rendered whole in a single pass.
+ *
+ * \throw std::runtime_error if a job has no pixels, or an image cannot be
+ *        written. Images are written in the order they are finished
+ */
+void render_batch(const Hitable& world,
+		  const MaterialTable& materials,
+		  const std::vector<RenderJob>& jobs,
+		  const RenderOptions& options,
+		  std::size_t max_frames = 4);
+
 } // namespace rt
 
 #endif // RENDER_HPP
@@ -0,0 +1,129 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <cstdint>
+
+#include <random.hpp>
+#include <vector.hpp>
+
+namespace rt {
+
+/*!
+ * \brief How the samples of a pixel are placed
+ */
+enum class SamplerKind : std::uint8_t {
+  //! Independent random numbers from the pixel stream
+  Random,
+  //! Halton sequence, with digits Owen scrambled per pixel. Dimensions past
+  //! the first HALTON_DIMENSIONS are random
+  Halton,
+  //! Owen scrambled Sobol sequence, scrambled per pixel. Dimensions are
+  //! taken 4 at a time from the first 4 of the sequence, each group with its
+  //! own scramble, so there is no limit on their number
+  Sobol,
+  //! Sobol sequence scrambled the same way in every pixel, and shifted per
+  //! pixel by the values of a blue noise mask. The error of neighbouring
+  //! pixels is then negatively correlated, and looks like high frequency
+  //! noise rather than blotches
+  BlueNoise
+};
+
+//! Dimensions of the Halton sampler that come from the sequence
+constexpr std::uint32_t HALTON_DIMENSIONS = 32;
+
+/*!
+ * \brief Source of the numbers a path consumes: the position in the pixel,
+ *        on the lens and every bounce
+ *
+ * Low discrepancy samplers hand out point \p index of a sequence, one
+ * dimension per number, so that the samples of a pixel cover the space of
+ * paths evenly instead of clumping like independent random numbers do.
+ * Dimensions are laid out per bounce: 0 and 1 jitter the pixel, 2 and 3 the
+ * lens, then every bounce starts at a fixed dimension (start_bounce()), so
+ * that the same dimension always drives the same decision.
+ *
+ * The Random kind returns the numbers of its Random stream, in the order
+ * the code asked for them before samplers existed, so images rendered with
+ * it are unchanged.
+ */
+class Sampler {
+ public:
+  //! First dimension of bounce 0, and dimensions per bounce
+  static constexpr std::uint32_t FIRST_BOUNCE_DIMENSION = 4;
+  static constexpr std::uint32_t BOUNCE_DIMENSIONS = 8;
+  //! Dimension of a bounce used by Russian roulette, after the 3 that
+  //! scattering may use
+  static constexpr std::uint32_t ROULETTE_DIMENSION = 3;
+  //! First of the 2 dimensions of a bounce that sample the lights
+  static constexpr std::uint32_t LIGHT_DIMENSION = 4;
+
+  Sampler() = default;
+
+  /*!
+   * \brief Independent random numbers from \p rng
+   */
+  explicit Sampler(const Random& rng) : rng_{rng} {}
+
+  /*!
+   * \brief Sampler of pixel (x, y) of a render with seed \p seed
+   *
+   * \param rng Random stream of the pixel. It gives the numbers of the
+   *        Random kind, and those past the dimensions of a sequence
+   */
+  Sampler(SamplerKind kind, std::uint64_t seed, std::uint32_t x, std::uint32_t y,
+          const Random& rng);
+
+  /*!
+   * \brief Start sample \p index of the pixel, at dimension 0
+   */
+  void start_sample(std::uint32_t index) {
+    index_ = index;
+    dimension_ = 0;
+  }
+
+  /*!
+   * \brief Move to dimension \p offset of bounce \p depth
+   */
+  void start_bounce(int depth, std::uint32_t offset = 0) {
+    dimension_ = FIRST_BOUNCE_DIMENSION + static_cast<std::uint32_t>(depth) * BOUNCE_DIMENSIONS +
+        offset;
+  }
+
+  /*!
+   * \brief Next number, in [0, 1)
+   */
+  float uniform() {
+    if (kind_ == SamplerKind::Random) {
+      return rng_.uniform();
+    }
+    return sample(dimension_++);
+  }
+
+  /*!
+   * \brief Point in the unit sphere, from 3 dimensions
+   */
+  Vector3f in_unit_sphere();
+
+  /*!
+   * \brief Point in the unit disk of the z = 0 plane, from 2 dimensions
+   */
+  Vector3f in_unit_disk();
+
+  SamplerKind kind() const { return kind_; }
+
+ private:
+  float sample(std::uint32_t dimension);
+
+  SamplerKind kind_ = SamplerKind::Random;
+  Random rng_;
+  std::uint32_t x_ = 0;
+  std::uint32_t y_ = 0;
+  //! Scramble of the sequence: per pixel, or per render for blue noise
+  std::uint32_t scramble_ = 0;
+  std::uint32_t index_ = 0;
+  std::uint32_t dimension_ = 0;
+};
+
+} // namespace rt
+
+#endif // SAMPLER_HPP
@@ -0,0 +1,93 @@
+#ifndef SCENE_FILE_HPP
+#define SCENE_FILE_HPP
+
+#include <cstdint>
+#include <string>
+
+#include <hitable.hpp>
+#include <material.hpp>
+#include <sphere_set.hpp>
+
+namespace rt {
+
+/*!
+ * \brief Write a SphereSet, and the materials of \p table it uses, to a
+ *        binary scene file
+ *
+ * The file holds the padded sphere arrays exactly as SphereSet stores them
+ * in memory, so that MappedScene can use them in place. If the set is
+ * accelerated its BVH is stored as well, and loading skips the build.
+ * Materials keep their ids, so a MappedScene of the file reports the same
+ * hits, materials included, as the set with \p table.
+ * Files use the byte order of the machine that wrote them.
+ *
+ * \throw std::runtime_error if the file cannot be written, or a material
+ *        uses a texture that cannot be stored (only constant and checker
+ *        textures can)
+ */
+void save_scene(const std::string& path, const SphereSet& spheres,
+                const MaterialTable& table);
+
+/*!
+ * \brief Spheres of a scene file, memory mapped
+ *
+ * Loading maps the file and points a SphereSetView at it: the geometry and
+ * the BVH are neither parsed nor copied, pages are read on first use. Only
+ * the materials are copied, into the table of the scene, which it is
+ * rendered with.
+ */
+class MappedScene final : public Hitable {
+ public:
+  /*!
+   * \throw std::runtime_error if the file cannot be mapped or is not a
+   *        scene file, or if it holds material ids, material kinds or BVH
+   *        nodes out of range
+   */
+  explicit MappedScene(const std::string& path);
+  ~MappedScene();
+
+  MappedScene(const MappedScene&) = delete;
+  MappedScene& operator=(const MappedScene&) = delete;
+
+  std::size_t size() const { return view_.size; }
+  const MaterialTable& materials() const { return materials_; }
+  //! Whether the file had a BVH
+  bool accelerated() const { return view_.nodes != nullptr; }
+
+  virtual bool hit(const Ray& r, float t_min, float t_max, Hit& rec) const override {
+    return view_.hit(r, t_min, t_max, rec);
+  }
+
+  virtual bool occluded(const Ray& r, float t_min, float t_max) const override {
+    return view_.occluded(r, t_min, t_max);
+  }
+
+  virtual std::uint32_t hit_packet(const RayPacket& packet, std::uint32_t active,
+                                   float t_min, HitPacket& hits) const override {
+    return view_.hit_packet(packet, active, t_min, hits);
+  }
+
+  virtual std::uint32_t occluded_packet(const RayPacket& packet, std::uint32_t active,
+                                        float t_min, const float* t_max) const override {
+    return view_.occluded_packet(packet, active, t_min, t_max);
+  }
+
+  virtual bool bounding_box(AABB& box) const override {
+    return view_.bounding_box(box);
+  }
+
+  virtual void collect_lights(const MaterialTable& materials,
+                              std::vector<SphereLight>& lights) const override {
+    view_.collect_lights(materials, lights);
+  }
+
+ private:
+  void* data_;
+  std::size_t length_;
+  SphereSetView view_;
+  MaterialTable materials_;
+};
+
+} // namespace rt
+
+#endif // SCENE_FILE_HPP
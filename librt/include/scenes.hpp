@@ -0,0 +1,57 @@
+#ifndef SCENES_HPP
+#define SCENES_HPP
+
+#include <memory>
+
+#include <arena.hpp>
+#include <camera.hpp>
+#include <hitable_list.hpp>
+#include <material.hpp>
+#include <random.hpp>
+#include <sphere_set.hpp>
+#include <texture.hpp>
+
+namespace rt {
+
+/*!
+ * \brief Small scene of a few spheres lit by two lights
+ *
+ * Its textures and materials are registered in \p textures and \p materials,
+ * which must outlive the objects. The spheres are built in \p arena, or on
+ * the heap if there is none.
+ */
+HitableList::HitablePtr lights_scene(MaterialRegistry& materials,
+                                     TextureRegistry& textures,
+                                     Arena* arena = nullptr);
+
+/*!
+ * \brief Cover scene of the book: a few hundred small spheres of random
+ *        materials around three big ones, on a checkered floor
+ *
+ * The scene only depends on the state of \p rng, so the same seed always
+ * gives the same scene. The spheres are built in \p arena, or on the heap if
+ * there is none; the scene is the same either way.
+ */
+HitableList::HitablePtr random_scene(MaterialRegistry& materials,
+                                     TextureRegistry& textures,
+                                     Random& rng,
+                                     Arena* arena = nullptr);
+
+/*!
+ * \brief Camera both scenes are rendered with, for images of aspect ratio
+ *        \p ratio (width / height)
+ */
+Camera scene_camera(float ratio);
+
+/*!
+ * \brief Copy the objects into a SphereSet. Every object of the scenes above
+ *        is a Sphere
+ *
+ * \param accelerate Build the BVH of the set
+ */
+std::unique_ptr<SphereSet> make_sphere_set(const HitableList::HitablePtr& objects,
+                                           bool accelerate);
+
+} // namespace rt
+
+#endif // SCENES_HPP
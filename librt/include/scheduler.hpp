@@ -0,0 +1,85 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace rt {
+
+/*!
+ * \brief Rectangle of pixels [x0, x1) x [y0, y1)
+ */
+struct Tile {
+  std::uint32_t x0, y0;
+  std::uint32_t x1, y1;
+};
+
+/*!
+ * \brief Split an image into tiles of (at most) tile_size x tile_size pixels
+ *
+ * Tiles are returned in Morton (Z curve) order, so tiles that are close in
+ * the list are close in the image, and tend to touch the same objects.
+ */
+std::vector<Tile> make_tiles(std::uint32_t width, std::uint32_t height,
+                             std::uint32_t tile_size);
+
+/*!
+ * \brief How the worker threads of a TileScheduler are created
+ */
+enum class Backend {
+  OpenMP,
+  Threads
+};
+
+/*!
+ * \brief Backend used when none is requested: OpenMP when the library is
+ *        built with it, std::thread otherwise
+ */
+constexpr Backend default_backend() {
+#ifdef USE_OMP
+  return Backend::OpenMP;
+#else
+  return Backend::Threads;
+#endif
+}
+
+/*!
+ * \brief Runs a function over a list of tiles with work stealing
+ *
+ * Every worker starts with a contiguous run of tiles in its own deque, which
+ * it consumes from the front. A worker whose deque is empty steals from the
+ * back of the others, so expensive tiles never leave the rest of the threads
+ * idle. A single parallel region is used for the whole list.
+ */
+class TileScheduler {
+ public:
+  using TileFunction = std::function<void(const Tile& tile, unsigned worker)>;
+  using WorkerFunction = std::function<void(unsigned worker)>;
+
+  /*!
+   * \param threads Number of workers, 0 means one per hardware thread
+   */
+  explicit TileScheduler(unsigned threads = 0, Backend backend = default_backend());
+
+  /*!
+   * \brief Call f(tile, worker) once for every tile. worker is in [0, threads())
+   */
+  void run(const std::vector<Tile>& tiles, const TileFunction& f) const;
+
+  /*!
+   * \brief Call f(worker) once on every worker, all at the same time, for
+   *        work the workers share out themselves
+   */
+  void parallel(const WorkerFunction& f) const;
+
+  unsigned threads() const { return threads_; }
+
+ private:
+  unsigned threads_;
+  Backend backend_;
+};
+
+} // namespace rt
+
+#endif // SCHEDULER_HPP
@@ -5,18 +5,21 @@
 #include <vector.hpp>
 
 #include <hitable.hpp>
+#include <light.hpp>
+#include <material.hpp>
+#include <packet.hpp>
+#include <stats.hpp>
 
 namespace rt {
 
-class Material;
-
-class Sphere : public Hitable {
+class Sphere final : public Hitable {
  public:
   explicit Sphere() {}
-  explicit Sphere(const Vector3f center, float radius, Material* material) :
+  explicit Sphere(const Vector3f center, float radius, MaterialId material) :
       center_{center}, radius_{radius}, material_{material} {}
 
   virtual bool hit(const Ray& r, float t_min, float t_max, Hit& rec) const override {
+    RT_STAT(++stats::local().hit_calls);
     Vector3f oc = r.origin() - center_;
     auto a = float{dot(r.dir(), r.dir())};
     auto b = float{dot(oc, r.dir())};
@@ -43,10 +46,63 @@ class Sphere : public Hitable {
     return false;
   };
 
+  virtual std::uint32_t hit_packet(const RayPacket& packet, std::uint32_t active,
+                                   float t_min, HitPacket& hits) const override {
+    // Same test as hit(), one lane per iteration so the loop vectorizes
+    float t[MAX_PACKET_SIZE];
+    std::uint32_t mask = 0;
+    for (auto l = 0U ; l < packet.size ; ++l) {
+      const auto ocx = packet.ox[l] - center_.x();
+      const auto ocy = packet.oy[l] - center_.y();
+      const auto ocz = packet.oz[l] - center_.z();
+      const auto a = packet.dx[l] * packet.dx[l] + packet.dy[l] * packet.dy[l] +
+          packet.dz[l] * packet.dz[l];
+      const auto b = ocx * packet.dx[l] + ocy * packet.dy[l] + ocz * packet.dz[l];
+      const auto c = ocx * ocx + ocy * ocy + ocz * ocz - radius_ * radius_;
+      const auto discriminant = b * b - a * c;
+      const auto root = sqrtf(discriminant > 0 ? discriminant : 0);
+      const auto t1 = (-b - root) / a;
+      const auto t2 = (-b + root) / a;
+      const auto hit1 = t1 < hits.t[l] && t1 > t_min;
+      const auto hit2 = t2 < hits.t[l] && t2 > t_min;
+      t[l] = hit1 ? t1 : t2;
+      mask |= static_cast<std::uint32_t>(discriminant > 0 && (hit1 || hit2)) << l;
+    }
+    mask &= active;
+
+    for_each_lane(mask, [&](std::uint32_t l) {
+        auto& rec = hits.hit[l];
+        rec.t = t[l];
+        rec.p = packet.ray(l).point_at(t[l]);
+        rec.normal = (rec.p - center_) / radius_;
+        rec.material = material_;
+        hits.t[l] = t[l];
+      });
+    return mask;
+  }
+
+  virtual bool bounding_box(AABB& box) const override {
+    // Hollow spheres use a negative radius
+    const auto r = fabsf(radius_);
+    box = AABB{center_ - Vector3f{r, r, r}, center_ + Vector3f{r, r, r}};
+    return true;
+  }
+
+  virtual void collect_lights(const MaterialTable& materials,
+                              std::vector<SphereLight>& lights) const override {
+    if (emits(materials, material_)) {
+      lights.push_back(SphereLight{center_, radius_, material_});
+    }
+  }
+
+  const Vector3f& center() const { return center_; }
+  float radius() const { return radius_; }
+  MaterialId material() const { return material_; }
+
  private:
   Vector3f center_;
   float radius_;
-  Material* material_;
+  MaterialId material_;
 };
 }
 #endif //SPHERE_HPP
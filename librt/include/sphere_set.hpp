@@ -0,0 +1,157 @@
+#ifndef SPHERE_SET_HPP
+#define SPHERE_SET_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include <aligned_allocator.hpp>
+#include <bvh.hpp>
+#include <hitable.hpp>
+#include <packet.hpp>
+#include <ray.hpp>
+#include <vector.hpp>
+
+namespace rt {
+
+/*!
+ * \brief Read only view of spheres stored as a structure of arrays
+ *
+ * Arrays must be readable up to a multiple of SphereSoA::WIDTH elements past
+ * any range that is intersected; padding entries have NaN centers and never
+ * produce a hit.
+ */
+struct SphereSoA {
+  //! Widest SIMD kernel, in floats
+  static constexpr std::size_t WIDTH = 8;
+
+  const float* cx;
+  const float* cy;
+  const float* cz;
+  const float* radius;
+  //! Tie breaking key. Equal distance hits resolve to the lowest id
+  const std::int32_t* id;
+};
+
+/*!
+ * \brief Closest intersection between a Ray and spheres [first, first + count)
+ *
+ * Runs the quadratic test of Sphere::hit on 8 (AVX2), 4 (SSE2) or 1 sphere at
+ * a time depending on the target, and reduces the lanes to the closest hit.
+ * The result is the same as testing the spheres one after the other in id
+ * order with Sphere::hit.
+ *
+ * \param closest In/out. Only hits closer than this are reported
+ * \param closest_id In/out. Id of the current closest hit, -1 if none. A hit
+ *        at exactly \p closest is reported if its id is lower
+ * \param slot Output. Index of the sphere that was hit
+ * \return true if a closer hit was found
+ */
+bool intersect_spheres(const SphereSoA& spheres, const Ray& r, float t_min,
+                       std::size_t first, std::size_t count,
+                       float& closest, std::int32_t& closest_id, std::size_t& slot);
+
+/*!
+ * \brief Read only view of a SphereSet, wherever its arrays are stored
+ *
+ * This is what SphereSet queries run on, so that spheres loaded from a file
+ * (see MappedScene) are intersected by the same code.
+ */
+struct SphereSetView {
+  SphereSoA spheres;
+  //! Material of every sphere
+  const MaterialId* material;
+  std::size_t size;
+  //! BVH whose leaves are ranges of the arrays, null to test every sphere
+  const BVHNode* nodes;
+  std::size_t node_count;
+
+  bool hit(const Ray& r, float t_min, float t_max, Hit& rec) const;
+  bool occluded(const Ray& r, float t_min, float t_max) const;
+  std::uint32_t hit_packet(const RayPacket& packet, std::uint32_t active,
+                           float t_min, HitPacket& hits) const;
+  std::uint32_t occluded_packet(const RayPacket& packet, std::uint32_t active,
+                                float t_min, const float* t_max) const;
+  bool bounding_box(AABB& box) const;
+  void collect_lights(const MaterialTable& materials, std::vector<SphereLight>& lights) const;
+
+ private:
+  void fill_hit(const Ray& r, float t, std::size_t slot, Hit& rec) const;
+};
+
+/*!
+ * \brief Set of spheres intersected with SIMD kernels
+ *
+ * Centers, radii and material ids are stored in separate 32 byte aligned
+ * arrays. The set can be intersected as a flat collection, or accelerated
+ * with a BVH whose leaves are contiguous ranges of the arrays. Either way the
+ * closest hit is the same a HitableList of the same spheres reports.
+ */
+class SphereSet final : public Hitable {
+ public:
+  SphereSet() = default;
+
+  /*!
+   * \brief Append a sphere. Invalidates the BVH built by accelerate()
+   */
+  void add(const Vector3f& center, float radius, MaterialId material);
+
+  /*!
+   * \brief Build a BVH over the spheres, reordering them so that every leaf
+   *        is a contiguous range intersected by the SIMD kernel
+   */
+  void accelerate(std::size_t max_leaf_size = 8);
+
+  std::size_t size() const { return size_; }
+
+  virtual bool hit(const Ray& r, float t_min, float t_max, Hit& rec) const override {
+    return view().hit(r, t_min, t_max, rec);
+  }
+
+  virtual bool occluded(const Ray& r, float t_min, float t_max) const override {
+    return view().occluded(r, t_min, t_max);
+  }
+
+  virtual std::uint32_t hit_packet(const RayPacket& packet, std::uint32_t active,
+                                   float t_min, HitPacket& hits) const override {
+    return view().hit_packet(packet, active, t_min, hits);
+  }
+
+  virtual std::uint32_t occluded_packet(const RayPacket& packet, std::uint32_t active,
+                                        float t_min, const float* t_max) const override {
+    return view().occluded_packet(packet, active, t_min, t_max);
+  }
+
+  virtual bool bounding_box(AABB& box) const override {
+    return view().bounding_box(box);
+  }
+
+  virtual void collect_lights(const MaterialTable& materials,
+                              std::vector<SphereLight>& lights) const override {
+    view().collect_lights(materials, lights);
+  }
+
+  /*!
+   * \brief The arrays (padded), and the BVH if the set is accelerated
+   */
+  SphereSetView view() const {
+    return SphereSetView{
+      SphereSoA{cx_.data(), cy_.data(), cz_.data(), radius_.data(), id_.data()},
+      material_.data(), size_, nodes_.empty() ? nullptr : nodes_.data(), nodes_.size()};
+  }
+
+ private:
+  template<typename T>
+  using Array = std::vector<T, AlignedAllocator<T, 32>>;
+
+  void pad();
+
+  std::size_t size_ = 0;
+  Array<float> cx_, cy_, cz_, radius_;
+  Array<std::int32_t> id_;
+  Array<MaterialId> material_;
+  std::vector<BVHNode> nodes_;
+};
+
+} // namespace rt
+
+#endif // SPHERE_SET_HPP
@@ -0,0 +1,134 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <material.hpp>
+#include <scheduler.hpp>
+
+/*!
+ * \brief Run a statement only in builds with instrumentation (USE_STATS)
+ *
+ * Without USE_STATS the statement disappears, so the counters cost nothing
+ * in regular builds:
+ *
+ *     RT_STAT(++stats::local().rays);
+ */
+#ifdef USE_STATS
+#define RT_STAT(statement) statement
+#else
+#define RT_STAT(statement)
+#endif
+
+namespace rt {
+
+/*!
+ * \brief Whether the library is built with USE_STATS. Without it the
+ *        counters stay at zero and no report is written
+ */
+constexpr bool stats_enabled() {
+#ifdef USE_STATS
+  return true;
+#else
+  return false;
+#endif
+}
+
+namespace stats {
+
+//! Paths are counted in the depth histogram up to this number of bounces,
+//! longer ones go to the last bin
+constexpr std::size_t DEPTH_BINS = 64;
+
+/*!
+ * \brief Time a worker spent on one tile of one pass
+ */
+struct TileTime {
+  Tile tile;
+  unsigned worker;
+  double seconds;
+};
+
+/*!
+ * \brief Counters of a render
+ */
+struct Counters {
+  //! Rays cast into the world: camera rays and bounces
+  std::uint64_t rays = 0;
+  //! Calls to Hitable::hit at every level: the world, and each object a
+  //! list or a BVH tests
+  std::uint64_t hit_calls = 0;
+  //! BVH nodes whose box was tested, by single rays and packets
+  std::uint64_t bvh_nodes = 0;
+  //! Scatter calls by MaterialKind. Light hits end the path
+  std::uint64_t scatter[MATERIAL_KINDS] = {};
+  //! Finished paths by number of surfaces they hit
+  std::uint64_t depth[DEPTH_BINS] = {};
+  std::vector<TileTime> tiles;
+
+  void add_depth(int bounces) {
+    ++depth[std::min(static_cast<std::size_t>(bounces), DEPTH_BINS - 1)];
+  }
+
+  void merge(const Counters& other);
+};
+
+/*!
+ * \brief Counters of the calling thread, registered for collect() while the
+ *        thread lives, and folded into the totals when it exits
+ */
+class ThreadCounters {
+ public:
+  ThreadCounters();
+  ~ThreadCounters();
+
+  Counters counters;
+};
+
+/*!
+ * \brief Counters of the calling thread. Incrementing them takes no lock
+ */
+inline Counters& local() {
+  thread_local ThreadCounters counters;
+  return counters.counters;
+}
+
+/*!
+ * \brief Zero the counters of every thread. Only call it while no thread is
+ *        counting, like before a render
+ */
+void reset();
+
+/*!
+ * \brief Sum of the counters of every thread since the last reset(). Only
+ *        call it while no thread is counting, like after a render
+ */
+Counters collect();
+
+/*!
+ * \brief Write the counters of a render as JSON: the totals, the depth
+ *        histogram, the busy time of every worker and the time of every tile
+ *
+ * \param seconds Wall clock time of the render
+ * \throw std::runtime_error if the file cannot be written
+ */
+void write_report(const std::string& path, const Counters& counters, double seconds);
+
+/*!
+ * \brief Write the time spent on every pixel as a heatmap, from black (no
+ *        time) through red and yellow to white (the slowest 1% of pixels)
+ *
+ * The image is a PNG image, or a PPM one if \p path ends with .ppm.
+ *
+ * \param cost Nanoseconds spent on each pixel, rows bottom up
+ */
+void write_heatmap(const std::string& path, const std::vector<float>& cost,
+                   std::uint32_t width, std::uint32_t height);
+
+} // namespace stats
+} // namespace rt
+
+#endif // STATS_HPP
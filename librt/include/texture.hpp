@@ -1,16 +1,71 @@
 #ifndef TEXTURE_HPP
 #define TEXTURE_HPP
 
+#include <cstdint>
 #include <map>
 #include <memory>
+#include <vector>
 
+#include <arena.hpp>
 #include <vector.hpp>
 
 namespace rt {
 
+class Texture;
+
+/*
+ * Pattern of CheckerTexture: color1 where the product of the sines is negative
+ */
+inline rt::Vector3f checker(const rt::Vector3f& color1, const rt::Vector3f& color2,
+                            const rt::Vector3f& p) {
+  const auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
+  return (sines < 0) ? color1 : color2;
+}
+
+enum class TextureKind : std::uint8_t {
+  Constant,
+  Checker,
+  Lambda,
+  //! Any other Texture, evaluated through the virtual interface
+  Other
+};
+
+/*!
+ * \brief A texture of any kind as a flat, tagged value, so that it can be
+ *        embedded in a MaterialRecord and evaluated without a virtual call
+ *
+ * Only the fields of its kind are meaningful.
+ */
+struct TextureRecord {
+  using Function = rt::Vector3f (*)(float, float, const rt::Vector3f&);
+
+  TextureKind kind = TextureKind::Constant;
+  //! Constant color, or the two colors of a checker
+  rt::Vector3f color1;
+  rt::Vector3f color2;
+  Function f = nullptr;
+  //! Texture of kind Other. It must outlive the record
+  const Texture* texture = nullptr;
+
+  rt::Vector3f value(float u, float v, const rt::Vector3f& p) const;
+};
+
 class Texture {
  public:
   virtual rt::Vector3f value(float u, float v, const rt::Vector3f& p) const = 0;
+
+  /*!
+   * \brief Flat copy of the texture. Textures that are not built in refer to
+   *        themselves, and keep using value()
+   */
+  virtual TextureRecord record() const {
+    TextureRecord r;
+    r.kind = TextureKind::Other;
+    r.texture = this;
+    return r;
+  }
+
+  virtual ~Texture() {}
 };
 
 class ConstantTexture : public Texture {
@@ -19,7 +74,14 @@ class ConstantTexture : public Texture {
   ConstantTexture(const rt::Vector3f& c) : color_{c} {}
   rt::Vector3f value(float u, float v, const rt::Vector3f& p) const override {
     return color_;
-  }  
+  }
+
+  TextureRecord record() const override {
+    TextureRecord r;
+    r.kind = TextureKind::Constant;
+    r.color1 = color_;
+    return r;
+  }
  private:
   rt::Vector3f color_;
 };
@@ -31,8 +93,15 @@ class CheckerTexture : public Texture {
       : color1_{c1}, color2_{c2} {}
 
   rt::Vector3f value(float u, float v, const rt::Vector3f& p) const override {
-    const auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
-    return (sines < 0) ? color1_ : color2_;
+    return checker(color1_, color2_, p);
+  }
+
+  TextureRecord record() const override {
+    TextureRecord r;
+    r.kind = TextureKind::Checker;
+    r.color1 = color1_;
+    r.color2 = color2_;
+    return r;
   }
   
   private:
@@ -41,36 +110,59 @@ class CheckerTexture : public Texture {
 };
 
 class LambdaTexture : public Texture {
-  using Function = rt::Vector3f (*)(float, float, const rt::Vector3f&);
+  using Function = TextureRecord::Function;
  public:
   LambdaTexture(Function f) : f_{f} {}
   rt::Vector3f value(float u, float v, const rt::Vector3f& p) const override {
     return f_(u, v, p);
   }
+
+  TextureRecord record() const override {
+    TextureRecord r;
+    r.kind = TextureKind::Lambda;
+    r.f = f_;
+    return r;
+  }
   
  private:
     Function f_;
 };
 
+inline rt::Vector3f TextureRecord::value(float u, float v, const rt::Vector3f& p) const {
+  switch (kind) {
+    case TextureKind::Constant:
+      return color1;
+    case TextureKind::Checker:
+      return checker(color1, color2, p);
+    case TextureKind::Lambda:
+      return f(u, v, p);
+    default:
+      return texture->value(u, v, p);
+  }
+}
+
 class TextureRegistry {
  public:
-  TextureRegistry() = default;
+  /*!
+   * \param arena Where textures are built, on the heap if null. It must
+   *        outlive the registry
+   */
+  explicit TextureRegistry(Arena* arena = nullptr) : arena_{arena} {}
+
   void register_color(const std::string& name, const rt::Vector3f& color){
-    registry_[name] = std::make_unique<ConstantTexture>(color);
+    registry_[name] = make_object<ConstantTexture>(arena_, color);
   }
 
   template<typename T, typename... ARGS>
   void register_texture(const std::string& name, ARGS&& ...args) {
-    registry_[name] = std::make_unique<T>(args...);
+    registry_[name] = make_object<T>(arena_, args...);
   }
 
-  Texture* random_color() {
-    auto dis = std::uniform_real_distribution<float>{0.0, 1.0};
-    std::random_device device;
-    random_.push_back(std::make_unique<ConstantTexture>(
-        rt::Vector3f{dis(device) * dis(device),
-              dis(device) * dis(device),
-              dis(device) * dis(device)}));
+  Texture* random_color(Random& rng) {
+    random_.push_back(make_object<ConstantTexture>(arena_,
+        rt::Vector3f{rng.uniform() * rng.uniform(),
+              rng.uniform() * rng.uniform(),
+              rng.uniform() * rng.uniform()}));
     return random_.back().get();
   }
 
@@ -78,8 +170,9 @@ class TextureRegistry {
     return registry_[name].get();
   }
  private:
-  std::map<std::string, std::unique_ptr<Texture>> registry_;
-  std::vector<std::unique_ptr<Texture>> random_;  
+  Arena* arena_;
+  std::map<std::string, ArenaPtr<Texture>> registry_;
+  std::vector<ArenaPtr<Texture>> random_;  
 };
 }
 
@@ -0,0 +1,129 @@
+#ifndef WAVEFRONT_HPP
+#define WAVEFRONT_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include <film.hpp>
+#include <hitable.hpp>
+#include <material.hpp>
+#include <random.hpp>
+#include <ray.hpp>
+#include <sampler.hpp>
+#include <scheduler.hpp>
+#include <vector.hpp>
+
+namespace rt {
+
+class Camera;
+
+/*!
+ * \brief Paths in flight, stored as a structure of arrays: their current
+ *        ray, their throughput and the pixel they contribute to
+ *
+ * With light sampling, pdf is the density of the direction of the ray when
+ * it left a diffuse surface, which weighs the light it finds, and 0 when
+ * that light was not sampled.
+ */
+struct PathQueue {
+  std::vector<float> ox, oy, oz;
+  std::vector<float> dx, dy, dz;
+  std::vector<float> tr, tg, tb;
+  std::vector<float> pdf;
+  std::vector<std::uint32_t> pixel;
+
+  std::size_t size() const { return pixel.size(); }
+
+  void reserve(std::size_t n);
+  void clear();
+  void push(const Ray& r, const Vector3f& throughput, std::uint32_t pixel, float pdf = 0);
+
+  Ray ray(std::size_t i) const {
+    return Ray{Vector3f{ox[i], oy[i], oz[i]}, Vector3f{dx[i], dy[i], dz[i]}};
+  }
+
+  Vector3f throughput(std::size_t i) const {
+    return Vector3f{tr[i], tg[i], tb[i]};
+  }
+};
+
+/*!
+ * \brief Path tracer that advances many paths one bounce at a time
+ *
+ * Instead of following each path to its end, every bounce is run as a
+ * sequence of passes over the whole queue of live paths: intersect all of
+ * them, bin the hits by MaterialKind, then scatter every bin in its own
+ * loop, which calls the scatter function of that kind directly. The paths
+ * that survive
+ * form the queue of the next bounce, already grouped by the material they
+ * left from.
+ *
+ * A tracer owns its queues, so every worker thread needs its own.
+ */
+class WavefrontTracer {
+ public:
+  /*!
+   * \param capacity Number of paths to keep in flight. Tiles whose samples
+   *        do not fit are traced in several waves, each with at least one
+   *        sample of every pixel
+   */
+  WavefrontTracer(const Hitable& world, const Camera& cam, const PathSettings& settings,
+                  std::size_t capacity);
+
+  /*!
+   * \brief Trace spp samples of every pixel of \p tile and add them to \p film
+   *
+   * Pass p of pixel k uses random stream p * pixels + k, as in the path
+   * engine. The streams are consumed in a different order, so the image is
+   * not the same. It depends on the seed, the tile size and the capacity,
+   * which set how samples are split into waves, but not on the threads.
+   *
+   * If \p film has a feature buffer, the features of the first hits are
+   * added to it, without the luminance of the samples: the paths of a pixel
+   * add up in one sum.
+   */
+  void trace(const Tile& tile, std::uint32_t width, std::uint32_t height,
+             std::uint32_t spp, std::uint64_t seed, std::uint32_t pass, Film& film);
+
+  /*!
+   * \brief Trace the next tiles through \p cam, so that one tracer can serve
+   *        several views of its world
+   */
+  void set_camera(const Camera& cam) { cam_ = &cam; }
+
+ private:
+  // depth is the bounce of the current paths, which stats counters need
+  void intersect(int depth);
+  void sort_by_material();
+  void shade_lights(std::size_t begin, std::size_t end, int depth);
+  template<bool (*Scatter)(const MaterialRecord&, const Ray&, const Hit&, Vector3f&, Ray&,
+                           Sampler&)>
+  void scatter(std::size_t begin, std::size_t end, int depth);
+
+  const Hitable& world_;
+  const Camera* cam_;
+  const MaterialTable& materials_;
+  PathSettings settings_;
+  std::size_t capacity_;
+
+  PathQueue current_;
+  PathQueue next_;
+  // Per path of current_: closest hit and the bin it goes to
+  std::vector<Hit> hits_;
+  std::vector<std::uint8_t> bin_;
+  // Paths of current_ that hit something, grouped by MaterialKind, and the
+  // start of every kind in it (plus the end of the last one)
+  std::vector<std::uint32_t> order_;
+  std::size_t bin_start_[MATERIAL_KINDS + 1];
+
+  // Per pixel of the tile being traced. The paths of a pixel are in flight
+  // together and draw from one stream, so samplers are of the Random kind
+  std::vector<Sampler> sampler_;
+  std::vector<Vector3f> radiance_;
+  // Features of the first hits, empty if the film takes none
+  std::vector<Features> features_;
+};
+
+} // namespace rt
+
+#endif // WAVEFRONT_HPP
@@ -0,0 +1,55 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include <arena.hpp>
+
+namespace rt {
+
+constexpr std::size_t Arena::ALIGNMENT;
+
+Arena::Arena(std::size_t block_size)
+    : block_size_{std::max<std::size_t>(block_size, ALIGNMENT)} {}
+
+Arena::~Arena() {
+  for (auto d = destructors_.rbegin() ; d != destructors_.rend() ; ++d) {
+    d->destroy(d->object);
+  }
+  for (auto* block : blocks_) {
+    free(block);
+  }
+}
+
+void* Arena::allocate(std::size_t size, std::size_t alignment) {
+  size = std::max<std::size_t>(size, 1);
+  // Padding that aligns the next object of the current block
+  const auto misalignment = reinterpret_cast<std::uintptr_t>(next_) % alignment;
+  const auto padding = misalignment == 0 ? 0 : alignment - misalignment;
+  if (next_ == nullptr || static_cast<std::size_t>(end_ - next_) < padding + size) {
+    const auto block_size = std::max(size, block_size_);
+    void* block = nullptr;
+    if (posix_memalign(&block, ALIGNMENT, block_size) != 0) {
+      throw std::bad_alloc{};
+    }
+    blocks_.push_back(block);
+    // A large object gets a block of its own, and the current block stays
+    // open for the small ones
+    if (block_size > block_size_) {
+      used_ += size;
+      return block;
+    }
+    next_ = static_cast<char*>(block);
+    end_ = next_ + block_size;
+    used_ += size;
+    auto* p = next_;
+    next_ += size;
+    return p;
+  }
+  auto* p = next_ + padding;
+  next_ = p + size;
+  used_ += padding + size;
+  return p;
+}
+
+} // namespace rt
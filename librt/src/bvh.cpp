@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <cmath>
+
+#include <bvh.hpp>
+
+namespace rt {
+namespace {
+
+constexpr auto BINS = 12;
+// Cost of visiting an interior node relative to intersecting one primitive
+constexpr auto TRAVERSAL_COST = 0.125f;
+// Leaves store their size in 16 bits
+constexpr std::size_t MAX_LEAF_COUNT = 0xFFFF;
+
+struct Bin {
+  AABB box;
+  std::size_t count = 0;
+};
+
+// Depth of a tree of n leaves split at their median: ceil(log2(n))
+std::size_t median_depth(std::size_t n) {
+  std::size_t depth = 0;
+  while ((std::size_t{1} << depth) < n) {
+    ++depth;
+  }
+  return depth;
+}
+
+class Builder {
+ public:
+  Builder(const std::vector<AABB>& boxes, std::size_t max_leaf_size,
+          std::vector<BVHNode>& nodes, std::vector<std::uint32_t>& order)
+      : boxes_{boxes}, max_leaf_size_{std::max<std::size_t>(max_leaf_size, 1)},
+        nodes_{nodes}, order_{order} {
+    centroids_.reserve(boxes.size());
+    for (const auto& box : boxes) {
+      centroids_.push_back(box.centroid());
+    }
+  }
+
+  std::uint32_t build(std::size_t begin, std::size_t end, std::size_t depth) {
+    const auto index = static_cast<std::uint32_t>(nodes_.size());
+    nodes_.emplace_back();
+
+    AABB bounds, centroid_bounds;
+    for (auto i = begin ; i < end ; ++i) {
+      bounds.grow(boxes_[order_[i]]);
+      centroid_bounds.grow(centroids_[order_[i]]);
+    }
+
+    const auto count = end - begin;
+    auto axis = 0;
+    auto split = end;
+    // A SAH split may leave all but one primitive on one side. Once that
+    // could go past BVH_MAX_DEPTH, median splits halve the nodes instead
+    const auto median = depth + 1 + median_depth(count) > BVH_MAX_DEPTH;
+    if (median) {
+      if (count > max_leaf_size_) {
+        axis = split_median(begin, end, centroid_bounds);
+        split = begin + count / 2;
+      }
+    } else if (count > 1) {
+      find_split(begin, end, bounds, centroid_bounds, axis, split);
+    }
+
+    if (split == end) {
+      if (count <= MAX_LEAF_COUNT) {
+        set_bounds(index, bounds);
+        nodes_[index].offset = static_cast<std::uint32_t>(begin);
+        nodes_[index].count = static_cast<std::uint16_t>(count);
+        nodes_[index].axis = 0;
+        return index;
+      }
+      // Too many primitives we could not separate, split them by position
+      split = begin + count / 2;
+    }
+
+    build(begin, split, depth + 1);
+    const auto right = build(split, end, depth + 1);
+    set_bounds(index, bounds);
+    nodes_[index].offset = right;
+    nodes_[index].count = 0;
+    nodes_[index].axis = static_cast<std::uint16_t>(axis);
+    return index;
+  }
+
+ private:
+  void set_bounds(std::uint32_t index, const AABB& bounds) {
+    for (auto a = 0 ; a < 3 ; ++a) {
+      nodes_[index].lower[a] = bounds.lower[a];
+      nodes_[index].upper[a] = bounds.upper[a];
+    }
+  }
+
+  /*
+   * Bin the centroids along every axis and pick the split plane with the
+   * lowest surface area heuristic cost. Leaves split == end when keeping a
+   * leaf is cheaper (and allowed by max_leaf_size).
+   */
+  void find_split(std::size_t begin, std::size_t end,
+                  const AABB& bounds, const AABB& centroid_bounds,
+                  int& best_axis, std::size_t& split) {
+    const auto count = end - begin;
+    auto best_cost = INFINITY;
+    auto best_plane = 0;
+    best_axis = -1;
+    for (auto a = 0 ; a < 3 ; ++a) {
+      const auto extent = centroid_bounds.upper[a] - centroid_bounds.lower[a];
+      if (!(extent > 0)) {
+        continue;
+      }
+      Bin bins[BINS];
+      for (auto i = begin ; i < end ; ++i) {
+        const auto b = bin(order_[i], a, centroid_bounds);
+        bins[b].count += 1;
+        bins[b].box.grow(boxes_[order_[i]]);
+      }
+
+      // Sweep from the right to get the cost of every right hand side
+      float right_area[BINS - 1];
+      std::size_t right_count[BINS - 1];
+      AABB accum;
+      std::size_t n = 0;
+      for (auto b = BINS - 1 ; b > 0 ; --b) {
+        accum.grow(bins[b].box);
+        n += bins[b].count;
+        right_area[b - 1] = accum.surface_area();
+        right_count[b - 1] = n;
+      }
+
+      accum = AABB{};
+      n = 0;
+      for (auto b = 0 ; b < BINS - 1 ; ++b) {
+        accum.grow(bins[b].box);
+        n += bins[b].count;
+        if (n == 0 || right_count[b] == 0) {
+          continue;
+        }
+        const auto cost = n * accum.surface_area() + right_count[b] * right_area[b];
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = a;
+          best_plane = b;
+        }
+      }
+    }
+
+    split = end;
+    if (best_axis < 0) {
+      best_axis = 0;
+      return;
+    }
+
+    const auto area = bounds.surface_area();
+    const auto split_cost = TRAVERSAL_COST + (area > 0 ? best_cost / area : 0);
+    if (count <= max_leaf_size_ && split_cost >= count) {
+      return;
+    }
+
+    const auto middle = std::partition(
+        order_.begin() + begin, order_.begin() + end,
+        [&](std::uint32_t prim) {
+          return bin(prim, best_axis, centroid_bounds) <= best_plane;
+        });
+    split = static_cast<std::size_t>(middle - order_.begin());
+  }
+
+  /*
+   * Order the primitives so that the first half has the centroids below the
+   * median along the widest axis of \p centroid_bounds, which is returned
+   */
+  int split_median(std::size_t begin, std::size_t end, const AABB& centroid_bounds) {
+    const auto extent = centroid_bounds.upper - centroid_bounds.lower;
+    auto axis = 0;
+    for (auto a = 1 ; a < 3 ; ++a) {
+      if (extent[a] > extent[axis]) {
+        axis = a;
+      }
+    }
+    std::nth_element(order_.begin() + begin, order_.begin() + begin + (end - begin) / 2,
+                     order_.begin() + end, [&](std::uint32_t a, std::uint32_t b) {
+                       return centroids_[a][axis] < centroids_[b][axis];
+                     });
+    return axis;
+  }
+
+  int bin(std::uint32_t prim, int axis, const AABB& centroid_bounds) const {
+    const auto lo = centroid_bounds.lower[axis];
+    const auto extent = centroid_bounds.upper[axis] - lo;
+    const auto b = static_cast<int>(BINS * ((centroids_[prim][axis] - lo) / extent));
+    return std::min(std::max(b, 0), BINS - 1);
+  }
+
+  const std::vector<AABB>& boxes_;
+  std::vector<Vector3f> centroids_;
+  std::size_t max_leaf_size_;
+  std::vector<BVHNode>& nodes_;
+  std::vector<std::uint32_t>& order_;
+};
+
+} // Unnamed namespace
+
+void build_bvh(const std::vector<AABB>& boxes,
+               std::size_t max_leaf_size,
+               std::vector<BVHNode>& nodes,
+               std::vector<std::uint32_t>& order) {
+  nodes.clear();
+  order.resize(boxes.size());
+  for (auto i = 0U ; i < order.size() ; ++i) {
+    order[i] = i;
+  }
+  if (boxes.empty()) {
+    return;
+  }
+  nodes.reserve(2 * boxes.size());
+  Builder{boxes, max_leaf_size, nodes, order}.build(0, boxes.size(), 0);
+}
+
+BVH::BVH(HitableList::HitablePtr&& objects, std::size_t max_leaf_size) {
+  std::vector<AABB> boxes;
+  HitableList::HitablePtr bounded;
+  std::vector<std::uint32_t> bounded_index;
+  for (auto i = 0U ; i < objects.size() ; ++i) {
+    AABB box;
+    if (objects[i]->bounding_box(box)) {
+      boxes.push_back(box);
+      bounded.push_back(std::move(objects[i]));
+      bounded_index.push_back(i);
+    } else {
+      unbounded_.push_back(std::move(objects[i]));
+      unbounded_index_.push_back(i);
+    }
+  }
+
+  std::vector<std::uint32_t> order;
+  build_bvh(boxes, max_leaf_size, nodes_, order);
+
+  // Store the objects in leaf order so each leaf is a contiguous range
+  for (auto prim : order) {
+    objects_.push_back(std::move(bounded[prim]));
+    index_.push_back(bounded_index[prim]);
+  }
+}
+
+bool BVH::hit(const Ray& r, float t_min, float t_max, Hit& rec) const {
+  RT_STAT(++stats::local().hit_calls);
+  Hit tmp_hit;
+  auto hit_anything = false;
+  auto closest = t_max;
+  auto best = std::uint32_t{0};
+
+  // HitableList keeps the first of several hits at the same distance. The
+  // objects are visited in a different order here, so an object that comes
+  // earlier in the list is allowed to win a tie
+  auto test = [&](const Hitable& object, std::uint32_t index) {
+    const auto limit = (hit_anything && index < best) ?
+        std::nextafter(closest, FLT_MAX) : closest;
+    if (object.hit(r, t_min, limit, tmp_hit)) {
+      hit_anything = true;
+      closest = tmp_hit.t;
+      best = index;
+      rec = tmp_hit;
+      return true;
+    }
+    return false;
+  };
+
+  for (auto i = 0U ; i < unbounded_.size() ; ++i) {
+    test(*unbounded_[i], unbounded_index_[i]);
+  }
+
+  if (!nodes_.empty()) {
+    bvh_traverse(nodes_.data(), r, t_min, closest,
+                 [&](std::uint32_t first, std::uint32_t count, float& /* closest */) {
+                   auto found = false;
+                   for (auto i = first ; i < first + count ; ++i) {
+                     found |= test(*objects_[i], index_[i]);
+                   }
+                   return found;
+                 });
+  }
+  return hit_anything;
+}
+
+bool BVH::occluded(const Ray& r, float t_min, float t_max) const {
+  RT_STAT(++stats::local().hit_calls);
+  for (const auto& object : unbounded_) {
+    if (object->occluded(r, t_min, t_max)) {
+      return true;
+    }
+  }
+  if (nodes_.empty()) {
+    return false;
+  }
+  auto closest = t_max;
+  return bvh_traverse<true>(nodes_.data(), r, t_min, closest,
+                            [&](std::uint32_t first, std::uint32_t count, float& /* closest */) {
+                              for (auto i = first ; i < first + count ; ++i) {
+                                if (objects_[i]->occluded(r, t_min, t_max)) {
+                                  return true;
+                                }
+                              }
+                              return false;
+                            });
+}
+
+std::uint32_t BVH::hit_packet(const RayPacket& packet, std::uint32_t active,
+                              float t_min, HitPacket& hits) const {
+  std::uint32_t hit_mask = 0;
+  std::uint32_t best[MAX_PACKET_SIZE];
+  HitPacket tmp_hits;
+
+  // Same tie breaking as hit(), per lane
+  auto test = [&](const Hitable& object, std::uint32_t index, std::uint32_t lanes) {
+    for_each_lane(lanes, [&](std::uint32_t l) {
+        const auto earlier = ((hit_mask >> l) & 1U) && index < best[l];
+        tmp_hits.t[l] = earlier ? std::nextafter(hits.t[l], FLT_MAX) : hits.t[l];
+      });
+    const auto found = object.hit_packet(packet, lanes, t_min, tmp_hits);
+    for_each_lane(found, [&](std::uint32_t l) {
+        hits.t[l] = tmp_hits.t[l];
+        hits.hit[l] = tmp_hits.hit[l];
+        best[l] = index;
+      });
+    hit_mask |= found;
+  };
+
+  for (auto i = 0U ; i < unbounded_.size() ; ++i) {
+    test(*unbounded_[i], unbounded_index_[i], active);
+  }
+
+  if (!nodes_.empty()) {
+    bvh_traverse_packet(nodes_.data(), packet, active, t_min, hits.t,
+                        [&](std::uint32_t first, std::uint32_t count, std::uint32_t lanes) {
+                          for (auto i = first ; i < first + count ; ++i) {
+                            test(*objects_[i], index_[i], lanes);
+                          }
+                        });
+  }
+  return hit_mask;
+}
+
+std::uint32_t BVH::occluded_packet(const RayPacket& packet, std::uint32_t active,
+                                   float t_min, const float* t_max) const {
+  std::uint32_t occluded = 0;
+  for (const auto& object : unbounded_) {
+    occluded |= object->occluded_packet(packet, active & ~occluded, t_min, t_max);
+  }
+  if (nodes_.empty() || occluded == active) {
+    return occluded;
+  }
+
+  // Occluded lanes get a closest distance no box is hit before, which takes
+  // them out of the rest of the traversal
+  float closest[MAX_PACKET_SIZE];
+  for (auto l = 0U ; l < packet.size ; ++l) {
+    closest[l] = ((active & ~occluded) >> l) & 1U ? t_max[l] : -FLT_MAX;
+  }
+  bvh_traverse_packet(nodes_.data(), packet, active & ~occluded, t_min, closest,
+                      [&](std::uint32_t first, std::uint32_t count, std::uint32_t lanes) {
+                        for (auto i = first ; i < first + count && lanes != 0 ; ++i) {
+                          const auto found = objects_[i]->occluded_packet(packet, lanes, t_min,
+                                                                          t_max);
+                          for_each_lane(found, [&](std::uint32_t l) {
+                              closest[l] = -FLT_MAX;
+                            });
+                          occluded |= found;
+                          lanes &= ~found;
+                        }
+                      });
+  return occluded;
+}
+
+bool BVH::bounding_box(AABB& box) const {
+  if (!unbounded_.empty() || nodes_.empty()) {
+    return false;
+  }
+  const auto& root = nodes_.front();
+  box = AABB{Vector3f{root.lower[0], root.lower[1], root.lower[2]},
+             Vector3f{root.upper[0], root.upper[1], root.upper[2]}};
+  return true;
+}
+
+void BVH::collect_lights(const MaterialTable& materials,
+                         std::vector<SphereLight>& lights) const {
+  for (const auto& objects : {&objects_, &unbounded_}) {
+    for (const auto& object : *objects) {
+      object->collect_lights(materials, lights);
+    }
+  }
+}
+
+} // namespace rt
@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <denoise.hpp>
+
+namespace rt {
+namespace {
+
+// B3 spline, the kernel of every pass
+const float KERNEL[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+constexpr std::uint32_t TILE_SIZE = 64;
+// Smallest albedo divided out, so that black surfaces keep their color
+constexpr float MIN_ALBEDO = 1e-3f;
+
+float luminance(const Vector3f& c) {
+  return 0.2126f * c.r() + 0.7152f * c.g() + 0.0722f * c.b();
+}
+
+/*
+ * Pixels of the film, in row order from its first row, with everything the
+ * filter reads
+ */
+struct Image {
+  std::uint32_t width, height;
+  std::vector<Vector3f> albedo;
+  std::vector<Vector3f> normal;
+  std::vector<float> depth;
+  // Largest change of depth to the next pixel
+  std::vector<float> gradient;
+
+  std::size_t index(std::uint32_t x, std::uint32_t y) const {
+    return static_cast<std::size_t>(y) * width + x;
+  }
+};
+
+/*
+ * Weight of neighbour q in the filter of pixel p, apart from the kernel and
+ * luminance: normals and depths must match, and pixels that missed only
+ * blend with pixels that missed
+ */
+float geometry_weight(const Image& image, std::size_t p, std::size_t q, float distance,
+                      const DenoiseOptions& options) {
+  const auto miss_p = image.depth[p] == 0;
+  const auto miss_q = image.depth[q] == 0;
+  if (miss_p || miss_q) {
+    return miss_p && miss_q ? 1.0f : 0.0f;
+  }
+  const auto cosine = std::max(0.0f, dot(image.normal[p], image.normal[q]));
+  const auto w_normal = std::pow(cosine, options.sigma_normal);
+  const auto w_depth = std::exp(-std::abs(image.depth[p] - image.depth[q]) /
+                                (options.sigma_depth * image.gradient[p] * distance + 1e-6f));
+  return w_normal * w_depth;
+}
+
+} // Unnamed namespace
+
+Film denoise(const Film& film, const TileScheduler& scheduler, const DenoiseOptions& options) {
+  const auto width = film.width();
+  const auto height = film.height();
+  const auto x0 = film.first_column();
+  const auto y0 = film.first_row();
+  const auto pixels = static_cast<std::size_t>(width) * height;
+
+  Image image{width, height, std::vector<Vector3f>(pixels), std::vector<Vector3f>(pixels),
+              std::vector<float>(pixels), std::vector<float>(pixels)};
+  // Color divided by the albedo, and the variance of its luminance
+  std::vector<Vector3f> irradiance(pixels);
+  std::vector<float> variance(pixels, -1.0f);
+  for (auto y = 0U ; y < height ; ++y) {
+    for (auto x = 0U ; x < width ; ++x) {
+      const auto p = image.index(x, y);
+      const auto f = film.features(x0 + x, y0 + y);
+      const auto samples = film.samples(x0 + x, y0 + y);
+      auto& albedo = image.albedo[p];
+      albedo = f.albedo;
+      for (auto k = 0 ; k < 3 ; ++k) {
+        albedo[k] = std::max(albedo[k], MIN_ALBEDO);
+      }
+      const auto color = film.color(x0 + x, y0 + y);
+      irradiance[p] = color / albedo;
+      const auto length = f.normal.norm2();
+      image.normal[p] = length > 0 ? f.normal / length : Vector3f{0, 0, 0};
+      image.depth[p] = f.depth;
+      // Variance of the mean of the samples, divided by the albedo like
+      // the color
+      if (samples >= 2 && f.luminance2 > 0) {
+        const auto mean = luminance(color);
+        const auto a = luminance(albedo);
+        variance[p] = std::max(0.0f, f.luminance2 - mean * mean) / (samples - 1) / (a * a);
+      }
+    }
+  }
+
+  const auto tiles = make_tiles(width, height, TILE_SIZE);
+  auto for_each_pixel = [&](auto&& f) {
+    scheduler.run(tiles, [&](const Tile& tile, unsigned /* worker */) {
+        for (auto y = tile.y0 ; y < tile.y1 ; ++y) {
+          for (auto x = tile.x0 ; x < tile.x1 ; ++x) {
+            f(x, y);
+          }
+        }
+      });
+  };
+
+  // Depth gradients, and the variance of the pixels whose samples are not
+  // known, from the luminance of their 5x5 neighbourhood
+  for_each_pixel([&](std::uint32_t x, std::uint32_t y) {
+      const auto p = image.index(x, y);
+      auto gradient = 0.0f;
+      if (x + 1 < width) {
+        gradient = std::max(gradient, std::abs(image.depth[p + 1] - image.depth[p]));
+      }
+      if (x > 0) {
+        gradient = std::max(gradient, std::abs(image.depth[p] - image.depth[p - 1]));
+      }
+      if (y + 1 < height) {
+        gradient = std::max(gradient, std::abs(image.depth[p + width] - image.depth[p]));
+      }
+      if (y > 0) {
+        gradient = std::max(gradient, std::abs(image.depth[p] - image.depth[p - width]));
+      }
+      image.gradient[p] = gradient;
+
+      if (variance[p] >= 0) {
+        return;
+      }
+      auto sum = 0.0f, sum2 = 0.0f;
+      auto n = 0;
+      for (auto dy = -2 ; dy <= 2 ; ++dy) {
+        for (auto dx = -2 ; dx <= 2 ; ++dx) {
+          const auto qx = static_cast<int>(x) + dx;
+          const auto qy = static_cast<int>(y) + dy;
+          if (qx < 0 || qy < 0 || qx >= static_cast<int>(width) ||
+              qy >= static_cast<int>(height)) {
+            continue;
+          }
+          const auto l = luminance(irradiance[image.index(qx, qy)]);
+          sum += l;
+          sum2 += l * l;
+          ++n;
+        }
+      }
+      const auto mean = sum / n;
+      variance[p] = std::max(0.0f, sum2 / n - mean * mean);
+    });
+
+  std::vector<Vector3f> next_irradiance(pixels);
+  std::vector<float> next_variance(pixels);
+  for (auto i = 0 ; i < options.iterations ; ++i) {
+    const auto step = 1 << i;
+    for_each_pixel([&](std::uint32_t x, std::uint32_t y) {
+        const auto p = image.index(x, y);
+        // Noise of the pixel, from its variance blurred over 3x3 pixels
+        // which steadies it
+        auto blurred = 0.0f, blur_weight = 0.0f;
+        for (auto dy = -1 ; dy <= 1 ; ++dy) {
+          for (auto dx = -1 ; dx <= 1 ; ++dx) {
+            const auto qx = static_cast<int>(x) + dx;
+            const auto qy = static_cast<int>(y) + dy;
+            if (qx < 0 || qy < 0 || qx >= static_cast<int>(width) ||
+                qy >= static_cast<int>(height)) {
+              continue;
+            }
+            const auto h = KERNEL[dx + 2] * KERNEL[dy + 2];
+            blurred += h * variance[image.index(qx, qy)];
+            blur_weight += h;
+          }
+        }
+        const auto sigma = options.sigma_luminance * std::sqrt(blurred / blur_weight) + 1e-6f;
+
+        const auto l_p = luminance(irradiance[p]);
+        Vector3f sum{0, 0, 0};
+        auto sum_variance = 0.0f;
+        auto sum_weight = 0.0f;
+        for (auto dy = -2 ; dy <= 2 ; ++dy) {
+          for (auto dx = -2 ; dx <= 2 ; ++dx) {
+            const auto qx = static_cast<int>(x) + dx * step;
+            const auto qy = static_cast<int>(y) + dy * step;
+            if (qx < 0 || qy < 0 || qx >= static_cast<int>(width) ||
+                qy >= static_cast<int>(height)) {
+              continue;
+            }
+            const auto q = image.index(qx, qy);
+            const auto distance = static_cast<float>(step) * std::sqrt(dx * dx + dy * dy);
+            const auto w_luminance = std::exp(-std::abs(l_p - luminance(irradiance[q])) / sigma);
+            // The pixel itself always counts, so the weights never sum to 0
+            const auto w = KERNEL[dx + 2] * KERNEL[dy + 2] * w_luminance *
+                (q == p ? 1.0f : geometry_weight(image, p, q, distance, options));
+            sum += w * irradiance[q];
+            sum_variance += w * w * variance[q];
+            sum_weight += w;
+          }
+        }
+        next_irradiance[p] = sum / sum_weight;
+        next_variance[p] = sum_variance / (sum_weight * sum_weight);
+      });
+    std::swap(irradiance, next_irradiance);
+    std::swap(variance, next_variance);
+  }
+
+  Film denoised{width, height, y0, x0};
+  for (auto y = 0U ; y < height ; ++y) {
+    for (auto x = 0U ; x < width ; ++x) {
+      const auto p = image.index(x, y);
+      const auto samples = film.samples(x0 + x, y0 + y);
+      denoised.add(x0 + x, y0 + y, irradiance[p] * image.albedo[p] * static_cast<float>(samples),
+                   samples);
+    }
+  }
+  return denoised;
+}
+
+} // namespace rt
@@ -0,0 +1,623 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <camera.hpp>
+#include <distributed.hpp>
+#include <film.hpp>
+#include <scene_file.hpp>
+
+namespace rt {
+namespace {
+
+/*
+ * Protocol. Every message is a MessageHeader followed by size bytes:
+ *
+ * - Job, coordinator to worker, once: a JobHeader, then the scene file
+ * - Region, coordinator to worker: a RegionHeader
+ * - Result, worker to coordinator: the RegionHeader, then the sums (3 floats
+ *   per pixel) and the sample counts of the region, rows bottom up, then the
+ *   feature sums (FEATURE_CHANNELS floats per pixel) if the job needs them,
+ *   to denoise or for AOVs
+ * - Done, coordinator to worker: nothing, the frame is finished
+ *
+ * Structures are sent as they are in memory, so all the processes must run
+ * on the same kind of machine, as with scene files.
+ */
+enum class MessageType : std::uint32_t {
+  Job = 1,
+  Region,
+  Result,
+  Done
+};
+
+struct MessageHeader {
+  std::uint32_t type;
+  std::uint32_t unused;
+  std::uint64_t size;
+};
+
+const char JOB_MAGIC[8] = {'R', 'T', 'J', 'O', 'B', '0', '0', '5'};
+
+static_assert(std::is_trivially_copyable<Camera>::value, "Cameras are sent as bytes");
+
+/*
+ * Image size, camera and the options that change the samples
+ */
+struct JobHeader {
+  char magic[8];
+  std::uint32_t width, height;
+  std::uint64_t seed;
+  std::int32_t max_depth, rr_depth;
+  std::uint32_t background, engine, packet_size, tile_size;
+  std::uint32_t adaptive, min_spp, max_spp, progressive;
+  float threshold;
+  std::uint32_t sampler, pass_spp, features, light_sampling, unused;
+  std::uint64_t wavefront_size;
+  unsigned char camera[sizeof(Camera)];
+};
+
+struct RegionHeader {
+  std::uint32_t id;
+  Tile region;
+  std::uint32_t pass;
+  std::uint32_t spp;
+};
+
+/*
+ * Owned file descriptor, closed on destruction
+ */
+class Descriptor {
+ public:
+  explicit Descriptor(int fd = -1) : fd_{fd} {}
+  ~Descriptor() { reset(); }
+
+  Descriptor(Descriptor&& other) : fd_{other.fd_} { other.fd_ = -1; }
+  Descriptor& operator=(Descriptor&& other) {
+    std::swap(fd_, other.fd_);
+    return *this;
+  }
+
+  int get() const { return fd_; }
+
+  void reset() {
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+ private:
+  int fd_;
+};
+
+bool is_unix(const std::string& address) {
+  return address.compare(0, 5, "unix:") == 0;
+}
+
+sockaddr_un unix_address(const std::string& address) {
+  const auto path = address.substr(5);
+  sockaddr_un sa{};
+  if (path.empty() || path.size() >= sizeof(sa.sun_path)) {
+    throw std::runtime_error{"Invalid socket path " + path};
+  }
+  sa.sun_family = AF_UNIX;
+  std::strcpy(sa.sun_path, path.c_str());
+  return sa;
+}
+
+/*
+ * Addresses of HOST:PORT, null if it cannot be resolved. An empty host
+ * listens on every interface
+ */
+addrinfo* tcp_addresses(const std::string& address, bool passive) {
+  const auto colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    throw std::runtime_error{"Invalid address " + address + ", expected HOST:PORT or unix:PATH"};
+  }
+  const auto host = address.substr(0, colon);
+  const auto port = address.substr(colon + 1);
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  addrinfo* list = nullptr;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &list) != 0) {
+    return nullptr;
+  }
+  return list;
+}
+
+Descriptor listen_on(const std::string& address) {
+  if (is_unix(address)) {
+    const auto sa = unix_address(address);
+    // A socket left behind by a coordinator that was killed. Files of any
+    // other kind, and sockets something still listens on, are left alone
+    struct stat st;
+    if (lstat(sa.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      Descriptor probe{socket(AF_UNIX, SOCK_STREAM, 0)};
+      if (probe.get() >= 0 &&
+          connect(probe.get(), reinterpret_cast<const sockaddr*>(&sa), sizeof(sa)) != 0 &&
+          errno == ECONNREFUSED) {
+        unlink(sa.sun_path);
+      }
+    }
+    Descriptor fd{socket(AF_UNIX, SOCK_STREAM, 0)};
+    if (fd.get() < 0 || bind(fd.get(), reinterpret_cast<const sockaddr*>(&sa), sizeof(sa)) != 0 ||
+        listen(fd.get(), SOMAXCONN) != 0) {
+      throw std::runtime_error{"Cannot listen on " + address};
+    }
+    return fd;
+  }
+
+  auto* list = tcp_addresses(address, true);
+  Descriptor fd;
+  for (auto* ai = list ; ai != nullptr && fd.get() < 0 ; ai = ai->ai_next) {
+    fd = Descriptor{socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)};
+    const int on = 1;
+    if (fd.get() < 0 ||
+        setsockopt(fd.get(), SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        bind(fd.get(), ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd.get(), SOMAXCONN) != 0) {
+      fd.reset();
+    }
+  }
+  if (list != nullptr) {
+    freeaddrinfo(list);
+  }
+  if (fd.get() < 0) {
+    throw std::runtime_error{"Cannot listen on " + address};
+  }
+  return fd;
+}
+
+/*
+ * Connection to address, closed if nothing listens there
+ */
+Descriptor connect_to(const std::string& address) {
+  if (is_unix(address)) {
+    const auto sa = unix_address(address);
+    Descriptor fd{socket(AF_UNIX, SOCK_STREAM, 0)};
+    if (fd.get() >= 0 &&
+        connect(fd.get(), reinterpret_cast<const sockaddr*>(&sa), sizeof(sa)) != 0) {
+      fd.reset();
+    }
+    return fd;
+  }
+
+  auto* list = tcp_addresses(address, false);
+  Descriptor fd;
+  for (auto* ai = list ; ai != nullptr && fd.get() < 0 ; ai = ai->ai_next) {
+    fd = Descriptor{socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)};
+    if (fd.get() >= 0 && connect(fd.get(), ai->ai_addr, ai->ai_addrlen) != 0) {
+      fd.reset();
+    }
+  }
+  if (list != nullptr) {
+    freeaddrinfo(list);
+  }
+  if (fd.get() >= 0) {
+    // Regions are small messages, they should not wait for more data
+    const int on = 1;
+    setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  return fd;
+}
+
+/*
+ * Blocking transfers of exactly size bytes. They fail when the peer is gone
+ */
+bool send_all(int fd, const void* data, std::size_t size) {
+  const auto* p = static_cast<const char*>(data);
+  while (size > 0) {
+    const auto n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+bool recv_all(int fd, void* data, std::size_t size) {
+  auto* p = static_cast<char*>(data);
+  while (size > 0) {
+    const auto n = recv(fd, p, size, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+struct Buffer {
+  const void* data;
+  std::size_t size;
+};
+
+bool send_message(int fd, MessageType type, std::initializer_list<Buffer> payload) {
+  MessageHeader header{static_cast<std::uint32_t>(type), 0, 0};
+  for (const auto& b : payload) {
+    header.size += b.size;
+  }
+  if (!send_all(fd, &header, sizeof(header))) {
+    return false;
+  }
+  for (const auto& b : payload) {
+    if (!send_all(fd, b.data, b.size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::size_t pixels(const Tile& region) {
+  return static_cast<std::size_t>(region.x1 - region.x0) * (region.y1 - region.y0);
+}
+
+using Clock = std::chrono::steady_clock;
+
+/*
+ * A connected worker, the ids of the regions it was sent, and when it must
+ * have returned the next one
+ */
+struct Peer {
+  Descriptor fd;
+  std::vector<std::uint32_t> in_flight;
+  Clock::time_point deadline;
+};
+
+/*
+ * Read a Result from peer and add it to the film.
+ *
+ * \return false if the peer is gone or broke the protocol
+ */
+bool receive_result(Peer& peer, const std::vector<RegionHeader>& items, Film& film) {
+  MessageHeader header;
+  RegionHeader result;
+  if (!recv_all(peer.fd.get(), &header, sizeof(header)) ||
+      header.type != static_cast<std::uint32_t>(MessageType::Result) ||
+      header.size < sizeof(RegionHeader) ||
+      !recv_all(peer.fd.get(), &result, sizeof(result))) {
+    return false;
+  }
+  const auto it = std::find(peer.in_flight.begin(), peer.in_flight.end(), result.id);
+  if (it == peer.in_flight.end()) {
+    return false;
+  }
+
+  const auto& region = items[result.id].region;
+  const auto n = pixels(region);
+  const auto channels = film.has_features() ? FEATURE_CHANNELS : 0;
+  if (header.size != sizeof(RegionHeader) +
+      n * ((3 + channels) * sizeof(float) + sizeof(std::uint32_t))) {
+    return false;
+  }
+  std::vector<float> sums(n * 3);
+  std::vector<std::uint32_t> counts(n);
+  std::vector<float> features(n * channels);
+  if (!recv_all(peer.fd.get(), sums.data(), sums.size() * sizeof(float)) ||
+      !recv_all(peer.fd.get(), counts.data(), counts.size() * sizeof(std::uint32_t)) ||
+      !recv_all(peer.fd.get(), features.data(), features.size() * sizeof(float))) {
+    return false;
+  }
+
+  auto k = std::size_t{0};
+  for (auto y = region.y0 ; y < region.y1 ; ++y) {
+    for (auto x = region.x0 ; x < region.x1 ; ++x, ++k) {
+      film.add(x, y, Vector3f{sums[k * 3], sums[k * 3 + 1], sums[k * 3 + 2]}, counts[k]);
+      if (channels > 0) {
+        film.add_feature_sums(x, y, &features[k * channels]);
+      }
+    }
+  }
+  peer.in_flight.erase(it);
+  return true;
+}
+
+} // Unnamed namespace
+
+void render_distributed(std::uint32_t width,
+                        std::uint32_t height,
+                        const std::string& scene,
+                        const Camera& cam,
+                        std::uint16_t anti_alias,
+                        const std::string& filepath,
+                        const RenderOptions& options,
+                        const DistributedOptions& distributed) {
+  // The scene is read once, and sent as it is to every worker
+  std::ifstream is{scene, std::ios::binary};
+  if (!is) {
+    throw std::runtime_error{"Cannot open scene " + scene};
+  }
+  const std::vector<char> scene_data{std::istreambuf_iterator<char>{is},
+                                     std::istreambuf_iterator<char>{}};
+
+  // Workers add the features of their samples when the image is denoised,
+  // and for every AOV but the sample count
+  const auto features = options.denoise ||
+      std::any_of(options.aovs.begin(), options.aovs.end(),
+                  [](AOV aov) { return aov != AOV::Samples; });
+
+  JobHeader job{};
+  std::copy(JOB_MAGIC, JOB_MAGIC + sizeof(JOB_MAGIC), job.magic);
+  job.width = width;
+  job.height = height;
+  job.seed = options.seed;
+  job.max_depth = options.max_depth;
+  job.rr_depth = options.rr_depth;
+  job.background = options.background;
+  job.engine = static_cast<std::uint32_t>(options.engine);
+  job.packet_size = options.packet_size;
+  job.tile_size = options.tile_size;
+  job.adaptive = options.adaptive;
+  job.min_spp = options.min_spp;
+  job.max_spp = options.max_spp;
+  job.progressive = options.progressive;
+  job.threshold = options.threshold;
+  job.sampler = static_cast<std::uint32_t>(options.sampler);
+  job.pass_spp = options.pass_spp;
+  job.features = features;
+  job.light_sampling = options.light_sampling;
+  job.wavefront_size = options.wavefront_size;
+  std::memcpy(job.camera, &cam, sizeof(Camera));
+
+  // Regions are whole tiles, so workers split them into the tiles render()
+  // uses. Progressive renders send every region once per pass
+  const auto tile_size = std::max(options.tile_size, 1U);
+  const auto region_size = std::max(distributed.region_size / tile_size, 1U) * tile_size;
+  const auto regions = make_tiles(width, height, region_size);
+  const auto pass_spp = options.progressive ?
+      std::max(options.pass_spp, 1U) : std::max<std::uint32_t>(anti_alias, 1);
+  std::vector<RegionHeader> items;
+  for (auto pass = 0U, done = 0U ; done < anti_alias ; ++pass, done += pass_spp) {
+    for (const auto& region : regions) {
+      const auto id = static_cast<std::uint32_t>(items.size());
+      items.push_back(RegionHeader{id, region, pass, std::min(pass_spp, anti_alias - done)});
+    }
+  }
+
+  Film film{width, height};
+  if (features) {
+    film.enable_features();
+  }
+  const auto listener = listen_on(distributed.address);
+  std::deque<std::uint32_t> pending;
+  for (const auto& item : items) {
+    pending.push_back(item.id);
+  }
+  std::vector<Peer> peers;
+  // The regions of a lost worker are redone first
+  auto lose = [&](Peer& peer) {
+    peer.fd.reset();
+    pending.insert(pending.begin(), peer.in_flight.begin(), peer.in_flight.end());
+    peer.in_flight.clear();
+  };
+  const auto timeout = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<float>{distributed.region_timeout});
+  const auto expires = distributed.region_timeout > 0;
+
+  auto finished = std::size_t{0};
+  while (finished < items.size()) {
+    std::vector<pollfd> fds{pollfd{listener.get(), POLLIN, 0}};
+    for (const auto& peer : peers) {
+      fds.push_back(pollfd{peer.fd.get(), POLLIN, 0});
+    }
+    // Wake up every second to check the deadlines
+    if (poll(fds.data(), fds.size(), expires ? 1000 : -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"Cannot wait for the workers"};
+    }
+
+    for (auto p = 0U ; p < peers.size() ; ++p) {
+      if (fds[p + 1].revents == 0) {
+        continue;
+      }
+      if (receive_result(peers[p], items, film)) {
+        ++finished;
+        peers[p].deadline = Clock::now() + timeout;
+      } else {
+        lose(peers[p]);
+      }
+    }
+
+    // A worker that hangs, or whose host vanished without closing the
+    // connection, is dropped like one that died
+    if (expires) {
+      const auto late = Clock::now();
+      for (auto& peer : peers) {
+        if (peer.fd.get() >= 0 && !peer.in_flight.empty() && late >= peer.deadline) {
+          lose(peer);
+        }
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      Peer peer{Descriptor{accept(listener.get(), nullptr, nullptr)}, {}, {}};
+      // Lets the system notice dead hosts on idle TCP connections too
+      const int on = 1;
+      setsockopt(peer.fd.get(), SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+      if (peer.fd.get() >= 0 &&
+          send_message(peer.fd.get(), MessageType::Job,
+                       {Buffer{&job, sizeof(job)}, Buffer{scene_data.data(), scene_data.size()}})) {
+        peers.push_back(std::move(peer));
+      }
+    }
+
+    // Keep every worker busy
+    for (auto& peer : peers) {
+      while (peer.fd.get() >= 0 && peer.in_flight.size() < std::max(distributed.queue_depth, 1U) &&
+             !pending.empty()) {
+        const auto id = pending.front();
+        pending.pop_front();
+        if (peer.in_flight.empty()) {
+          peer.deadline = Clock::now() + timeout;
+        }
+        peer.in_flight.push_back(id);
+        if (!send_message(peer.fd.get(), MessageType::Region,
+                          {Buffer{&items[id], sizeof(RegionHeader)}})) {
+          lose(peer);
+        }
+      }
+    }
+    peers.erase(std::remove_if(peers.begin(), peers.end(),
+                               [](const Peer& peer) { return peer.fd.get() < 0; }),
+                peers.end());
+  }
+
+  for (const auto& peer : peers) {
+    send_message(peer.fd.get(), MessageType::Done, {});
+  }
+  if (is_unix(distributed.address)) {
+    unlink(unix_address(distributed.address).sun_path);
+  }
+
+  write_film(film, filepath, options);
+}
+
+bool run_worker(const std::string& address, unsigned threads, float wait) {
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<float>{wait};
+  auto connection = connect_to(address);
+  while (connection.get() < 0) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{100});
+    connection = connect_to(address);
+  }
+  const auto fd = connection.get();
+
+  // A coordinator that closes without a job has just finished its frame
+  MessageHeader header;
+  if (!recv_all(fd, &header, sizeof(header))) {
+    return true;
+  }
+  JobHeader job;
+  if (header.type != static_cast<std::uint32_t>(MessageType::Job) ||
+      header.size < sizeof(JobHeader) || !recv_all(fd, &job, sizeof(job)) ||
+      !std::equal(JOB_MAGIC, JOB_MAGIC + sizeof(JOB_MAGIC), job.magic)) {
+    throw std::runtime_error{"Invalid job from " + address};
+  }
+  std::vector<char> scene_data(header.size - sizeof(JobHeader));
+  if (!recv_all(fd, scene_data.data(), scene_data.size())) {
+    return true;
+  }
+
+  // MappedScene maps a file: the scene goes through a temporary one, which
+  // can be unlinked as soon as it is mapped
+  char path[] = "/tmp/rt_sceneXXXXXX";
+  const auto scene_fd = mkstemp(path);
+  if (scene_fd < 0) {
+    throw std::runtime_error{"Cannot create a temporary scene file"};
+  }
+  close(scene_fd);
+  std::unique_ptr<MappedScene> world;
+  try {
+    std::ofstream os{path, std::ios::binary | std::ios::trunc};
+    os.write(scene_data.data(), static_cast<std::streamsize>(scene_data.size()));
+    os.close();
+    if (!os) {
+      throw std::runtime_error{std::string{"Cannot write "} + path};
+    }
+    // The path of the temporary file means nothing to the user
+    try {
+      world = std::make_unique<MappedScene>(path);
+    } catch (const std::runtime_error& e) {
+      throw std::runtime_error{"Invalid scene from " + address + ": " + e.what()};
+    }
+  } catch (...) {
+    unlink(path);
+    throw;
+  }
+  unlink(path);
+  scene_data.clear();
+
+  std::aligned_storage<sizeof(Camera), alignof(Camera)>::type camera;
+  std::memcpy(&camera, job.camera, sizeof(Camera));
+  const auto& cam = *reinterpret_cast<const Camera*>(&camera);
+
+  RenderOptions options;
+  options.seed = job.seed;
+  options.max_depth = job.max_depth;
+  options.rr_depth = job.rr_depth;
+  options.light_sampling = job.light_sampling != 0;
+  options.background = job.background != 0;
+  options.engine = static_cast<Engine>(job.engine);
+  options.packet_size = job.packet_size;
+  options.tile_size = job.tile_size;
+  options.adaptive = job.adaptive != 0;
+  options.min_spp = job.min_spp;
+  options.max_spp = job.max_spp;
+  options.progressive = job.progressive != 0;
+  options.threshold = job.threshold;
+  options.sampler = static_cast<SamplerKind>(job.sampler);
+  options.pass_spp = job.pass_spp;
+  options.wavefront_size = job.wavefront_size;
+  options.threads = threads;
+
+  while (recv_all(fd, &header, sizeof(header))) {
+    if (header.type == static_cast<std::uint32_t>(MessageType::Done)) {
+      break;
+    }
+    RegionHeader item;
+    if (header.type != static_cast<std::uint32_t>(MessageType::Region) ||
+        header.size != sizeof(RegionHeader) || !recv_all(fd, &item, sizeof(item))) {
+      throw std::runtime_error{"Invalid message from " + address};
+    }
+    const auto& region = item.region;
+    if (region.x0 >= region.x1 || region.x1 > job.width ||
+        region.y0 >= region.y1 || region.y1 > job.height) {
+      throw std::runtime_error{"Invalid region from " + address};
+    }
+
+    Film film{region.x1 - region.x0, region.y1 - region.y0, region.y0, region.x0};
+    if (job.features != 0) {
+      film.enable_features();
+    }
+    render_region(job.width, job.height, *world, world->materials(), cam, region, item.pass,
+                  item.spp, options, film);
+    const auto& sums = film.sums();
+    const auto& counts = film.counts();
+    const auto& features = film.feature_sums();
+    if (!send_message(fd, MessageType::Result,
+                      {Buffer{&item, sizeof(item)},
+                       Buffer{sums.data(), sums.size() * sizeof(float)},
+                       Buffer{counts.data(), counts.size() * sizeof(std::uint32_t)},
+                       Buffer{features.data(), features.size() * sizeof(float)}})) {
+      break;
+    }
+  }
+  return true;
+}
+
+} // namespace rt
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cstring>
+
+#include <image.hpp>
+
+namespace rt {
+namespace {
+
+// Channel pixel types
+constexpr std::int32_t EXR_HALF = 1;
+constexpr std::int32_t EXR_FLOAT = 2;
+
+/*
+ * IEEE 754 binary16, rounded to nearest even. Overflows go to infinity and
+ * values too small for a subnormal to zero
+ */
+std::uint16_t to_half(float value) {
+    std::uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    const auto sign = static_cast<std::uint16_t>((f >> 16) & 0x8000);
+    const auto exponent = static_cast<std::int32_t>((f >> 23) & 0xFF) - 127 + 15;
+    auto mantissa = f & 0x7FFFFF;
+
+    if (((f >> 23) & 0xFF) == 0xFF) {
+	// Infinity or NaN
+	return sign | 0x7C00 | (mantissa != 0 ? 0x200 : 0);
+    }
+    if (exponent >= 31) {
+	return sign | 0x7C00;
+    }
+    if (exponent <= 0) {
+	if (exponent < -10) {
+	    return sign;
+	}
+	// Subnormal: shift the mantissa, with its implicit bit, into place
+	mantissa |= 0x800000;
+	const auto shift = static_cast<std::uint32_t>(14 - exponent);
+	auto half = mantissa >> shift;
+	const auto rest = mantissa & ((1U << shift) - 1);
+	const auto halfway = 1U << (shift - 1);
+	if (rest > halfway || (rest == halfway && (half & 1))) {
+	    ++half;
+	}
+	return sign | static_cast<std::uint16_t>(half);
+    }
+    auto half = (static_cast<std::uint32_t>(exponent) << 10) | (mantissa >> 13);
+    const auto rest = mantissa & 0x1FFF;
+    // A carry out of the mantissa correctly bumps the exponent
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+	++half;
+    }
+    return sign | static_cast<std::uint16_t>(half);
+}
+
+template<typename T>
+void put(std::ostream& os, T value) {
+    os.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void put_attribute(std::ostream& os, const char* name, const char* type, std::int32_t size) {
+    os.write(name, std::strlen(name) + 1);
+    os.write(type, std::strlen(type) + 1);
+    put(os, size);
+}
+
+} // Unnamed namespace
+
+void EXRWriter::write(const std::vector<float>& buffer, std::size_t width, std::size_t height) const {
+    EXRRowWriter writer{filepath_, half_};
+    writer.begin(width, height);
+    // The buffer is stored bottom up
+    for (auto i = height ; i > 0 ; --i) {
+	writer.write_rows(&buffer[(i - 1) * width * 3], 1);
+    }
+    writer.end();
+}
+
+void EXRRowWriter::begin(std::size_t width, std::size_t height) {
+    width_ = width;
+    row_ = 0;
+    os_.open(filepath_, std::ios::binary | std::ios::trunc);
+
+    // Magic number and version 2, single part scan line file
+    put<std::uint32_t>(os_, 20000630);
+    put<std::uint32_t>(os_, 2);
+
+    // Channels are stored in alphabetical order, each with its index in the
+    // pixels of the rows
+    std::vector<std::pair<std::string, std::size_t>> channels{{"R", 0}, {"G", 1}, {"B", 2}};
+    for (auto k = 0U ; k < extra_.size() ; ++k) {
+	channels.emplace_back(extra_[k].name, 3 + k);
+    }
+    std::sort(channels.begin(), channels.end());
+    std::int32_t list_size = 1;
+    for (const auto& channel : channels) {
+	list_size += static_cast<std::int32_t>(channel.first.size() + 1 + 16);
+    }
+    put_attribute(os_, "channels", "chlist", list_size);
+    layout_.clear();
+    std::size_t offset = 0;
+    for (const auto& channel : channels) {
+	const auto source = channel.second;
+	const auto half = half_ && (source < 3 || !extra_[source - 3].exact);
+	os_.write(channel.first.c_str(), channel.first.size() + 1);
+	put<std::int32_t>(os_, half ? EXR_HALF : EXR_FLOAT);
+	// pLinear and 3 reserved bytes, then the x and y sampling
+	put<std::uint32_t>(os_, 0);
+	put<std::int32_t>(os_, 1);
+	put<std::int32_t>(os_, 1);
+	layout_.push_back(Layout{source, half, offset});
+	offset += width * (half ? sizeof(std::uint16_t) : sizeof(float));
+    }
+    os_.put(0);
+
+    put_attribute(os_, "compression", "compression", 1);
+    os_.put(0);
+    const auto x_max = static_cast<std::int32_t>(width) - 1;
+    const auto y_max = static_cast<std::int32_t>(height) - 1;
+    for (const auto* window : {"dataWindow", "displayWindow"}) {
+	put_attribute(os_, window, "box2i", 16);
+	put<std::int32_t>(os_, 0);
+	put<std::int32_t>(os_, 0);
+	put<std::int32_t>(os_, x_max);
+	put<std::int32_t>(os_, y_max);
+    }
+    // Increasing y: the top row first
+    put_attribute(os_, "lineOrder", "lineOrder", 1);
+    os_.put(0);
+    put_attribute(os_, "pixelAspectRatio", "float", 4);
+    put<float>(os_, 1.0f);
+    put_attribute(os_, "screenWindowCenter", "v2f", 8);
+    put<float>(os_, 0.0f);
+    put<float>(os_, 0.0f);
+    put_attribute(os_, "screenWindowWidth", "float", 4);
+    put<float>(os_, 1.0f);
+    os_.put(0);
+
+    // Uncompressed lines all have the same size, so the offset table is known
+    // up front. Every line is its y, its size, then the channels one after
+    // the other
+    line_.resize(offset);
+    const auto first_line = static_cast<std::uint64_t>(os_.tellp()) + height * sizeof(std::uint64_t);
+    const auto line_bytes = 2 * sizeof(std::int32_t) + line_.size();
+    for (auto y = 0U ; y < height ; ++y) {
+	put<std::uint64_t>(os_, first_line + y * line_bytes);
+    }
+}
+
+void EXRRowWriter::write_rows(const float* rows, std::size_t count) {
+    const auto stride = 3 + extra_.size();
+    for (auto i = 0U ; i < count ; ++i, ++row_) {
+	const auto* row = rows + i * width_ * stride;
+	for (const auto& channel : layout_) {
+	    auto* out = line_.data() + channel.offset;
+	    for (auto x = 0U ; x < width_ ; ++x) {
+		const auto value = row[x * stride + channel.source];
+		if (channel.half) {
+		    const auto h = to_half(value);
+		    std::memcpy(out + x * sizeof(h), &h, sizeof(h));
+		} else {
+		    std::memcpy(out + x * sizeof(value), &value, sizeof(value));
+		}
+	    }
+	}
+	put<std::int32_t>(os_, static_cast<std::int32_t>(row_));
+	put<std::int32_t>(os_, static_cast<std::int32_t>(line_.size()));
+	os_.write(line_.data(), line_.size());
+    }
+}
+
+void EXRRowWriter::end() {
+    os_.close();
+}
+
+} // namespace rt
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+#include <film.hpp>
+
+namespace rt {
+namespace {
+
+const char CHECKPOINT_MAGIC[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '3'};
+// Checkpoints without features
+const char CHECKPOINT_MAGIC_V1[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '1'};
+// Checkpoints without the samples per pass
+const char CHECKPOINT_MAGIC_V2[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '2'};
+
+template<typename T>
+void write_raw(std::ostream& os, const T* data, std::size_t count) {
+  os.write(reinterpret_cast<const char*>(data), sizeof(T) * count);
+}
+
+template<typename T>
+void read_raw(std::istream& is, T* data, std::size_t count) {
+  is.read(reinterpret_cast<char*>(data), sizeof(T) * count);
+}
+
+} // Unnamed namespace
+
+const char* aov_name(AOV aov) {
+  switch (aov) {
+    case AOV::Normal: return "normal";
+    case AOV::Albedo: return "albedo";
+    case AOV::Depth: return "depth";
+    case AOV::Material: return "material";
+    case AOV::Samples: return "samples";
+  }
+  return "";
+}
+
+std::size_t aov_channels(AOV aov) {
+  return aov == AOV::Normal || aov == AOV::Albedo ? 3 : 1;
+}
+
+std::vector<std::uint8_t> Film::to_rgb8() const {
+  // Conversion factor to go from float to unsigned char for RGB components
+  const auto CONV = 255.99f;
+
+  std::vector<std::uint8_t> img(sum_.size());
+  for (auto y = first_row_ ; y < first_row_ + height_ ; ++y) {
+    for (auto x = first_column_ ; x < first_column_ + width_ ; ++x) {
+      auto c = color(x, y);
+      c.sqrt();
+      const auto base_idx = index(x, y) * 3;
+      // Emitters are brighter than white, and would wrap around
+      for (auto k = 0 ; k < 3 ; ++k) {
+        img[base_idx + k] = static_cast<std::uint8_t>(std::min(c[k], 1.0f) * CONV);
+      }
+    }
+  }
+  return img;
+}
+
+std::vector<float> Film::to_rgbf() const {
+  std::vector<float> img(sum_.size());
+  for (auto y = first_row_ ; y < first_row_ + height_ ; ++y) {
+    for (auto x = first_column_ ; x < first_column_ + width_ ; ++x) {
+      const auto c = color(x, y);
+      const auto base_idx = index(x, y) * 3;
+      img[base_idx] = c.x();
+      img[base_idx + 1] = c.y();
+      img[base_idx + 2] = c.z();
+    }
+  }
+  return img;
+}
+
+void Film::aov(AOV aov, std::uint32_t x, std::uint32_t y, float* values) const {
+  if (aov == AOV::Samples) {
+    values[0] = static_cast<float>(samples(x, y));
+    return;
+  }
+  const auto f = features(x, y);
+  switch (aov) {
+    case AOV::Normal:
+    case AOV::Albedo: {
+      const auto& v = aov == AOV::Normal ? f.normal : f.albedo;
+      values[0] = v.x();
+      values[1] = v.y();
+      values[2] = v.z();
+      break;
+    }
+    case AOV::Depth:
+      values[0] = f.depth;
+      break;
+    default:
+      values[0] = f.material == NO_MATERIAL ? -1.0f : static_cast<float>(f.material);
+      break;
+  }
+}
+
+void Film::save(const std::string& path, std::uint64_t seed, std::uint32_t passes,
+                std::uint32_t pass_spp) const {
+  const auto tmp = path + ".tmp";
+  {
+    std::ofstream os{tmp, std::ios::binary | std::ios::trunc};
+    write_raw(os, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    write_raw(os, &width_, 1);
+    write_raw(os, &height_, 1);
+    write_raw(os, &seed, 1);
+    write_raw(os, &passes, 1);
+    write_raw(os, &pass_spp, 1);
+    write_raw(os, sum_.data(), sum_.size());
+    write_raw(os, samples_.data(), samples_.size());
+    const auto channels = static_cast<std::uint32_t>(has_features() ? FEATURE_CHANNELS : 0);
+    write_raw(os, &channels, 1);
+    write_raw(os, features_.data(), features_.size());
+    if (!os) {
+      throw std::runtime_error{"Cannot write checkpoint " + tmp};
+    }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error{"Cannot replace checkpoint " + path};
+  }
+}
+
+bool Film::load(const std::string& path, std::uint64_t& seed, std::uint32_t& passes,
+                std::uint32_t& pass_spp) {
+  std::ifstream is{path, std::ios::binary};
+  if (!is) {
+    return false;
+  }
+  char magic[sizeof(CHECKPOINT_MAGIC)];
+  std::uint32_t width = 0, height = 0;
+  read_raw(is, magic, sizeof(magic));
+  read_raw(is, &width, 1);
+  read_raw(is, &height, 1);
+  const auto v1 = std::equal(magic, magic + sizeof(magic), CHECKPOINT_MAGIC_V1);
+  const auto v2 = std::equal(magic, magic + sizeof(magic), CHECKPOINT_MAGIC_V2);
+  if (!is || (!v1 && !v2 && !std::equal(magic, magic + sizeof(magic), CHECKPOINT_MAGIC))) {
+    throw std::runtime_error{path + " is not a checkpoint"};
+  }
+  if (width != width_ || height != height_) {
+    throw std::runtime_error{path + " is a checkpoint of an image of a different size"};
+  }
+  read_raw(is, &seed, 1);
+  read_raw(is, &passes, 1);
+  pass_spp = 0;
+  if (!v1 && !v2) {
+    read_raw(is, &pass_spp, 1);
+  }
+  read_raw(is, sum_.data(), sum_.size());
+  read_raw(is, samples_.data(), samples_.size());
+  std::uint32_t channels = 0;
+  if (!v1) {
+    read_raw(is, &channels, 1);
+  }
+  if (has_features()) {
+    if (is && channels == 0) {
+      throw std::runtime_error{path + " has no features"};
+    }
+    if (is && channels != FEATURE_CHANNELS) {
+      throw std::runtime_error{path + " has features of another version"};
+    }
+    read_raw(is, features_.data(), features_.size());
+  }
+  if (!is) {
+    throw std::runtime_error{path + " is truncated"};
+  }
+  return true;
+}
+
+} // namespace rt
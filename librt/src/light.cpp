@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <tuple>
+
+#include <light.hpp>
+#include <material.hpp>
+#include <sampler.hpp>
+
+namespace rt {
+namespace {
+
+/*
+ * 1 - cos(theta_max), where theta_max is the half angle of the cone a sphere
+ * of squared radius r2 subtends at squared distance d2 > r2. Written so that
+ * small cones keep their precision
+ */
+float cone_width(float r2, float d2) {
+  const auto sin2 = r2 / d2;
+  return sin2 / (1 + std::sqrt(std::max(0.0f, 1 - sin2)));
+}
+
+} // Unnamed namespace
+
+Lights::Lights(const Hitable& world, const MaterialTable& materials) : materials_{&materials} {
+  world.collect_lights(materials, lights_);
+  // Acceleration structures reorder their objects: sorting gives every
+  // structure of the same spheres the same lights, and the same images
+  std::sort(lights_.begin(), lights_.end(), [](const SphereLight& a, const SphereLight& b) {
+      return std::make_tuple(a.center.x(), a.center.y(), a.center.z(), a.radius, a.material) <
+          std::make_tuple(b.center.x(), b.center.y(), b.center.z(), b.radius, b.material);
+    });
+}
+
+bool Lights::sample(const Vector3f& p, Sampler& sampler, LightSample& sample) const {
+  const auto n = lights_.size();
+  // The first dimension picks the light, and what is left of it places the
+  // direction in the cone
+  auto u = sampler.uniform() * n;
+  const auto k = std::min(static_cast<std::size_t>(u), n - 1);
+  u -= k;
+  const auto v = sampler.uniform();
+
+  const auto& light = lights_[k];
+  const auto to_center = light.center - p;
+  const auto d2 = dot(to_center, to_center);
+  const auto r2 = light.radius * light.radius;
+  if (d2 <= r2) {
+    return false;
+  }
+  const auto d = std::sqrt(d2);
+  const auto w = to_center / d;
+  const auto width = cone_width(r2, d2);
+  const auto cos_theta = 1 - u * width;
+  const auto sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+  const auto phi = 2 * static_cast<float>(M_PI) * v;
+
+  // Orthonormal basis around w (Duff et al., "Building an Orthonormal Basis,
+  // Revisited", 2017)
+  const auto sign = std::copysign(1.0f, w.z());
+  const auto a = -1 / (sign + w.z());
+  const auto b = w.x() * w.y() * a;
+  const Vector3f s{1 + sign * w.x() * w.x() * a, sign * b, -sign * w.x()};
+  const Vector3f t{b, sign + w.y() * w.y() * a, -w.y()};
+  sample.dir = (sin_theta * std::cos(phi)) * s + (sin_theta * std::sin(phi)) * t + cos_theta * w;
+  // Nearest intersection with the sphere, which every direction of the cone
+  // has, up to rounding
+  sample.distance = d * cos_theta -
+      std::sqrt(std::max(0.0f, r2 - d2 * sin_theta * sin_theta));
+  sample.emitted = emmitted((*materials_)[light.material]);
+  sample.pdf = 1 / (n * 2 * static_cast<float>(M_PI) * width);
+  return true;
+}
+
+float Lights::pdf(const Vector3f& p, const Hit& hit) const {
+  // Hits do not tell which object they are on: the light hit is the one of
+  // that material whose surface passes closest to the point
+  const SphereLight* closest = nullptr;
+  auto gap = FLT_MAX;
+  for (const auto& light : lights_) {
+    if (light.material != hit.material) {
+      continue;
+    }
+    const auto g = std::abs((hit.p - light.center).norm2() - std::abs(light.radius));
+    if (g < gap) {
+      gap = g;
+      closest = &light;
+    }
+  }
+  if (closest == nullptr) {
+    return 0;
+  }
+  const auto to_center = closest->center - p;
+  const auto d2 = dot(to_center, to_center);
+  const auto r2 = closest->radius * closest->radius;
+  if (d2 <= r2) {
+    return 0;
+  }
+  return 1 / (lights_.size() * 2 * static_cast<float>(M_PI) * cone_width(r2, d2));
+}
+
+} // namespace rt
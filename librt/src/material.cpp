@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cmath>
+
 #include <material.hpp>
 #include <ray.hpp>
 #include <vector.hpp>
@@ -32,30 +35,56 @@ float schlick(float cosine, float ref_idx) {
 
 } // Unnamed namespace
 
-bool Lambertian::scatter(const Ray& /* ray */,
-			 const Hit& rec,
-			 Vector3f& attenuation,
-			 Ray& scattered) const {
-  Vector3f target = rec.p + rec.normal + random_in_unit_sphere();
+bool scatter_lambertian(const MaterialRecord& material,
+			const Ray& /* ray */,
+			const Hit& rec,
+			Vector3f& attenuation,
+			Ray& scattered,
+			Sampler& sampler) {
+  Vector3f target = rec.p + rec.normal + sampler.in_unit_sphere();
   scattered = Ray{rec.p, target - rec.p};
-  attenuation = albedo_->value(0, 0, rec.p);
+  attenuation = material.albedo.value(0, 0, rec.p);
   return true;
 }
 
-bool Metal::scatter(const Ray& ray,
+bool scatter_cosine(const MaterialRecord& material,
+		    const Ray& /* ray */,
+		    const Hit& rec,
+		    Vector3f& attenuation,
+		    Ray& scattered,
+		    Sampler& sampler) {
+  // The normal plus a point on the unit sphere
+  const auto z = 1 - 2 * sampler.uniform();
+  const auto phi = 2 * static_cast<float>(M_PI) * sampler.uniform();
+  const auto r = std::sqrt(std::max(0.0f, 1 - z * z));
+  auto dir = rec.normal + Vector3f{r * std::cos(phi), r * std::sin(phi), z};
+  if (dir.squared_length() < 1e-8f) {
+    dir = rec.normal;
+  }
+  scattered = Ray{rec.p, dir};
+  attenuation = material.albedo.value(0, 0, rec.p);
+  return true;
+}
+
+bool scatter_metal(const MaterialRecord& material,
+		   const Ray& ray,
 		   const Hit& rec,
 		   Vector3f& attenuation,
-		   Ray& scattered) const {
+		   Ray& scattered,
+		   Sampler& /* sampler */) {
   Vector3f reflected = reflect(unit_vector(ray.dir()), rec.normal);
   scattered = Ray{rec.p, reflected};
-  attenuation = albedo_;
+  attenuation = material.color;
   return dot(scattered.dir(), rec.normal) > 0;
 }
 
-bool Dielectric::scatter(const Ray& ray,
-		   const Hit& rec,
-		   Vector3f& attenuation,
-		   Ray& scattered) const {
+bool scatter_dielectric(const MaterialRecord& material,
+			const Ray& ray,
+			const Hit& rec,
+			Vector3f& attenuation,
+			Ray& scattered,
+			Sampler& sampler) {
+  const auto ref_idx = material.ref_idx;
   Vector3f outward_normal;
   Vector3f reflected = reflect(ray.dir(), rec.normal);
   float ni_over_nt;
@@ -65,25 +94,22 @@ bool Dielectric::scatter(const Ray& ray,
   float cosine;
   if (dot(ray.dir(), rec.normal) > 0) {
     outward_normal = -rec.normal;
-    ni_over_nt = ref_idx_;
-    cosine = ref_idx_ * dot(ray.dir(), rec.normal) / ray.dir().norm2();
+    ni_over_nt = ref_idx;
+    cosine = ref_idx * dot(ray.dir(), rec.normal) / ray.dir().norm2();
   } else {
     outward_normal = rec.normal;
-    ni_over_nt = 1 / ref_idx_;
+    ni_over_nt = 1 / ref_idx;
     cosine = -dot(ray.dir(), rec.normal) / ray.dir().norm2();
   }
 
   if (refract(ray.dir(), outward_normal, ni_over_nt, refracted)) {
-    reflect_prob = schlick(cosine, ref_idx_);
+    reflect_prob = schlick(cosine, ref_idx);
   } else {
     scattered = Ray{rec.p, reflected};
     reflect_prob = 1.0;
   }
 
-  auto dis = std::uniform_real_distribution<>{0.0, 1.0};
-  std::random_device device;
-
-  if(dis(device) < reflect_prob) {
+  if(sampler.uniform() < reflect_prob) {
     scattered = Ray{rec.p, reflected};
   } else {
     scattered = Ray{rec.p, refracted};
@@ -94,25 +120,50 @@ bool Dielectric::scatter(const Ray& ray,
 
 void MaterialRegistry::register_lambertian(const std::string& name,
 					   Texture* attenuation) {
-  registry_[name] = std::make_unique<Lambertian>(attenuation);
+  const MaterialRecord record{MaterialKind::Lambertian, attenuation->record(),
+                              Vector3f{0, 0, 0}, 0};
+  registry_[name] = table_.add(record);
 }
 
 void MaterialRegistry::register_metal(const std::string& name,
 				      const Vector3f& attenuation) {
-    registry_[name] = std::make_unique<Metal>(attenuation);
+  const MaterialRecord record{MaterialKind::Metal, TextureRecord{}, attenuation, 0};
+  registry_[name] = table_.add(record);
 }
 
 void MaterialRegistry::register_dielectric(const std::string& name,
 					   float ref_idx) {
-  registry_[name] = std::make_unique<Dielectric>(ref_idx);
+  const MaterialRecord record{MaterialKind::Dielectric, TextureRecord{}, Vector3f{0, 0, 0},
+                              ref_idx};
+  registry_[name] = table_.add(record);
 }
 
 void MaterialRegistry::register_light(const std::string& name,
 				      const Vector3f& color) {
-  registry_[name] = std::make_unique<Light>(color);
+  const MaterialRecord record{MaterialKind::Light, TextureRecord{}, color, 0};
+  registry_[name] = table_.add(record);
+}
+
+MaterialId MaterialRegistry::get(const std::string& name) const {
+  return registry_.at(name);
+}
+
+MaterialId MaterialRegistry::generate_lambertial(rt::TextureRegistry& textures, Random& rng) {
+  const MaterialRecord record{MaterialKind::Lambertian, textures.random_color(rng)->record(),
+                              Vector3f{0, 0, 0}, 0};
+  return table_.add(record);
+}
+
+MaterialId MaterialRegistry::generate_metal(Random& rng) {
+  const auto r = 0.5f * (1 + rng.uniform());
+  const auto g = 0.5f * (1 + rng.uniform());
+  const auto b = 0.5f * rng.uniform();
+  const MaterialRecord record{MaterialKind::Metal, TextureRecord{}, rt::Vector3f{r, g, b}, 0};
+  return table_.add(record);
 }
 
-Material* MaterialRegistry::get(const std::string& name) {
-  return registry_[name].get();
+MaterialId MaterialRegistry::generate_dielectric() {
+  const MaterialRecord record{MaterialKind::Dielectric, TextureRecord{}, Vector3f{0, 0, 0}, 1.5};
+  return table_.add(record);
 }
 }
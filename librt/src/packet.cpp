@@ -0,0 +1,37 @@
+#include <hitable.hpp>
+#include <packet.hpp>
+#include <ray.hpp>
+
+namespace rt {
+
+std::uint32_t Hitable::hit_packet(const RayPacket& packet, std::uint32_t active,
+                                  float t_min, HitPacket& hits) const {
+  std::uint32_t mask = 0;
+  Hit tmp_hit;
+  for_each_lane(active, [&](std::uint32_t lane) {
+      if (hit(packet.ray(lane), t_min, hits.t[lane], tmp_hit)) {
+        hits.t[lane] = tmp_hit.t;
+        hits.hit[lane] = tmp_hit;
+        mask |= 1U << lane;
+      }
+    });
+  return mask;
+}
+
+bool Hitable::occluded(const Ray& r, float t_min, float t_max) const {
+  Hit rec;
+  return hit(r, t_min, t_max, rec);
+}
+
+std::uint32_t Hitable::occluded_packet(const RayPacket& packet, std::uint32_t active,
+                                       float t_min, const float* t_max) const {
+  std::uint32_t mask = 0;
+  for_each_lane(active, [&](std::uint32_t lane) {
+      if (occluded(packet.ray(lane), t_min, t_max[lane])) {
+        mask |= 1U << lane;
+      }
+    });
+  return mask;
+}
+
+} // namespace rt
@@ -0,0 +1,39 @@
+#include <bvh.hpp>
+#include <hitable_list.hpp>
+#include <path.hpp>
+#include <scene_file.hpp>
+#include <sphere_set.hpp>
+
+namespace rt {
+namespace {
+
+/*
+ * Kernel for worlds of type World if world is one, with the background
+ * picked at run time among the two instantiations
+ */
+template<typename World>
+bool try_kernel(const Hitable& world, const PathSettings& settings, PathKernel& kernel) {
+  if (dynamic_cast<const World*>(&world) == nullptr) {
+    return false;
+  }
+  kernel = settings.background ?
+      static_path_kernel<World, true, DEFAULT_MAX_DEPTH>() :
+      static_path_kernel<World, false, DEFAULT_MAX_DEPTH>();
+  return true;
+}
+
+} // Unnamed namespace
+
+PathKernel path_kernel(const Hitable& world, const PathSettings& settings) {
+  PathKernel kernel;
+  if (settings.max_depth == DEFAULT_MAX_DEPTH &&
+      (try_kernel<SphereSet>(world, settings, kernel) ||
+       try_kernel<MappedScene>(world, settings, kernel) ||
+       try_kernel<BVH>(world, settings, kernel) ||
+       try_kernel<HitableList>(world, settings, kernel))) {
+    return kernel;
+  }
+  return PathKernel{};
+}
+
+} // namespace rt
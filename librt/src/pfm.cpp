@@ -0,0 +1,39 @@
+#include <image.hpp>
+
+namespace rt {
+
+void PFMWriter::write(const std::vector<float>& buffer, std::size_t width, std::size_t height) const {
+    PFMRowWriter writer{filepath_};
+    writer.begin(width, height);
+    // The buffer is stored bottom up
+    for (auto i = height ; i > 0 ; --i) {
+	writer.write_rows(&buffer[(i - 1) * width * 3], 1);
+    }
+    writer.end();
+}
+
+void PFMRowWriter::begin(std::size_t width, std::size_t height) {
+    width_ = width;
+    height_ = height;
+    row_ = 0;
+    os_.open(filepath_, std::ios::binary | std::ios::trunc);
+    // A negative scale means little endian data
+    os_ << "PF\n" << width << " " << height << "\n-1.0\n";
+    data_ = os_.tellp();
+}
+
+void PFMRowWriter::write_rows(const float* rows, std::size_t count) {
+    // PFM stores the bottom row first: rows arriving from the top are placed
+    // from the end of the file backwards
+    const auto row_bytes = static_cast<std::streamoff>(width_ * 3 * sizeof(float));
+    for (auto i = 0U ; i < count ; ++i, ++row_) {
+	os_.seekp(data_ + static_cast<std::streamoff>(height_ - 1 - row_) * row_bytes);
+	os_.write(reinterpret_cast<const char*>(rows + i * width_ * 3), row_bytes);
+    }
+}
+
+void PFMRowWriter::end() {
+    os_.close();
+}
+
+} // namespace rt
@@ -0,0 +1,286 @@
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <image.hpp>
+#include <scheduler.hpp>
+
+#include <zlib.h>
+
+namespace rt {
+namespace {
+
+constexpr std::size_t BYTES_PER_PIXEL = 3;
+// Deflate can refer back this far, so this much data primes every block
+constexpr std::size_t WINDOW = 32768;
+
+void put_u32(std::vector<std::uint8_t>& out, std::uint32_t value) {
+    out.push_back(static_cast<std::uint8_t>(value >> 24));
+    out.push_back(static_cast<std::uint8_t>(value >> 16));
+    out.push_back(static_cast<std::uint8_t>(value >> 8));
+    out.push_back(static_cast<std::uint8_t>(value));
+}
+
+std::uint8_t paeth(int a, int b, int c) {
+    const auto p = a + b - c;
+    const auto pa = std::abs(p - a);
+    const auto pb = std::abs(p - b);
+    const auto pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) {
+	return static_cast<std::uint8_t>(a);
+    }
+    return static_cast<std::uint8_t>(pb <= pc ? b : c);
+}
+
+/*
+ * Filter one row with filter type `type` (0 to 4) into out, which gets the
+ * type byte followed by the filtered bytes
+ */
+void filter_row(int type, const std::uint8_t* row, const std::uint8_t* prev, std::size_t size,
+		std::uint8_t* out) {
+    out[0] = static_cast<std::uint8_t>(type);
+    ++out;
+    for (auto i = 0U ; i < size ; ++i) {
+	const int a = i >= BYTES_PER_PIXEL ? row[i - BYTES_PER_PIXEL] : 0;
+	const int b = prev[i];
+	const int c = i >= BYTES_PER_PIXEL ? prev[i - BYTES_PER_PIXEL] : 0;
+	switch (type) {
+	    case 0: out[i] = row[i]; break;
+	    case 1: out[i] = static_cast<std::uint8_t>(row[i] - a); break;
+	    case 2: out[i] = static_cast<std::uint8_t>(row[i] - b); break;
+	    case 3: out[i] = static_cast<std::uint8_t>(row[i] - (a + b) / 2); break;
+	    default: out[i] = static_cast<std::uint8_t>(row[i] - paeth(a, b, c)); break;
+	}
+    }
+}
+
+/*
+ * Adaptive filtering keeps the filter with the lowest sum of the absolute
+ * values of its output, read as signed bytes
+ */
+void filter_row(PNGFilter filter, const std::uint8_t* row, const std::uint8_t* prev,
+		std::size_t size, std::uint8_t* out, std::vector<std::uint8_t>& scratch) {
+    if (filter != PNGFilter::Adaptive) {
+	filter_row(static_cast<int>(filter), row, prev, size, out);
+	return;
+    }
+    scratch.resize(size + 1);
+    auto best = ~0ULL;
+    for (auto type = 0 ; type < 5 ; ++type) {
+	filter_row(type, row, prev, size, scratch.data());
+	auto cost = 0ULL;
+	for (auto i = 1U ; i <= size ; ++i) {
+	    cost += std::abs(static_cast<int>(static_cast<std::int8_t>(scratch[i])));
+	}
+	if (cost < best) {
+	    best = cost;
+	    std::copy(scratch.begin(), scratch.end(), out);
+	}
+    }
+}
+
+/*
+ * Raw deflate of one block, primed with dictionary. The output ends on a
+ * byte boundary (sync flush), or with the final block of the stream
+ */
+std::vector<std::uint8_t> deflate_block(const std::uint8_t* data, std::size_t size,
+					const std::uint8_t* dictionary, std::size_t dictionary_size,
+					int level, int strategy, bool last) {
+    z_stream zs{};
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+	throw std::runtime_error{"Cannot initialize zlib"};
+    }
+    if (dictionary_size > 0) {
+	deflateSetDictionary(&zs, dictionary, static_cast<uInt>(dictionary_size));
+    }
+
+    // Room for the worst case, plus the empty stored block of the flush
+    std::vector<std::uint8_t> out(deflateBound(&zs, size) + 16);
+    zs.next_in = const_cast<Bytef*>(data);
+    zs.avail_in = static_cast<uInt>(size);
+    zs.next_out = out.data();
+    zs.avail_out = static_cast<uInt>(out.size());
+    while (true) {
+	const auto status = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+	if (last ? status == Z_STREAM_END : zs.avail_out > 0) {
+	    break;
+	}
+	const auto done = out.size() - zs.avail_out;
+	out.resize(out.size() * 2);
+	zs.next_out = out.data() + done;
+	zs.avail_out = static_cast<uInt>(out.size() - done);
+    }
+    out.resize(out.size() - zs.avail_out);
+    deflateEnd(&zs);
+    return out;
+}
+
+} // Unnamed namespace
+
+void PNGWriter::write(const std::vector<uint8_t>& buffer, std::size_t width, std::size_t height) const {
+    PNGRowWriter writer{filepath_, options_};
+    writer.begin(width, height);
+    // The buffer is stored bottom up
+    for (auto i = height ; i > 0 ; --i) {
+	writer.write_rows(&buffer[(i - 1) * width * 3], 1);
+    }
+    writer.end();
+}
+
+PNGRowWriter::~PNGRowWriter() {
+    // Finish an image that was not ended. Destructors must not throw, and
+    // the rows that could not be written are lost anyway
+    if (os_.is_open()) {
+	try {
+	    end();
+	} catch (...) {
+	}
+    }
+}
+
+void PNGRowWriter::begin(std::size_t width, std::size_t height) {
+    width_ = width;
+    const auto row_bytes = width * BYTES_PER_PIXEL;
+    block_rows_ = options_.block_rows > 0 ? options_.block_rows :
+	std::max<std::size_t>(1, (256 * 1024) / (row_bytes + 1));
+    threads_ = TileScheduler{options_.threads}.threads();
+    pending_.clear();
+    previous_.assign(row_bytes, 0);
+    dictionary_.clear();
+    adler_ = adler32(0, nullptr, 0);
+    header_written_ = false;
+
+    os_.open(filepath_, std::ios::binary | std::ios::trunc);
+    if (!os_) {
+	throw std::runtime_error{"Cannot write " + filepath_};
+    }
+    const char signature[8] = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+    os_.write(signature, sizeof(signature));
+
+    // 8 bit RGB, no interlacing
+    std::vector<std::uint8_t> ihdr;
+    put_u32(ihdr, static_cast<std::uint32_t>(width));
+    put_u32(ihdr, static_cast<std::uint32_t>(height));
+    ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});
+    write_chunk("IHDR", ihdr);
+}
+
+void PNGRowWriter::write_rows(const std::uint8_t* rows, std::size_t count) {
+    pending_.insert(pending_.end(), rows, rows + count * width_ * BYTES_PER_PIXEL);
+    if (pending_.size() >= threads_ * block_rows_ * width_ * BYTES_PER_PIXEL) {
+	flush(false);
+    }
+}
+
+void PNGRowWriter::end() {
+    flush(true);
+    write_chunk("IEND", {});
+    os_.close();
+}
+
+void PNGRowWriter::flush(bool last) {
+    const auto row_bytes = width_ * BYTES_PER_PIXEL;
+    const auto rows = static_cast<std::uint32_t>(pending_.size() / row_bytes);
+    if (rows == 0 && !last) {
+	return;
+    }
+
+    // Blocks are row ranges [y0, y1) of the pending rows. The last flush
+    // always has one, to end the stream
+    std::vector<Tile> blocks;
+    for (auto y = 0U ; y < rows || (blocks.empty() && last) ; y += block_rows_) {
+	blocks.push_back(Tile{0, y, 0, std::min<std::uint32_t>(y + block_rows_, rows)});
+    }
+    const TileScheduler scheduler{threads_};
+
+    // Filter all the rows first, so that each block can be primed with the
+    // data before it
+    std::vector<std::uint8_t> filtered(static_cast<std::size_t>(rows) * (row_bytes + 1));
+    scheduler.run(blocks, [&](const Tile& block, unsigned) {
+	    std::vector<std::uint8_t> scratch;
+	    for (auto y = block.y0 ; y < block.y1 ; ++y) {
+		const auto* row = &pending_[y * row_bytes];
+		const auto* prev = y == 0 ? previous_.data() : row - row_bytes;
+		filter_row(options_.filter, row, prev, row_bytes,
+			   &filtered[y * (row_bytes + 1)], scratch);
+	    }
+	});
+
+    // libpng also trades Huffman matching for literals on filtered data
+    const auto strategy = options_.filter == PNGFilter::None ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+    std::vector<std::vector<std::uint8_t>> compressed(blocks.size());
+    std::vector<uLong> adler(blocks.size());
+    scheduler.run(blocks, [&](const Tile& block, unsigned) {
+	    const auto b = block.y0 / block_rows_;
+	    const auto begin = static_cast<std::size_t>(block.y0) * (row_bytes + 1);
+	    const auto end = static_cast<std::size_t>(block.y1) * (row_bytes + 1);
+
+	    // The window before the block: the end of the previous flushes,
+	    // then the filtered rows of this one
+	    std::vector<std::uint8_t> dictionary;
+	    if (begin < WINDOW) {
+		const auto from_previous = std::min(dictionary_.size(), WINDOW - begin);
+		dictionary.assign(dictionary_.end() - from_previous, dictionary_.end());
+	    }
+	    dictionary.insert(dictionary.end(),
+			      filtered.begin() + (begin > WINDOW ? begin - WINDOW : 0),
+			      filtered.begin() + begin);
+
+	    compressed[b] = deflate_block(filtered.data() + begin, end - begin,
+					  dictionary.data(), dictionary.size(),
+					  options_.level, strategy,
+					  last && b + 1 == blocks.size());
+	    adler[b] = adler32(adler32(0, nullptr, 0), filtered.data() + begin,
+			       static_cast<uInt>(end - begin));
+	});
+
+    for (auto b = 0U ; b < blocks.size() ; ++b) {
+	auto& data = compressed[b];
+	if (!header_written_) {
+	    // zlib header: deflate with a 32 KB window, and a level hint
+	    const auto level = options_.level;
+	    const std::uint8_t cmf = 0x78;
+	    std::uint8_t flg = static_cast<std::uint8_t>(
+		(level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6);
+	    flg |= 31 - (cmf * 256 + flg) % 31;
+	    data.insert(data.begin(), {cmf, flg});
+	    header_written_ = true;
+	}
+	const auto size = static_cast<z_off_t>(blocks[b].y1 - blocks[b].y0) * (row_bytes + 1);
+	adler_ = adler32_combine(adler_, adler[b], size);
+	if (last && b + 1 == blocks.size()) {
+	    put_u32(data, adler_);
+	}
+	write_chunk("IDAT", data);
+    }
+
+    // Keep what the next flush refers to
+    if (rows > 0) {
+	previous_.assign(pending_.end() - row_bytes, pending_.end());
+	dictionary_.insert(dictionary_.end(), filtered.end() -
+			   std::min(filtered.size(), WINDOW), filtered.end());
+	if (dictionary_.size() > WINDOW) {
+	    dictionary_.erase(dictionary_.begin(), dictionary_.end() - WINDOW);
+	}
+    }
+    pending_.clear();
+}
+
+void PNGRowWriter::write_chunk(const char* type, const std::vector<std::uint8_t>& data) {
+    std::vector<std::uint8_t> length;
+    put_u32(length, static_cast<std::uint32_t>(data.size()));
+    os_.write(reinterpret_cast<const char*>(length.data()), length.size());
+    os_.write(type, 4);
+    os_.write(reinterpret_cast<const char*>(data.data()), data.size());
+
+    auto crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+    // A null buffer would reset the CRC instead
+    if (!data.empty()) {
+	crc = crc32(crc, data.data(), static_cast<uInt>(data.size()));
+    }
+    std::vector<std::uint8_t> trailer;
+    put_u32(trailer, static_cast<std::uint32_t>(crc));
+    os_.write(reinterpret_cast<const char*>(trailer.data()), trailer.size());
+}
+
+} // namespace rt
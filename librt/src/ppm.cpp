@@ -0,0 +1,37 @@
+#include <image.hpp>
+
+namespace rt {
+
+void PPMWriter::write(const std::vector<uint8_t>& buffer, std::size_t width, std::size_t height) const {
+    PPMRowWriter writer{filepath_};
+    writer.begin(width, height);
+    // The buffer is stored bottom up
+    for (auto i = height ; i > 0 ; --i) {
+	writer.write_rows(&buffer[(i - 1) * width * 3], 1);
+    }
+    writer.end();
+}
+
+void PPMRowWriter::begin(std::size_t width, std::size_t height) {
+    width_ = width;
+    os_.open(filepath_);
+    os_ << "P3" << std::endl << width << " " << height << std::endl <<  "255" << std::endl;
+}
+
+void PPMRowWriter::write_rows(const std::uint8_t* rows, std::size_t count) {
+    for (auto i = 0U ; i < count ; ++i) {
+	const auto* row = rows + i * width_ * 3;
+	for (auto j = 0U; j < width_; ++j) {
+	    os_ << +row[j * 3] << " "
+		<< +row[j * 3 + 1] << " "
+		<< +row[j * 3 + 2] << " ";
+	}
+	os_ << std::endl;
+    }
+}
+
+void PPMRowWriter::end() {
+    os_.close();
+}
+
+} // namespace rt
@@ -1,122 +1,1105 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cfloat>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <exception>
 #include <fstream>
-#include <random>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include <camera.hpp>
+#include <denoise.hpp>
+#include <film.hpp>
+#include <hitable.hpp>
 #include <image.hpp>
+#include <light.hpp>
+#include <packet.hpp>
+#include <path.hpp>
+#include <random.hpp>
 #include <ray.hpp>
 #include <render.hpp>
+#include <sampler.hpp>
+#include <scheduler.hpp>
+#include <stats.hpp>
 #include <vector.hpp>
+#include <wavefront.hpp>
 
-#include <png.h>
+namespace rt {
+namespace {
+
+/*
+ * Running estimate of a pixel: the sum of its samples, plus the mean and
+ * variance (Welford) of their display luminance, which drive adaptive
+ * sampling, and the sum of their features when the frame captures them
+ */
+struct PixelEstimate {
+    Vector3f sum{0, 0, 0};
+    std::uint32_t samples = 0;
+    float mean = 0;
+    float m2 = 0;
+    Features features;
+
+    void add(const Vector3f& c) {
+	sum += c;
+	++samples;
+	// Noise is judged after the same sqrt the image goes through
+	const auto y = sqrtf(fmaxf(0.0f, 0.2126f * c.r() + 0.7152f * c.g() + 0.0722f * c.b()));
+	const auto delta = y - mean;
+	mean += delta / samples;
+	m2 += delta * (y - mean);
+    }
+
+    Vector3f color() const {
+	auto c = sum;
+	if (samples > 0) {
+	    c /= static_cast<float>(samples);
+	}
+	return c;
+    }
+
+    /*
+     * add() for a sample with features f
+     */
+    void add(const Vector3f& c, Features f) {
+	add(c);
+	const auto y = 0.2126f * c.r() + 0.7152f * c.g() + 0.0722f * c.b();
+	f.luminance2 = y * y;
+	features += f;
+    }
+};
+
+/*
+ * Name of channel c of an AOV stored as a layer of an EXR image
+ */
+std::string exr_channel(AOV aov, std::size_t c) {
+    static const char* const NAMES[AOV_KINDS][3] = {
+	{"X", "Y", "Z"}, {"R", "G", "B"}, {"Z"}, {"id"}, {"count"}};
+    return std::string{aov_name(aov)} + "." + NAMES[static_cast<std::size_t>(aov)][c];
+}
+
+/*
+ * 8 bit rendition of the values of an AOV: normals map [-1, 1] to [0, 255],
+ * albedos are tonemapped like the image, depths [0, depth_range] go from
+ * black to white, like misses, every material gets a color of its own
+ * (misses are black) and sample counts are gray levels, clamped to 255
+ */
+void aov_rgb8(AOV aov, const float* values, float depth_range, std::uint8_t* rgb) {
+    const auto CONV = 255.99f;
+    float c[3];
+    switch (aov) {
+	case AOV::Normal:
+	    for (auto k = 0 ; k < 3 ; ++k) {
+		c[k] = 0.5f * (values[k] + 1);
+	    }
+	    break;
+	case AOV::Albedo:
+	    for (auto k = 0 ; k < 3 ; ++k) {
+		c[k] = sqrtf(values[k]);
+	    }
+	    break;
+	case AOV::Depth:
+	    c[0] = c[1] = c[2] = values[0] > 0 ? values[0] / depth_range : 1.0f;
+	    break;
+	case AOV::Material: {
+	    // Consecutive ids land far apart
+	    const auto h = values[0] < 0 ? 0U :
+		(static_cast<std::uint32_t>(values[0]) + 1) * 0x9E3779B9U;
+	    rgb[0] = static_cast<std::uint8_t>(h >> 24);
+	    rgb[1] = static_cast<std::uint8_t>(h >> 16);
+	    rgb[2] = static_cast<std::uint8_t>(h >> 8);
+	    return;
+	}
+	case AOV::Samples:
+	    rgb[0] = rgb[1] = rgb[2] = static_cast<std::uint8_t>(std::min(values[0], 255.0f));
+	    return;
+    }
+    for (auto k = 0 ; k < 3 ; ++k) {
+	rgb[k] = static_cast<std::uint8_t>(std::min(std::max(c[k], 0.0f), 1.0f) * CONV);
+    }
+}
+
+/*
+ * Position of the extension of filepath, its size if it has none
+ */
+std::size_t extension_start(const std::string& filepath) {
+    const auto dot = filepath.rfind('.');
+    const auto slash = filepath.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+	return filepath.size();
+    }
+    return dot;
+}
+
+/*
+ * Extension of filepath in lower case, which selects the image format.
+ * Paths without one get PNG images
+ */
+std::string image_extension(const std::string& filepath) {
+    auto extension = filepath.substr(extension_start(filepath));
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (!extension.empty() && extension != ".png" && extension != ".ppm" &&
+	extension != ".pfm" && extension != ".exr") {
+	throw std::runtime_error{"Unknown image format " + extension + " of " + filepath};
+    }
+    return extension;
+}
+
+/*
+ * Image files written by a render. The format follows the extension of the
+ * path: PFM and EXR files get the linear (HDR) film, PPM and PNG (the
+ * default) files the tonemapped 8 bit image. Other extensions are refused. AOVs are layers of EXR images,
+ * and files of their own in the other formats, named after the image with
+ * the name of the AOV before the extension. Films are written whole, or as
+ * bands from the top of the image down
+ */
+class ImageOutput {
+ public:
+    ImageOutput(const std::string& filepath, const RenderOptions& options)
+	: depth_range_{options.depth_range} {
+	const auto dot = extension_start(filepath);
+	const auto extension = image_extension(filepath);
+	if (extension == ".exr") {
+	    std::vector<EXRChannel> channels;
+	    for (const auto aov : options.aovs) {
+		for (auto c = 0U ; c < aov_channels(aov) ; ++c) {
+		    // Halves would round ids and counts
+		    channels.push_back(EXRChannel{exr_channel(aov, c),
+						  aov == AOV::Material || aov == AOV::Samples});
+		}
+	    }
+	    files_.emplace_back();
+	    files_.back().hdr = std::make_unique<EXRRowWriter>(filepath, options.half_float,
+							       std::move(channels));
+	    files_.back().color = true;
+	    files_.back().aovs = options.aovs;
+	    return;
+	}
+
+	add_file(filepath, extension, options);
+	files_.back().color = true;
+	for (const auto aov : options.aovs) {
+	    add_file(filepath.substr(0, dot) + "." + aov_name(aov) + filepath.substr(dot),
+		     extension, options);
+	    files_.back().aovs.push_back(aov);
+	}
+    }
+
+    void begin(std::uint32_t width, std::uint32_t height) {
+	for (auto& file : files_) {
+	    if (file.hdr) {
+		file.hdr->begin(width, height);
+	    } else {
+		file.ldr->begin(width, height);
+	    }
+	}
+    }
+
+    /*
+     * Write the rows of film, with the AOVs of features, a film of the
+     * same pixels (the one film was denoised from for instance)
+     */
+    void write(const Film& film, const Film& features) {
+	for (auto& file : files_) {
+	    if (file.hdr) {
+		write_hdr(file, film, features);
+	    } else {
+		write_ldr(file, film, features);
+	    }
+	}
+    }
+
+    void write(const Film& film) {
+	write(film, film);
+    }
+
+    void end() {
+	for (auto& file : files_) {
+	    if (file.hdr) {
+		file.hdr->end();
+	    } else {
+		file.ldr->end();
+	    }
+	}
+    }
+
+    /*
+     * Write a whole film
+     */
+    void write_image(const Film& film, const Film& features) {
+	begin(film.width(), film.height());
+	write(film, features);
+	end();
+    }
+
+ private:
+    /*
+     * One file and what goes in it: the color of the film, followed by the
+     * values of its AOVs
+     */
+    struct File {
+	std::unique_ptr<RowWriter> ldr;
+	std::unique_ptr<HDRRowWriter> hdr;
+	bool color = false;
+	std::vector<AOV> aovs;
+    };
+
+    void add_file(const std::string& filepath, const std::string& extension,
+		  const RenderOptions& options) {
+	files_.emplace_back();
+	auto& file = files_.back();
+	if (extension == ".pfm") {
+	    file.hdr = std::make_unique<PFMRowWriter>(filepath);
+	} else if (extension == ".ppm") {
+	    file.ldr = std::make_unique<PPMRowWriter>(filepath);
+	} else {
+	    // .png, or no extension at all
+	    file.ldr = std::make_unique<PNGRowWriter>(filepath, options.png);
+	}
+    }
+
+    // Films are bottom up, the writers want the top row first
+    void write_ldr(File& file, const Film& film, const Film& features) {
+	const auto row_size = static_cast<std::size_t>(film.width()) * 3;
+	if (file.color) {
+	    const auto rgb = film.to_rgb8();
+	    for (auto row = film.height() ; row > 0 ; --row) {
+		file.ldr->write_rows(&rgb[(row - 1) * row_size], 1);
+	    }
+	    return;
+	}
+	// Files of the 8 bit formats hold a single AOV
+	const auto aov = file.aovs.front();
+	auto depth_range = depth_range_;
+	if (aov == AOV::Depth && depth_range <= 0) {
+	    depth_range = farthest_hit(features);
+	}
+	std::vector<std::uint8_t> rgb(row_size);
+	float values[3];
+	for (auto y = film.first_row() + film.height() ; y > film.first_row() ; --y) {
+	    for (auto x = 0U ; x < film.width() ; ++x) {
+		features.aov(aov, film.first_column() + x, y - 1, values);
+		aov_rgb8(aov, values, depth_range, &rgb[x * 3]);
+	    }
+	    file.ldr->write_rows(rgb.data(), 1);
+	}
+    }
+
+    void write_hdr(File& file, const Film& film, const Film& features) {
+	if (file.aovs.empty()) {
+	    const auto row_size = static_cast<std::size_t>(film.width()) * 3;
+	    const auto rgb = film.to_rgbf();
+	    for (auto row = film.height() ; row > 0 ; --row) {
+		file.hdr->write_rows(&rgb[(row - 1) * row_size], 1);
+	    }
+	    return;
+	}
+	auto stride = file.color ? 3U : 0U;
+	for (const auto aov : file.aovs) {
+	    stride += aov_channels(aov);
+	}
+	// PFM files of a single channel AOV repeat it in R, G and B
+	const auto gray = stride == 1;
+	std::vector<float> row(static_cast<std::size_t>(film.width()) * std::max(stride, 3U));
+	for (auto y = film.first_row() + film.height() ; y > film.first_row() ; --y) {
+	    auto* pixel = row.data();
+	    for (auto x = film.first_column() ; x < film.first_column() + film.width() ; ++x) {
+		if (file.color) {
+		    const auto c = film.color(x, y - 1);
+		    *pixel++ = c.x();
+		    *pixel++ = c.y();
+		    *pixel++ = c.z();
+		}
+		for (const auto aov : file.aovs) {
+		    features.aov(aov, x, y - 1, pixel);
+		    pixel += aov_channels(aov);
+		}
+		if (gray) {
+		    pixel[0] = pixel[1] = pixel[-1];
+		    pixel += 2;
+		}
+	    }
+	    file.hdr->write_rows(row.data(), 1);
+	}
+    }
+
+    static float farthest_hit(const Film& film) {
+	auto farthest = 0.0f;
+	for (auto y = film.first_row() ; y < film.first_row() + film.height() ; ++y) {
+	    for (auto x = film.first_column() ; x < film.first_column() + film.width() ; ++x) {
+		farthest = std::max(farthest, film.features(x, y).depth);
+	    }
+	}
+	return farthest;
+    }
+
+    float depth_range_;
+    std::vector<File> files_;
+};
+
+/*
+ * Write a whole film, denoised first if the options ask for it and the film
+ * has the features it needs. AOVs come from the film as it is
+ */
+void write_image(const Film& film, const std::string& filepath, const RenderOptions& options,
+		 const TileScheduler& scheduler) {
+    if (options.denoise && film.has_features()) {
+	ImageOutput{filepath, options}.write_image(denoise(film, scheduler, options.denoiser), film);
+    } else {
+	ImageOutput{filepath, options}.write_image(film, film);
+    }
+}
+
+/*
+ * Everything the sample loops need, shared by all the tiles of a frame
+ */
+struct Frame {
+    std::uint32_t width;
+    std::uint32_t height;
+    const Hitable& world;
+    const Camera& cam;
+    const RenderOptions& options;
+    // Adaptive sampling is only used by single pass renders
+    bool adaptive;
+    PathSettings path;
+    // Sample functions of the path engine
+    PathKernel kernel;
+    // Capture the features of the samples, for the denoiser and the AOVs
+    bool features;
+    // One tracer per worker with the wavefront engine, null otherwise
+    WavefrontTracer* wavefront;
+    // Nanoseconds spent on every pixel of the image when a heatmap is
+    // requested (and the library counts stats), null otherwise
+    float* cost;
+};
+
+/*
+ * Whether films must have a feature buffer: for AOVs other than the sample
+ * count, and for the denoiser, which does not filter band renders
+ */
+bool needs_features(const RenderOptions& options) {
+    const auto aovs = std::any_of(options.aovs.begin(), options.aovs.end(),
+				  [](AOV aov) { return aov != AOV::Samples; });
+    return aovs || (options.denoise && (options.band_rows == 0 || options.progressive));
+}
+
+/*
+ * Lights that the paths sample: those of the world with
+ * options.light_sampling, none otherwise
+ */
+Lights sampled_lights(const Hitable& world, const MaterialTable& materials,
+		      const RenderOptions& options) {
+    return options.light_sampling ? Lights{world, materials} : Lights{};
+}
+
+PathSettings path_settings(const RenderOptions& options, const MaterialTable& materials,
+			   const Lights& lights = Lights{}) {
+    PathSettings path;
+    path.materials = &materials;
+    path.max_depth = options.max_depth;
+    path.rr_depth = options.rr_depth;
+    path.background = options.background;
+    path.lights = lights.empty() ? nullptr : &lights;
+    return path;
+}
+
+/*
+ * Worker threads of a frame, and the state each of them needs for the engine
+ */
+struct Workers {
+    Workers(const Hitable& world, const Camera& cam, const PathSettings& path,
+	    const RenderOptions& options)
+	: scheduler{options.threads, options.backend} {
+	if (options.engine == Engine::Wavefront) {
+	    wavefront.reserve(scheduler.threads());
+	    for (auto w = 0U ; w < scheduler.threads() ; ++w) {
+		wavefront.emplace_back(world, cam, path, options.wavefront_size);
+	    }
+	}
+    }
+
+    TileScheduler scheduler;
+    std::vector<WavefrontTracer> wavefront;
+};
+
+Frame make_frame(std::uint32_t width, std::uint32_t height, const Hitable& world,
+		 const Camera& cam, const RenderOptions& options, const PathSettings& path,
+		 const PathKernel& kernel, Workers& workers, float* cost) {
+    return Frame{width, height, world, cam, options,
+		 options.adaptive && !options.progressive && workers.wavefront.empty(), path,
+		 kernel, needs_features(options),
+		 workers.wavefront.empty() ? nullptr : workers.wavefront.data(), cost};
+}
+
+/*
+ * Scheduling tiles of the pixels of region
+ */
+std::vector<Tile> region_tiles(const Tile& region, std::uint32_t tile_size) {
+    auto tiles = make_tiles(region.x1 - region.x0, region.y1 - region.y0, tile_size);
+    for (auto& tile : tiles) {
+	tile.x0 += region.x0;
+	tile.x1 += region.x0;
+	tile.y0 += region.y0;
+	tile.y1 += region.y0;
+    }
+    return tiles;
+}
+
+/*
+ * Whether the 95% confidence interval of the luminance of a pixel is wider
+ * than the threshold
+ */
+bool noisy(const Frame& frame, const PixelEstimate& e) {
+    if (e.samples < 2) {
+	return true;
+    }
+    const auto variance = e.m2 / (e.samples - 1);
+    return 1.96f * sqrtf(variance / e.samples) > frame.options.threshold;
+}
+
+/*
+ * Whether a pixel has enough samples. Without adaptive sampling that is
+ * spp of them. Otherwise spp is a cap, and the pixel stops before it once
+ * it has min_spp samples and is no longer noisy
+ */
+bool converged(const Frame& frame, const PixelEstimate& e, std::uint32_t spp) {
+    if (!frame.adaptive || e.samples >= spp) {
+	return e.samples >= spp;
+    }
+    if (e.samples < std::max(frame.options.min_spp, 2U)) {
+	return false;
+    }
+    return !noisy(frame, e);
+}
+
+/*
+ * Sample pixel (i, j) with jittered rays until it converges. Its samples are
+ * numbered from first_sample in the sequence of the sampler
+ */
+void trace_pixel(const Frame& frame, int i, std::uint32_t j, std::uint32_t spp,
+		 std::uint32_t first_sample, Sampler& sampler, PixelEstimate& estimate) {
+    while (!converged(frame, estimate, spp)) {
+	sampler.start_sample(first_sample + estimate.samples);
+	// For the anti-alias we generate random rays around the fixed
+	// grid. This also enables soft shadows
+	auto u = static_cast<float>(j + sampler.uniform()) / frame.width;
+	auto v = static_cast<float>(i + sampler.uniform()) / frame.height;
+
+	auto r = frame.cam.ray(u, v, sampler);
+	if (!frame.features) {
+	    estimate.add(frame.kernel.color(r, frame.world, frame.path, sampler));
+	    continue;
+	}
+	// Same as kernel.color, with the first hit at hand for the features
+	Hit rec;
+	RT_STAT(++stats::local().rays);
+	if (frame.world.hit(r, RAY_T_MIN, FLT_MAX, rec)) {
+	    estimate.add(frame.kernel.shade(r, rec, frame.world, frame.path, sampler, nullptr),
+			 hit_features(*frame.path.materials, r, rec));
+	} else {
+	    RT_STAT(stats::local().add_depth(0));
+	    estimate.add(rt::miss_color(r, frame.options.background), miss_features());
+	}
+    }
+}
+
+/*
+ * Light samples of the first bounce of the lanes of \p hit_mask that land
+ * on diffuse surfaces, with their shadow rays traced as one packet. Lanes
+ * whose sample was taken are set in the returned mask, and their light is in
+ * \p light. The samples come from the light dimensions of bounce 0, as
+ * shade_path() would take them
+ */
+std::uint32_t first_lights(const Frame& frame, const RayPacket& packet, std::uint32_t hit_mask,
+			   const HitPacket& hits, Sampler* sampler, Vector3f* light) {
+    const auto* lights = frame.path.lights;
+    if (lights == nullptr || frame.path.max_depth <= 0) {
+	return 0;
+    }
+    const auto& materials = *frame.path.materials;
+    std::uint32_t sampled = 0;
+    std::uint32_t shadow = 0;
+    LightSample samples[MAX_PACKET_SIZE];
+    RayPacket shadow_rays;
+    shadow_rays.size = packet.size;
+    float t_max[MAX_PACKET_SIZE];
+    for_each_lane(hit_mask, [&](std::uint32_t l) {
+	    const auto& rec = hits.hit[l];
+	    if (materials[rec.material].kind != MaterialKind::Lambertian) {
+		return;
+	    }
+	    sampled |= 1U << l;
+	    light[l] = Vector3f{0, 0, 0};
+	    sampler[l].start_bounce(0, Sampler::LIGHT_DIMENSION);
+	    if (sample_direct_light(rec, *lights, sampler[l], samples[l])) {
+		shadow_rays.set(l, shadow_ray(rec, samples[l]));
+		t_max[l] = shadow_t_max(samples[l]);
+		shadow |= 1U << l;
+	    }
+	});
+    if (shadow == 0) {
+	return sampled;
+    }
+
+    RT_STAT(stats::local().rays += __builtin_popcount(shadow));
+    const auto occluded = frame.world.occluded_packet(shadow_rays, shadow, RAY_T_MIN, t_max);
+    for_each_lane(shadow & ~occluded, [&](std::uint32_t l) {
+	    light[l] = unoccluded_light(materials[hits.hit[l].material], hits.hit[l], samples[l]);
+	});
+    return sampled;
+}
+
+/*
+ * Same as trace_pixel for the count pixels (x[l], y[l]), with the primary
+ * rays of every sample, and the shadow rays of their first bounce, traced as
+ * packets. Pixels that converge leave the packet. Each pixel consumes its
+ * random stream in the same order as trace_pixel, so the result is identical
+ */
+void trace_block(const Frame& frame, const std::uint32_t* x, const std::uint32_t* y,
+		 std::uint32_t count, std::uint32_t spp, std::uint32_t first_sample,
+		 Sampler* sampler, PixelEstimate* estimate) {
+    RayPacket packet;
+    packet.size = count;
+    HitPacket hits;
+    Vector3f light[MAX_PACKET_SIZE];
+    while (true) {
+	std::uint32_t active = 0;
+	for (auto l = 0U ; l < count ; ++l) {
+	    if (!converged(frame, estimate[l], spp)) {
+		active |= 1U << l;
+	    }
+	}
+	if (active == 0) {
+	    break;
+	}
 
-#ifdef USE_OMP
-#include <omp.h>
+	for_each_lane(active, [&](std::uint32_t l) {
+		sampler[l].start_sample(first_sample + estimate[l].samples);
+		auto u = static_cast<float>(x[l] + sampler[l].uniform()) / frame.width;
+		auto v = static_cast<float>(y[l] + sampler[l].uniform()) / frame.height;
+		packet.set(l, frame.cam.ray(u, v, sampler[l]));
+	    });
+
+	hits.reset(FLT_MAX);
+	RT_STAT(stats::local().rays += __builtin_popcount(active));
+	const auto hit_mask = frame.world.hit_packet(packet, active, RAY_T_MIN, hits);
+	const auto lit = first_lights(frame, packet, hit_mask, hits, sampler, light);
+	for_each_lane(active, [&](std::uint32_t l) {
+		const auto r = packet.ray(l);
+		if ((hit_mask >> l) & 1U) {
+		    const auto c = frame.kernel.shade(r, hits.hit[l], frame.world, frame.path,
+						      sampler[l], (lit >> l) & 1U ? &light[l] : nullptr);
+		    if (frame.features) {
+			estimate[l].add(c, hit_features(*frame.path.materials, r, hits.hit[l]));
+		    } else {
+			estimate[l].add(c);
+		    }
+		} else {
+		    RT_STAT(stats::local().add_depth(0));
+		    const auto c = rt::miss_color(r, frame.options.background);
+		    if (frame.features) {
+			estimate[l].add(c, miss_features());
+		    } else {
+			estimate[l].add(c);
+		    }
+		}
+	    });
+    }
+}
+
+#ifdef USE_STATS
+/*
+ * Spread the time since start over the count pixels (x[l], y[l])
+ */
+void add_cost(const Frame& frame, const std::uint32_t* x, const std::uint32_t* y,
+	      std::uint32_t count, std::chrono::steady_clock::time_point start) {
+    if (frame.cost == nullptr) {
+	return;
+    }
+    const auto ns = std::chrono::duration<float, std::nano>(
+	std::chrono::steady_clock::now() - start).count();
+    for (auto l = 0U ; l < count ; ++l) {
+	frame.cost[static_cast<std::size_t>(y[l]) * frame.width + x[l]] += ns / count;
+    }
+}
 #endif
 
-namespace rt {
+/*
+ * Take spp samples (or sample adaptively) for every pixel of a tile, and add
+ * them to the film. Pass p of pixel k uses random stream p * pixels + k, so
+ * every pixel and pass owns an independent stream and the image only depends
+ * on the seed. Low discrepancy samplers continue the sequence of the pixel
+ * instead, from sample p * pass_spp
+ *
+ * Adaptive sampling gives the tile a budget of spp samples per pixel (at
+ * least min_spp). A first sweep caps every pixel at that average, then the
+ * samples that the converged pixels left over raise the cap of the noisy
+ * ones, sweep after sweep, until the budget is spent, max_spp is reached or
+ * no pixel is noisy anymore
+ */
+void trace_tile(const Frame& frame, const Tile& tile, unsigned worker, std::uint32_t pass,
+		std::uint32_t spp, Film& film) {
+    if (frame.wavefront != nullptr) {
+	frame.wavefront[worker].trace(tile, frame.width, frame.height, spp,
+				      frame.options.seed, pass, film);
+	return;
+    }
+
+    // Pixels are traced in blocks as square as the packet allows (2x2 for 4
+    // lanes, 4x2 for 8, 4x4 for 16), one lane per pixel, so that the rays of
+    // a packet stay close together. The pixels of a block are contiguous in
+    // the arrays below, which keep their state between adaptive sweeps
+    const auto lanes = std::max(1U, std::min(frame.options.packet_size, MAX_PACKET_SIZE));
+    const auto block_width = lanes >= 8 ? 4U : lanes >= 4 ? 2U : 1U;
+    const auto block_height = lanes / block_width;
+    const auto stream_base = static_cast<std::uint64_t>(pass) * frame.width * frame.height;
+    const auto first_sample = pass * std::max(frame.options.pass_spp, 1U);
+
+    const auto pixels = static_cast<std::size_t>(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    std::vector<std::uint32_t> x, y;
+    std::vector<std::size_t> blocks;
+    x.reserve(pixels);
+    y.reserve(pixels);
+    for (auto y0 = tile.y0 ; y0 < tile.y1 ; y0 += block_height) {
+	for (auto x0 = tile.x0 ; x0 < tile.x1 ; x0 += block_width) {
+	    blocks.push_back(x.size());
+	    for (auto i = y0 ; i < std::min(y0 + block_height, tile.y1) ; ++i) {
+		for (auto j = x0 ; j < std::min(x0 + block_width, tile.x1) ; ++j) {
+		    x.push_back(j);
+		    y.push_back(i);
+		}
+	    }
+	}
+    }
+    blocks.push_back(x.size());
+
+    std::vector<Sampler> sampler(pixels);
+    std::vector<PixelEstimate> estimate(pixels);
+    for (std::size_t k = 0 ; k < pixels ; ++k) {
+	const auto rng = Random::for_stream(frame.options.seed, stream_base +
+					    static_cast<std::uint64_t>(y[k]) * frame.width + x[k]);
+	sampler[k] = Sampler{frame.options.sampler, frame.options.seed, x[k], y[k], rng};
+    }
+
+    const auto sweep = [&](std::uint32_t cap) {
+	for (std::size_t b = 0 ; b + 1 < blocks.size() ; ++b) {
+	    const auto first = blocks[b];
+	    const auto count = static_cast<std::uint32_t>(blocks[b + 1] - first);
+	    RT_STAT(const auto start = std::chrono::steady_clock::now());
+	    if (lanes == 1) {
+		trace_pixel(frame, static_cast<int>(y[first]), x[first], cap, first_sample,
+			    sampler[first], estimate[first]);
+	    } else {
+		trace_block(frame, &x[first], &y[first], count, cap, first_sample,
+			    &sampler[first], &estimate[first]);
+	    }
+	    RT_STAT(add_cost(frame, &x[first], &y[first], count, start));
+	}
+    };
+
+    if (!frame.adaptive) {
+	sweep(spp);
+    } else {
+	const auto max_spp = frame.options.max_spp;
+	const auto average = std::max(spp, frame.options.min_spp);
+	const auto budget = static_cast<std::uint64_t>(average) * pixels;
+	auto cap = std::min(average, max_spp);
+	sweep(cap);
+	while (cap < max_spp) {
+	    std::uint64_t used = 0;
+	    std::uint64_t capped = 0;
+	    for (const auto& e : estimate) {
+		used += e.samples;
+		capped += e.samples >= cap && noisy(frame, e);
+	    }
+	    if (capped == 0 || used >= budget || (budget - used) / capped == 0) {
+		break;
+	    }
+	    cap = static_cast<std::uint32_t>(
+		std::min<std::uint64_t>(max_spp, cap + (budget - used) / capped));
+	    sweep(cap);
+	}
+    }
+
+    for (std::size_t k = 0 ; k < pixels ; ++k) {
+	film.add(x[k], y[k], estimate[k].sum, estimate[k].samples);
+	film.add_features(x[k], y[k], estimate[k].features);
+    }
+}
 
-void PPMWriter::write(const std::vector<uint8_t>& buffer, std::size_t width, std::size_t height) const {
-    std::ofstream os{filepath_};
-    os << "P3" << std::endl << width << " " << height << std::endl <<  "255" << std::endl;
-    
-    for (std::int32_t i = height - 1 ; i >= 0 ; --i) {
-	for (auto j = 0U; j < width; ++j) {
-	    os << +buffer[i * width * 3 + j * 3] << " "
-	       << +buffer[i * width * 3 + j * 3 + 1] << " "
-	       << +buffer[i * width * 3 + j * 3 + 2] << " ";
-	}
-	os << std::endl;
-    }    
-}
-
-void PNGWriter::write(const std::vector<uint8_t>& buffer, std::size_t width, std::size_t height) const {
-    // Initialize write machinery, this includes a pointer to the png write context
-    // and a pointer to the image information
-    png_structp png_ptr = nullptr;
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-
-    png_infop png_info_ptr = nullptr;
-    png_info_ptr = png_create_info_struct(png_ptr);
-
-
-    // Open a file for binary writing
-    FILE* fp = nullptr;
-    fp = fopen(filepath_.c_str(), "wb");
-
-    // Initialize IO
-    png_init_io(png_ptr, fp);
-
-    // Populate info data structure
-    // Write header (8 bit colour depth)
-    png_set_IHDR(png_ptr, png_info_ptr, width, height,
-		 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-		 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    // Actually write the header
-    png_write_info(png_ptr, png_info_ptr);
-
-    // Allocate memory for 3 bytes per pixel. We write the output one
-    // row at a time
-    auto row = std::make_unique<png_byte[]>(3 * width);
-    for (int i = height - 1 ; i >= 0 ; --i) {
-	for (auto j = 0U ; j < width ; ++j) {
-	    row[j * 3 + 0] = +buffer[i * width * 3 + j * 3];
-	    row[j * 3 + 1] = +buffer[i * width * 3 + j * 3 + 1];
-	    row[j * 3 + 2] = +buffer[i * width * 3 + j * 3 + 2];
-	}
-	png_write_row(png_ptr, row.get());
-    }
-
-    // Write the footer (if necessary) and flush
-    png_write_end(png_ptr, png_info_ptr);
-    png_write_flush(png_ptr);
-
-    // Cleanup
-    // See: http://www.ludism.org/~rwhe/LSB/png/libpng-png-free-data-1.html
-    png_free_data(png_ptr, png_info_ptr, PNG_FREE_ALL, -1);
-    // See: http://refspecs.linuxbase.org/LSB_3.1.0/LSB-Desktop-generic/LSB-Desktop-generic/libpng12.png.destroy.write.struct.1.html
-    png_destroy_write_struct(&png_ptr, &png_info_ptr);
-}    
-    
-void render(std::uint16_t width,
-	    std::uint16_t height,
+/*
+ * trace_tile, timed when the library counts stats. The wavefront engine
+ * traces the pixels of a tile together, so they share its time evenly
+ */
+void render_tile(const Frame& frame, const Tile& tile, unsigned worker, std::uint32_t pass,
+		 std::uint32_t spp, Film& film) {
+    RT_STAT(const auto start = std::chrono::steady_clock::now());
+    trace_tile(frame, tile, worker, pass, spp, film);
+#ifdef USE_STATS
+    const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    stats::local().tiles.push_back(stats::TileTime{tile, worker, seconds.count()});
+    if (frame.wavefront != nullptr && frame.cost != nullptr) {
+	const auto pixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+	const auto ns = static_cast<float>(seconds.count() * 1e9 / pixels);
+	for (auto i = tile.y0 ; i < tile.y1 ; ++i) {
+	    for (auto j = tile.x0 ; j < tile.x1 ; ++j) {
+		frame.cost[static_cast<std::size_t>(i) * frame.width + j] += ns;
+	    }
+	}
+    }
+#endif
+}
+
+/*
+ * Render the frame in passes of options.pass_spp samples until every pixel
+ * has anti_alias of them, checkpointing the film and writing a preview image
+ * every options.checkpoint_interval seconds
+ */
+void render_progressive(const Frame& frame, std::uint16_t anti_alias,
+			const std::string& filepath, const std::vector<Tile>& tiles,
+			const TileScheduler& scheduler, Film& film) {
+    const auto& options = frame.options;
+    const auto pass_spp = std::max(options.pass_spp, 1U);
+    std::uint32_t passes = 0;
+    if (options.resume && !options.checkpoint.empty()) {
+	std::uint64_t seed = 0;
+	std::uint32_t saved_pass_spp = 0;
+	if (film.load(options.checkpoint, seed, passes, saved_pass_spp)) {
+	    if (seed != options.seed) {
+		throw std::runtime_error{options.checkpoint + " was rendered with a different seed"};
+	    }
+	    // Samples of pass p are numbered from p * pass_spp: other passes
+	    // would take samples of the sequence that are already in the film
+	    if (saved_pass_spp != 0 && saved_pass_spp != pass_spp) {
+		throw std::runtime_error{options.checkpoint + " was rendered with " +
+					 std::to_string(saved_pass_spp) + " samples per pass"};
+	    }
+	}
+    }
+
+    // Every pixel takes the same number of samples in a progressive render
+    auto samples = film.samples(0, 0);
+    const auto interval = std::chrono::duration<float>{options.checkpoint_interval};
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    while (samples < anti_alias) {
+	const auto spp = std::min<std::uint32_t>(pass_spp, anti_alias - samples);
+	scheduler.run(tiles, [&](const Tile& tile, unsigned worker) {
+		render_tile(frame, tile, worker, passes, spp, film);
+	    });
+	++passes;
+	samples += spp;
+
+	const auto now = std::chrono::steady_clock::now();
+	if (!options.checkpoint.empty() &&
+	    (samples >= anti_alias || now - last_checkpoint >= interval)) {
+	    film.save(options.checkpoint, options.seed, passes, pass_spp);
+	    write_image(film, filepath, options, scheduler);
+	    last_checkpoint = now;
+	}
+    }
+}
+
+/*
+ * Render the frame in bands of options.band_rows rows, from the top of the
+ * image down, handing every band to the writer as soon as it is done. Only
+ * the film and the pixels of one band are ever allocated
+ */
+void render_bands(const Frame& frame, std::uint16_t anti_alias, const std::string& filepath,
+		  const TileScheduler& scheduler) {
+    const auto width = frame.width;
+    const auto band = frame.options.band_rows;
+    ImageOutput output{filepath, frame.options};
+    output.begin(width, frame.height);
+    for (auto top = frame.height ; top > 0 ; ) {
+	const auto first = top > band ? top - band : 0;
+	Film film{width, top - first, first};
+	if (frame.features) {
+	    film.enable_features();
+	}
+	const auto tiles = region_tiles(Tile{0, first, width, top}, frame.options.tile_size);
+	scheduler.run(tiles, [&](const Tile& tile, unsigned worker) {
+		render_tile(frame, tile, worker, 0, anti_alias, film);
+	    });
+
+	output.write(film);
+	top = first;
+    }
+    output.end();
+}
+
+/*
+ * Tiles of the jobs of a batch, handed out in order, and the films of the
+ * jobs between their first tile and their image being written
+ */
+class Batch {
+ public:
+    Batch(const std::vector<RenderJob>& jobs, const RenderOptions& options,
+	  std::size_t max_frames)
+	: jobs_{jobs}, options_{options}, max_frames_{std::max<std::size_t>(max_frames, 1)},
+	  first_item_{0}, films_(jobs.size()),
+	  remaining_{std::make_unique<std::atomic<std::size_t>[]>(jobs.size())} {
+	tiles_.reserve(jobs.size());
+	for (std::size_t j = 0 ; j < jobs.size() ; ++j) {
+	    if (jobs[j].width == 0 || jobs[j].height == 0) {
+		throw std::runtime_error{jobs[j].filepath + " has no pixels"};
+	    }
+	    image_extension(jobs[j].filepath);
+	    tiles_.push_back(make_tiles(jobs[j].width, jobs[j].height, options.tile_size));
+	    first_item_.push_back(first_item_.back() + tiles_.back().size());
+	    remaining_[j] = tiles_.back().size();
+	}
+    }
+
+    /*
+     * Render tiles until there are none left
+     */
+    void work(const Hitable& world, const PathSettings& path, const PathKernel& kernel,
+	      Workers& workers, unsigned worker) {
+	auto job = jobs_.size();
+	while (true) {
+	    const auto item = next_++;
+	    if (item >= first_item_.back()) {
+		return;
+	    }
+	    const auto j = static_cast<std::size_t>(
+		std::upper_bound(first_item_.begin(), first_item_.end(), item) -
+		first_item_.begin() - 1);
+	    if (j != job) {
+		job = j;
+		start(j);
+	    }
+
+	    const auto& spec = jobs_[j];
+	    if (!workers.wavefront.empty()) {
+		workers.wavefront[worker].set_camera(spec.cam);
+	    }
+	    const auto frame = make_frame(spec.width, spec.height, world, spec.cam, options_,
+					  path, kernel, workers, nullptr);
+	    render_tile(frame, tiles_[j][item - first_item_[j]], worker, 0, spec.anti_alias,
+			*films_[j]);
+	    if (--remaining_[j] == 0) {
+		std::lock_guard<std::mutex> lock{mutex_};
+		finished_.push_back(j);
+		changed_.notify_all();
+	    }
+	}
+    }
+
+    /*
+     * Write the films as they are finished, until every job is written. The
+     * first error is thrown once they all have been tried
+     */
+    void write() {
+	std::exception_ptr error;
+	std::unique_lock<std::mutex> lock{mutex_};
+	while (written_ < jobs_.size()) {
+	    changed_.wait(lock, [this] { return !finished_.empty(); });
+	    const auto j = finished_.front();
+	    finished_.pop_front();
+	    lock.unlock();
+
+	    try {
+		// The workers keep the other cores busy
+		write_image(*films_[j], jobs_[j].filepath, options_, TileScheduler{1});
+	    } catch (...) {
+		if (!error) {
+		    error = std::current_exception();
+		}
+	    }
+
+	    lock.lock();
+	    films_[j].reset();
+	    ++written_;
+	    changed_.notify_all();
+	}
+	if (error) {
+	    std::rethrow_exception(error);
+	}
+    }
+
+ private:
+    /*
+     * Wait until job j fits in max_frames_ with the ones not written yet,
+     * and give it a film. Jobs start in order, so the jobs before it that
+     * keep it waiting already have all their tiles taken
+     */
+    void start(std::size_t j) {
+	std::unique_lock<std::mutex> lock{mutex_};
+	changed_.wait(lock, [&] { return written_ + max_frames_ > j; });
+	if (!films_[j]) {
+	    films_[j] = std::make_unique<Film>(jobs_[j].width, jobs_[j].height);
+	    if (needs_features(options_)) {
+		films_[j]->enable_features();
+	    }
+	}
+    }
+
+    const std::vector<RenderJob>& jobs_;
+    const RenderOptions& options_;
+    const std::size_t max_frames_;
+    std::vector<std::vector<Tile>> tiles_;
+    // Index of the first tile of every job in the batch, and the total
+    std::vector<std::size_t> first_item_;
+    std::atomic<std::size_t> next_{0};
+
+    std::vector<std::unique_ptr<Film>> films_;
+    // Tiles of every job not rendered yet
+    std::unique_ptr<std::atomic<std::size_t>[]> remaining_;
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<std::size_t> finished_;
+    std::size_t written_ = 0;
+};
+
+} // Unnamed namespace
+
+void render(std::uint32_t width,
+	    std::uint32_t height,
             const Hitable& world,
+	    const MaterialTable& materials,
             const Camera& cam,
             std::uint16_t anti_alias,
             const std::string& filepath,
 	    bool background) {
-    // Conversion factor to go from float to unsigned char for RGB components
-    const auto CONV = 255.99f;
+    RenderOptions options;
+    options.background = background;
+    render(width, height, world, materials, cam, anti_alias, filepath, options);
+}
 
-    auto dis = std::uniform_real_distribution<>{0.0, 1.0};
-    std::random_device device;
+void render(std::uint32_t width,
+	    std::uint32_t height,
+            const Hitable& world,
+	    const MaterialTable& materials,
+            const Camera& cam,
+            std::uint16_t anti_alias,
+            const std::string& filepath,
+	    const RenderOptions& options) {
+    render(width, height, world, materials, cam, anti_alias, filepath, options,
+	   path_kernel(world, path_settings(options, materials)));
+}
 
-    // Image buffer. Preallocate the entire image to facilitate
-    // parallelism
-    std::vector<uint8_t> img(width * height * 3);
-    for (auto i = height - 1 ; i >= 0 ; --i) {
-        #pragma omp parallel for
-	for (auto j = 0U; j < width; ++j) {
-	    rt::Vector3f color{0, 0, 0};
-	    for (auto a = 0U ; a < anti_alias ; ++a) {
-		// For the anti-alias we generate random rays around the fixed
-		// grid. This also enables soft shadows
-		auto u = static_cast<float>(j + dis(device)) / width;
-		auto v = static_cast<float>(i + dis(device)) / height;
+void render(std::uint32_t width,
+	    std::uint32_t height,
+	    const Hitable& world,
+	    const MaterialTable& materials,
+	    const Camera& cam,
+	    std::uint16_t anti_alias,
+	    const std::string& filepath,
+	    const RenderOptions& options,
+	    const PathKernel& kernel) {
+    // Before hours of rendering for nothing
+    image_extension(filepath);
+    RT_STAT(stats::reset());
+    RT_STAT(const auto start = std::chrono::steady_clock::now());
+    std::vector<float> cost;
+    if (stats_enabled() && !options.heatmap.empty()) {
+	cost.assign(static_cast<std::size_t>(width) * height, 0.0f);
+    }
 
-		auto r = cam.ray(u,v);
-		color += rt::ray_color(r, world, 0, background);
-	    }
-	    color /= static_cast<float>(anti_alias);
-	    color.sqrt();
+    const auto lights = sampled_lights(world, materials, options);
+    const auto path = path_settings(options, materials, lights);
+    Workers workers{world, cam, path, options};
+    const auto& scheduler = workers.scheduler;
+    const auto frame = make_frame(width, height, world, cam, options, path, kernel, workers,
+				  cost.empty() ? nullptr : cost.data());
 
-	    const std::size_t base_idx = i * width * 3 + j * 3;
-	    img[base_idx] = static_cast<uint8_t>(color.x() * CONV);
-	    img[base_idx + 1] = static_cast<uint8_t>(color.y() * CONV);
-	    img[base_idx + 2] = static_cast<uint8_t>(color.z() * CONV);
+    if (options.band_rows > 0 && !options.progressive) {
+	render_bands(frame, anti_alias, filepath, scheduler);
+    } else {
+	// Accumulation buffer. Preallocate the entire image to facilitate
+	// parallelism
+	Film film{width, height};
+	if (frame.features) {
+	    film.enable_features();
 	}
+	const auto tiles = make_tiles(width, height, options.tile_size);
+	if (options.progressive) {
+	    render_progressive(frame, anti_alias, filepath, tiles, scheduler, film);
+	} else {
+	    scheduler.run(tiles, [&](const Tile& tile, unsigned worker) {
+		    render_tile(frame, tile, worker, 0, anti_alias, film);
+		});
+	}
+
+	write_image(film, filepath, options, scheduler);
+    }
+
+#ifdef USE_STATS
+    const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    if (!options.stats.empty()) {
+	stats::write_report(options.stats, stats::collect(), seconds.count());
+    }
+    if (!cost.empty()) {
+	stats::write_heatmap(options.heatmap, cost, width, height);
     }
+#endif
+}
 
-    PNGWriter{filepath}.write(img, width, height);
+void write_film(const Film& film, const std::string& filepath, const RenderOptions& options) {
+    write_image(film, filepath, options, TileScheduler{options.threads, options.backend});
+}
+
+void render_region(std::uint32_t width,
+		   std::uint32_t height,
+		   const Hitable& world,
+		   const MaterialTable& materials,
+		   const Camera& cam,
+		   const Tile& region,
+		   std::uint32_t pass,
+		   std::uint32_t spp,
+		   const RenderOptions& options,
+		   Film& film) {
+    const auto lights = sampled_lights(world, materials, options);
+    const auto path = path_settings(options, materials, lights);
+    Workers workers{world, cam, path, options};
+    auto frame = make_frame(width, height, world, cam, options, path,
+			    path_kernel(world, path), workers, nullptr);
+    frame.features = film.has_features();
+    workers.scheduler.run(region_tiles(region, options.tile_size),
+			  [&](const Tile& tile, unsigned worker) {
+			      render_tile(frame, tile, worker, pass, spp, film);
+			  });
+}
+
+void render_batch(const Hitable& world,
+		  const MaterialTable& materials,
+		  const std::vector<RenderJob>& jobs,
+		  const RenderOptions& options,
+		  std::size_t max_frames) {
+    if (jobs.empty()) {
+	return;
+    }
+    auto single_pass = options;
+    single_pass.progressive = false;
+    single_pass.band_rows = 0;
+
+    Batch batch{jobs, single_pass, max_frames};
+    const auto lights = sampled_lights(world, materials, single_pass);
+    const auto path = path_settings(single_pass, materials, lights);
+    Workers workers{world, jobs.front().cam, path, single_pass};
+
+    std::exception_ptr error;
+    std::thread writer{[&] {
+	    try {
+		batch.write();
+	    } catch (...) {
+		error = std::current_exception();
+	    }
+	}};
+    const auto kernel = path_kernel(world, path);
+    workers.scheduler.parallel([&](unsigned worker) {
+	    batch.work(world, path, kernel, workers, worker);
+	});
+    writer.join();
+    if (error) {
+	std::rethrow_exception(error);
+    }
 }
 } // namespace rt
@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <sampler.hpp>
+
+namespace rt {
+
+constexpr std::uint32_t Sampler::FIRST_BOUNCE_DIMENSION;
+constexpr std::uint32_t Sampler::BOUNCE_DIMENSIONS;
+constexpr std::uint32_t Sampler::ROULETTE_DIMENSION;
+constexpr std::uint32_t Sampler::LIGHT_DIMENSION;
+
+namespace {
+
+// Largest float below 1
+constexpr float ONE_MINUS_EPSILON = 1.0f - std::numeric_limits<float>::epsilon() / 2;
+
+/*
+ * 32 bit integer hash (lowbias32), used to derive scrambles and offsets
+ */
+std::uint32_t hash(std::uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+std::uint32_t hash_combine(std::uint32_t seed, std::uint32_t v) {
+  return hash(seed ^ (v + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+}
+
+std::uint32_t reverse_bits(std::uint32_t x) {
+  x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+  x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+  x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+/*
+ * Owen scrambling of the bits of x, from the most significant one down: each
+ * bit is flipped or not depending on the bits above it. The hash only
+ * propagates from low bits to high ones, so it runs on the reversed value
+ * (Laine and Karras, with the constants of Burley, "Practical Hash-based
+ * Owen Scrambling", 2020)
+ */
+std::uint32_t nested_uniform_scramble(std::uint32_t x, std::uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cU;
+  x ^= x * 0xb82f1e52U;
+  x ^= x * 0xc7afe638U;
+  x ^= x * 0x8d22f6e6U;
+  return reverse_bits(x);
+}
+
+/*
+ * Generator matrices of the first 4 dimensions of the Sobol sequence, from
+ * the primitive polynomials and initial direction numbers of Joe and Kuo
+ */
+constexpr std::uint32_t SOBOL_DIMENSIONS = 4;
+constexpr std::uint32_t SOBOL_BITS = 32;
+using SobolMatrices = std::array<std::array<std::uint32_t, SOBOL_BITS>, SOBOL_DIMENSIONS>;
+// Points of the sequence for every value of every byte of the index, so
+// that a point takes 4 lookups instead of one step per bit
+using SobolTables = std::array<std::array<std::array<std::uint32_t, 256>, 4>, SOBOL_DIMENSIONS>;
+
+SobolMatrices make_sobol_matrices() {
+  struct Polynomial {
+    std::uint32_t degree;
+    std::uint32_t coefficients;
+    std::uint32_t m[3];
+  };
+  const Polynomial polynomials[SOBOL_DIMENSIONS - 1] = {
+    {1, 0, {1, 0, 0}},
+    {2, 1, {1, 3, 0}},
+    {3, 1, {1, 3, 1}}
+  };
+
+  SobolMatrices matrices{};
+  // The first dimension is the van der Corput sequence
+  for (auto bit = 0U ; bit < SOBOL_BITS ; ++bit) {
+    matrices[0][bit] = 1U << (SOBOL_BITS - 1 - bit);
+  }
+  for (auto d = 1U ; d < SOBOL_DIMENSIONS ; ++d) {
+    const auto& p = polynomials[d - 1];
+    std::uint32_t m[SOBOL_BITS];
+    for (auto i = 0U ; i < SOBOL_BITS ; ++i) {
+      if (i < p.degree) {
+        m[i] = p.m[i];
+        continue;
+      }
+      m[i] = m[i - p.degree] ^ (m[i - p.degree] << p.degree);
+      for (auto k = 1U ; k < p.degree ; ++k) {
+        if ((p.coefficients >> (p.degree - 1 - k)) & 1U) {
+          m[i] ^= m[i - k] << k;
+        }
+      }
+    }
+    for (auto bit = 0U ; bit < SOBOL_BITS ; ++bit) {
+      matrices[d][bit] = m[bit] << (SOBOL_BITS - 1 - bit);
+    }
+  }
+  return matrices;
+}
+
+SobolTables make_sobol_tables() {
+  const auto matrices = make_sobol_matrices();
+  SobolTables tables{};
+  for (auto d = 0U ; d < SOBOL_DIMENSIONS ; ++d) {
+    for (auto byte = 0U ; byte < 4 ; ++byte) {
+      for (auto value = 0U ; value < 256 ; ++value) {
+        std::uint32_t x = 0;
+        for (auto bit = 0U ; bit < 8 ; ++bit) {
+          if ((value >> bit) & 1U) {
+            x ^= matrices[d][byte * 8 + bit];
+          }
+        }
+        tables[d][byte][value] = x;
+      }
+    }
+  }
+  return tables;
+}
+
+std::uint32_t sobol(std::uint32_t index, std::uint32_t dimension) {
+  static const auto tables = make_sobol_tables();
+  const auto& table = tables[dimension];
+  return table[0][index & 0xff] ^ table[1][(index >> 8) & 0xff] ^
+      table[2][(index >> 16) & 0xff] ^ table[3][index >> 24];
+}
+
+/*
+ * Dimension \p dimension of point \p index of an Owen scrambled Sobol
+ * sequence. Dimensions come in groups of 4, each with its own scramble and
+ * its own shuffle of the points, which keeps the groups independent
+ */
+std::uint32_t sobol_owen(std::uint32_t index, std::uint32_t dimension, std::uint32_t scramble) {
+  const auto group = hash_combine(scramble, dimension / SOBOL_DIMENSIONS);
+  const auto component = dimension % SOBOL_DIMENSIONS;
+  const auto shuffled = nested_uniform_scramble(index, group);
+  return nested_uniform_scramble(sobol(shuffled, component), hash_combine(group, component + 1));
+}
+
+float to_float(std::uint32_t x) {
+  return static_cast<float>(x >> 8) * (1.0f / 16777216.0f);
+}
+
+/*
+ * Radical inverse of index in base Base, with Owen scrambled digits: each
+ * digit goes through a permutation picked by the digits before it. Without
+ * this the first samples of the dimensions of large bases bunch up. Bases are
+ * prime, so d -> (a * d + b) mod Base is a permutation for any a in
+ * [1, Base).
+ *
+ * Digits are scrambled one by one down to 2^-16, which keeps the strata of
+ * the first 65536 samples, and the ones below are drawn at once from a hash
+ * of those above. Base is a template parameter so that the divisions by it
+ * compile to multiplications
+ */
+template<std::uint32_t Base>
+double scrambled_radical_inverse(std::uint32_t index, std::uint32_t seed) {
+  std::uint32_t reversed = 0;
+  auto scale = 1.0;
+  auto digits = 0U;
+  for ( ; scale > 1.0 / 65536 ; ++digits, index /= Base) {
+    const auto h = hash_combine(seed + digits, reversed);
+    const auto a = 1 + (h & 0xffff) % (Base - 1);
+    const auto b = (h >> 16) % Base;
+    reversed = reversed * Base + (a * (index % Base) + b) % Base;
+    scale *= 1.0 / Base;
+  }
+  const auto tail = to_float(hash_combine(seed + digits, reversed));
+  return (static_cast<double>(reversed) + tail) * scale;
+}
+
+// Base 2 scrambles all the bits at once
+template<>
+double scrambled_radical_inverse<2>(std::uint32_t index, std::uint32_t seed) {
+  return to_float(nested_uniform_scramble(reverse_bits(index), seed));
+}
+
+using RadicalInverse = double (*)(std::uint32_t index, std::uint32_t seed);
+
+const RadicalInverse HALTON[HALTON_DIMENSIONS] = {
+  scrambled_radical_inverse<2>, scrambled_radical_inverse<3>,
+  scrambled_radical_inverse<5>, scrambled_radical_inverse<7>,
+  scrambled_radical_inverse<11>, scrambled_radical_inverse<13>,
+  scrambled_radical_inverse<17>, scrambled_radical_inverse<19>,
+  scrambled_radical_inverse<23>, scrambled_radical_inverse<29>,
+  scrambled_radical_inverse<31>, scrambled_radical_inverse<37>,
+  scrambled_radical_inverse<41>, scrambled_radical_inverse<43>,
+  scrambled_radical_inverse<47>, scrambled_radical_inverse<53>,
+  scrambled_radical_inverse<59>, scrambled_radical_inverse<61>,
+  scrambled_radical_inverse<67>, scrambled_radical_inverse<71>,
+  scrambled_radical_inverse<73>, scrambled_radical_inverse<79>,
+  scrambled_radical_inverse<83>, scrambled_radical_inverse<89>,
+  scrambled_radical_inverse<97>, scrambled_radical_inverse<101>,
+  scrambled_radical_inverse<103>, scrambled_radical_inverse<107>,
+  scrambled_radical_inverse<109>, scrambled_radical_inverse<113>,
+  scrambled_radical_inverse<127>, scrambled_radical_inverse<131>
+};
+
+/*
+ * Blue noise mask of BLUE_NOISE_SIZE x BLUE_NOISE_SIZE ranks, made with the
+ * void and cluster method (Ulichney, 1993). The ranks are spread so that
+ * pixels of close ranks are far apart, and any threshold of the mask is a
+ * blue noise pattern. The mask tiles the plane
+ */
+constexpr std::uint32_t BLUE_NOISE_BITS = 6;
+constexpr std::uint32_t BLUE_NOISE_SIZE = 1U << BLUE_NOISE_BITS;
+constexpr std::uint32_t BLUE_NOISE_CELLS = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+
+class VoidAndCluster {
+ public:
+  VoidAndCluster() : kernel_(BLUE_NOISE_CELLS) {
+    const auto sigma = 1.5f;
+    for (auto y = 0U ; y < BLUE_NOISE_SIZE ; ++y) {
+      for (auto x = 0U ; x < BLUE_NOISE_SIZE ; ++x) {
+        // Toroidal distance, so that the mask tiles
+        const auto dx = static_cast<float>(std::min(x, BLUE_NOISE_SIZE - x));
+        const auto dy = static_cast<float>(std::min(y, BLUE_NOISE_SIZE - y));
+        kernel_[y * BLUE_NOISE_SIZE + x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+      }
+    }
+  }
+
+  std::vector<std::uint32_t> ranks() const {
+    // Initial pattern: a tenth of the cells at random, then moved from its
+    // tightest clusters to its largest voids until it is even
+    std::vector<bool> initial(BLUE_NOISE_CELLS, false);
+    std::vector<float> energy(BLUE_NOISE_CELLS, 0);
+    Random rng{0x626c7565U};
+    auto ones = 0U;
+    while (ones < BLUE_NOISE_CELLS / 10) {
+      const auto cell = rng() % BLUE_NOISE_CELLS;
+      if (!initial[cell]) {
+        initial[cell] = true;
+        splat(energy, cell, 1);
+        ++ones;
+      }
+    }
+    for (auto swaps = 0U ; swaps < BLUE_NOISE_CELLS ; ++swaps) {
+      const auto cluster = find(initial, energy, true);
+      initial[cluster] = false;
+      splat(energy, cluster, -1);
+      const auto hole = find(initial, energy, false);
+      initial[hole] = true;
+      splat(energy, hole, 1);
+      if (hole == cluster) {
+        break;
+      }
+    }
+
+    std::vector<std::uint32_t> ranks(BLUE_NOISE_CELLS);
+    // Ranks below the initial pattern: remove its tightest clusters first
+    auto pattern = initial;
+    auto pattern_energy = energy;
+    for (auto rank = ones ; rank-- > 0 ; ) {
+      const auto cluster = find(pattern, pattern_energy, true);
+      pattern[cluster] = false;
+      splat(pattern_energy, cluster, -1);
+      ranks[cluster] = rank;
+    }
+    // Ranks above it: fill its largest voids first
+    for (auto rank = ones ; rank < BLUE_NOISE_CELLS ; ++rank) {
+      const auto hole = find(initial, energy, false);
+      initial[hole] = true;
+      splat(energy, hole, 1);
+      ranks[hole] = rank;
+    }
+    return ranks;
+  }
+
+ private:
+  void splat(std::vector<float>& energy, std::uint32_t cell, float sign) const {
+    const auto cx = cell % BLUE_NOISE_SIZE;
+    const auto cy = cell / BLUE_NOISE_SIZE;
+    for (auto y = 0U ; y < BLUE_NOISE_SIZE ; ++y) {
+      const auto row = ((y - cy) & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE;
+      for (auto x = 0U ; x < BLUE_NOISE_SIZE ; ++x) {
+        energy[y * BLUE_NOISE_SIZE + x] += sign * kernel_[row + ((x - cx) & (BLUE_NOISE_SIZE - 1))];
+      }
+    }
+  }
+
+  // Set cell of highest energy (tightest cluster), or unset cell of lowest
+  // energy (largest void)
+  static std::uint32_t find(const std::vector<bool>& pattern, const std::vector<float>& energy,
+                            bool set) {
+    auto best = 0U;
+    auto best_energy = set ? -std::numeric_limits<float>::max() : std::numeric_limits<float>::max();
+    for (auto cell = 0U ; cell < BLUE_NOISE_CELLS ; ++cell) {
+      if (pattern[cell] != set) {
+        continue;
+      }
+      if (set ? energy[cell] > best_energy : energy[cell] < best_energy) {
+        best = cell;
+        best_energy = energy[cell];
+      }
+    }
+    return best;
+  }
+
+  std::vector<float> kernel_;
+};
+
+/*
+ * Offset of a pixel's sequence, a 32 bit fraction from the blue noise mask
+ */
+std::uint32_t blue_noise(std::uint32_t x, std::uint32_t y) {
+  static const auto ranks = VoidAndCluster{}.ranks();
+  const auto cell = (y & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE + (x & (BLUE_NOISE_SIZE - 1));
+  // Middle of the rank's interval
+  return (ranks[cell] << (32 - 2 * BLUE_NOISE_BITS)) | (1U << (31 - 2 * BLUE_NOISE_BITS));
+}
+
+} // namespace
+
+Sampler::Sampler(SamplerKind kind, std::uint64_t seed, std::uint32_t x, std::uint32_t y,
+                 const Random& rng)
+    : kind_{kind}, rng_{rng}, x_{x}, y_{y} {
+  const auto render = hash_combine(static_cast<std::uint32_t>(seed),
+                                   static_cast<std::uint32_t>(seed >> 32));
+  // Blue noise needs the same sequence in every pixel, the mask decorrelates
+  // them
+  scramble_ = kind == SamplerKind::BlueNoise ?
+      render : hash_combine(hash_combine(render, x), y);
+}
+
+float Sampler::sample(std::uint32_t dimension) {
+  switch (kind_) {
+  case SamplerKind::Halton: {
+    if (dimension >= HALTON_DIMENSIONS) {
+      return rng_.uniform();
+    }
+    const auto value = HALTON[dimension](index_, hash_combine(scramble_, dimension));
+    return std::min(static_cast<float>(value), ONE_MINUS_EPSILON);
+  }
+  case SamplerKind::Sobol:
+    return to_float(sobol_owen(index_, dimension, scramble_));
+  case SamplerKind::BlueNoise: {
+    // Each dimension reads the mask at its own offset, so that the
+    // dimensions of a pixel are not shifted alike
+    const auto offset = hash_combine(scramble_, dimension);
+    const auto shift = blue_noise(x_ + offset, y_ + (offset >> 16));
+    // Toroidal shift: the sum wraps around in 32 bit arithmetic
+    return to_float(sobol_owen(index_, dimension, scramble_) + shift);
+  }
+  case SamplerKind::Random:
+    break;
+  }
+  return rng_.uniform();
+}
+
+Vector3f Sampler::in_unit_sphere() {
+  if (kind_ == SamplerKind::Random) {
+    return random_in_unit_sphere(rng_);
+  }
+  // Direction from the first two dimensions, radius from the third, with the
+  // cube root that makes the volume uniform
+  const auto z = 1 - 2 * uniform();
+  const auto phi = 2 * static_cast<float>(M_PI) * uniform();
+  const auto radius = std::cbrt(uniform());
+  const auto r = std::sqrt(std::max(0.0f, 1 - z * z));
+  return radius * Vector3f{r * std::cos(phi), r * std::sin(phi), z};
+}
+
+Vector3f Sampler::in_unit_disk() {
+  if (kind_ == SamplerKind::Random) {
+    return random_in_unit_disk(rng_);
+  }
+  // Concentric mapping of the square (Shirley and Chiu), which keeps the
+  // strata of the sequence compact on the disk
+  const auto a = 2 * uniform() - 1;
+  const auto b = 2 * uniform() - 1;
+  if (a == 0 && b == 0) {
+    return {0, 0, 0};
+  }
+  const auto quarter_pi = static_cast<float>(M_PI) / 4;
+  float r, phi;
+  if (std::abs(a) > std::abs(b)) {
+    r = a;
+    phi = quarter_pi * (b / a);
+  } else {
+    r = b;
+    phi = 2 * quarter_pi - quarter_pi * (a / b);
+  }
+  return {r * std::cos(phi), r * std::sin(phi), 0};
+}
+
+} // namespace rt
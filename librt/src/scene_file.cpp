@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <material.hpp>
+#include <scene_file.hpp>
+
+namespace rt {
+namespace {
+
+/*
+ * Layout of a scene file: the header, then every array at an offset that is
+ * a multiple of ALIGNMENT (from the start of the file, which is mapped at a
+ * page boundary). Sphere arrays have `padded` entries, see SphereSoA
+ */
+const char SCENE_MAGIC[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '1'};
+constexpr std::uint64_t ALIGNMENT = 64;
+
+struct SceneHeader {
+  char magic[8];
+  std::uint32_t spheres;
+  std::uint32_t padded;
+  std::uint32_t materials;
+  std::uint32_t nodes;
+  // Offsets of the arrays
+  std::uint64_t cx, cy, cz, radius, id, material;
+  std::uint64_t material_records;
+  std::uint64_t node_records;
+};
+
+/*
+ * Storable subset of a MaterialRecord: the textures are reduced to their
+ * colors
+ */
+struct SceneMaterial {
+  std::uint8_t kind;
+  std::uint8_t texture;
+  std::uint8_t unused[2];
+  float color[3];
+  float color1[3];
+  float color2[3];
+  float ref_idx;
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode is stored as is in scene files");
+
+SceneMaterial to_scene(const MaterialRecord& record) {
+  const auto texture = record.albedo.kind;
+  if (record.kind == MaterialKind::Lambertian &&
+      texture != TextureKind::Constant && texture != TextureKind::Checker) {
+    throw std::runtime_error{"Only constant and checker textures can be saved in a scene"};
+  }
+  SceneMaterial m{};
+  m.kind = static_cast<std::uint8_t>(record.kind);
+  m.texture = static_cast<std::uint8_t>(texture);
+  for (auto i = 0 ; i < 3 ; ++i) {
+    m.color[i] = record.color[i];
+    m.color1[i] = record.albedo.color1[i];
+    m.color2[i] = record.albedo.color2[i];
+  }
+  m.ref_idx = record.ref_idx;
+  return m;
+}
+
+MaterialRecord from_scene(const SceneMaterial& m) {
+  TextureRecord albedo;
+  albedo.kind = static_cast<TextureKind>(m.texture);
+  albedo.color1 = Vector3f{m.color1[0], m.color1[1], m.color1[2]};
+  albedo.color2 = Vector3f{m.color2[0], m.color2[1], m.color2[2]};
+  return MaterialRecord{static_cast<MaterialKind>(m.kind), albedo,
+                        Vector3f{m.color[0], m.color[1], m.color[2]}, m.ref_idx};
+}
+
+/*
+ * Whether the arrays of a scene file that fit in it hold what the queries
+ * assume: material ids and kinds in range, and a BVH that is a tree, with
+ * leaves within the spheres, no deeper than the traversal stacks allow
+ */
+bool valid_contents(const SceneHeader& header, const char* base) {
+  const auto* material = reinterpret_cast<const MaterialId*>(base + header.material);
+  for (auto i = 0U ; i < header.spheres ; ++i) {
+    if (material[i] >= header.materials) {
+      return false;
+    }
+  }
+  const auto* materials = reinterpret_cast<const SceneMaterial*>(base + header.material_records);
+  for (auto i = 0U ; i < header.materials ; ++i) {
+    if (materials[i].kind >= MATERIAL_KINDS ||
+        (materials[i].texture != static_cast<std::uint8_t>(TextureKind::Constant) &&
+         materials[i].texture != static_cast<std::uint8_t>(TextureKind::Checker))) {
+      return false;
+    }
+  }
+
+  // Children come after their parent, as build_bvh() stores them, and have
+  // no other parent: one pass in order then sees every node once, and knows
+  // its depth
+  const auto* nodes = reinterpret_cast<const BVHNode*>(base + header.node_records);
+  const auto count = header.nodes;
+  std::vector<std::uint32_t> depth(count, 0);
+  std::vector<bool> reached(count, false);
+  if (count > 0) {
+    reached[0] = true;
+  }
+  for (auto i = 0U ; i < count ; ++i) {
+    const auto& node = nodes[i];
+    if (!reached[i] || depth[i] > BVH_MAX_DEPTH) {
+      return false;
+    }
+    if (node.leaf()) {
+      if (node.offset > header.spheres || node.count > header.spheres - node.offset) {
+        return false;
+      }
+      continue;
+    }
+    const auto left = i + 1;
+    const auto right = node.offset;
+    if (node.axis > 2 || right <= left || right >= count || reached[left] || reached[right]) {
+      return false;
+    }
+    reached[left] = reached[right] = true;
+    depth[left] = depth[right] = depth[i] + 1;
+  }
+  return true;
+}
+
+/*
+ * Append count elements at the next aligned offset and return the offset
+ */
+template<typename T>
+std::uint64_t write_array(std::ostream& os, const T* data, std::size_t count) {
+  const char zeros[ALIGNMENT] = {};
+  const auto position = static_cast<std::uint64_t>(os.tellp());
+  const auto offset = (position + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  os.write(zeros, offset - position);
+  os.write(reinterpret_cast<const char*>(data), sizeof(T) * count);
+  return offset;
+}
+
+} // Unnamed namespace
+
+void save_scene(const std::string& path, const SphereSet& spheres,
+                const MaterialTable& table) {
+  const auto view = spheres.view();
+  const auto padded = view.size + SphereSoA::WIDTH;
+
+  // Materials keep their ids, so the table is stored up to the last one in
+  // use. Those no sphere uses are left blank, whatever their texture
+  std::vector<SceneMaterial> materials;
+  for (auto i = 0U ; i < view.size ; ++i) {
+    const auto id = view.material[i];
+    if (id >= materials.size()) {
+      materials.resize(id + 1, SceneMaterial{});
+    }
+    materials[id] = to_scene(table[id]);
+  }
+
+  SceneHeader header{};
+  std::copy(SCENE_MAGIC, SCENE_MAGIC + sizeof(SCENE_MAGIC), header.magic);
+  header.spheres = static_cast<std::uint32_t>(view.size);
+  header.padded = static_cast<std::uint32_t>(padded);
+  header.materials = static_cast<std::uint32_t>(materials.size());
+  header.nodes = static_cast<std::uint32_t>(view.node_count);
+
+  std::ofstream os{path, std::ios::binary | std::ios::trunc};
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  header.cx = write_array(os, view.spheres.cx, padded);
+  header.cy = write_array(os, view.spheres.cy, padded);
+  header.cz = write_array(os, view.spheres.cz, padded);
+  header.radius = write_array(os, view.spheres.radius, padded);
+  header.id = write_array(os, view.spheres.id, padded);
+  header.material = write_array(os, view.material, padded);
+  header.material_records = write_array(os, materials.data(), materials.size());
+  header.node_records = write_array(os, view.nodes, view.node_count);
+  os.seekp(0);
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  if (!os) {
+    throw std::runtime_error{"Cannot write scene " + path};
+  }
+}
+
+MappedScene::MappedScene(const std::string& path) {
+  const auto fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error{"Cannot open scene " + path};
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(SceneHeader)) {
+    close(fd);
+    throw std::runtime_error{path + " is not a scene file"};
+  }
+  length_ = static_cast<std::size_t>(st.st_size);
+  data_ = mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data_ == MAP_FAILED) {
+    throw std::runtime_error{"Cannot map scene " + path};
+  }
+
+  const auto* base = static_cast<const char*>(data_);
+  SceneHeader header;
+  std::memcpy(&header, base, sizeof(header));
+  auto fits = [&](std::uint64_t offset, std::uint64_t bytes) {
+    return offset % ALIGNMENT == 0 && offset <= length_ && bytes <= length_ - offset;
+  };
+  const auto floats = std::uint64_t{header.padded} * sizeof(float);
+  if (!std::equal(SCENE_MAGIC, SCENE_MAGIC + sizeof(SCENE_MAGIC), header.magic) ||
+      header.padded != std::uint64_t{header.spheres} + SphereSoA::WIDTH ||
+      !fits(header.cx, floats) || !fits(header.cy, floats) || !fits(header.cz, floats) ||
+      !fits(header.radius, floats) || !fits(header.id, floats) ||
+      !fits(header.material, floats) ||
+      !fits(header.material_records, std::uint64_t{header.materials} * sizeof(SceneMaterial)) ||
+      !fits(header.node_records, std::uint64_t{header.nodes} * sizeof(BVHNode))) {
+    munmap(data_, length_);
+    throw std::runtime_error{path + " is not a scene file"};
+  }
+  if (!valid_contents(header, base)) {
+    munmap(data_, length_);
+    throw std::runtime_error{path + " is corrupt"};
+  }
+
+  const auto* materials = reinterpret_cast<const SceneMaterial*>(base + header.material_records);
+  for (auto i = 0U ; i < header.materials ; ++i) {
+    materials_.add(from_scene(materials[i]));
+  }
+
+  view_ = SphereSetView{
+    SphereSoA{reinterpret_cast<const float*>(base + header.cx),
+              reinterpret_cast<const float*>(base + header.cy),
+              reinterpret_cast<const float*>(base + header.cz),
+              reinterpret_cast<const float*>(base + header.radius),
+              reinterpret_cast<const std::int32_t*>(base + header.id)},
+    reinterpret_cast<const MaterialId*>(base + header.material),
+    header.spheres,
+    header.nodes > 0 ? reinterpret_cast<const BVHNode*>(base + header.node_records) : nullptr,
+    header.nodes};
+}
+
+MappedScene::~MappedScene() {
+  munmap(data_, length_);
+}
+
+} // namespace rt
@@ -0,0 +1,109 @@
+#include <scenes.hpp>
+#include <sphere.hpp>
+
+namespace rt {
+
+HitableList::HitablePtr lights_scene(MaterialRegistry& materials,
+                                     TextureRegistry& textures,
+                                     Arena* arena) {
+  textures.register_texture<ConstantTexture>("green", Vector3f{0.8, 0.8, 0});
+  textures.register_texture<ConstantTexture>("salmon", Vector3f{0.8, 0.3, 0.3});
+
+  materials.register_lambertian("ballgreen", textures.get("green"));
+  materials.register_lambertian("ballsalmon", textures.get("salmon"));
+  materials.register_metal("mirror", {0.8, 1, 0.5});
+  materials.register_metal("perfectmirror", {0.5, 0.5, 0.5});
+  materials.register_dielectric("transparent", 1.5);
+  materials.register_light("light", {2,2,2});
+
+  HitableList::HitablePtr world_vector;
+  world_vector.push_back(make_object<Sphere>(arena, Vector3f{0.5, 2, -1}, 1,
+                                             materials.get("light")));
+  world_vector.push_back(make_object<Sphere>(arena, Vector3f{-1, 1.5, -1}, 0.5,
+                                             materials.get("light")));
+  world_vector.push_back(make_object<Sphere>(arena, Vector3f{0, 0, -1}, 0.5,
+                                             materials.get("ballsalmon")));
+  world_vector.push_back(make_object<Sphere>(arena, Vector3f{1, 0, -1}, 0.25,
+                                             materials.get("perfectmirror")));
+  world_vector.push_back(make_object<Sphere>(arena, Vector3f{-1, 0.0, -1}, 0.5,
+                                             materials.get("transparent")));
+  world_vector.push_back(make_object<Sphere>(arena, Vector3f{-1, 0.0, -1}, -0.45,
+                                             materials.get("transparent")));
+  world_vector.push_back(make_object<Sphere>(arena, Vector3f{0, -100.5, -1}, 100,
+                                             materials.get("ballgreen")));
+  return world_vector;
+}
+
+HitableList::HitablePtr random_scene(MaterialRegistry& materials,
+                                     TextureRegistry& textures,
+                                     Random& rng,
+                                     Arena* arena) {
+  HitableList::HitablePtr world_vector;
+  textures.register_texture<CheckerTexture>("checker",
+                                            Vector3f{0.2, 0.3, 0.1},
+                                            Vector3f{0.9, 0.9, 0.9});
+
+  materials.register_lambertian("floor", textures.get("checker"));
+  // Floor
+  world_vector.push_back(make_object<Sphere>(arena, Vector3f{0, -1000, 0}, 1000.f,
+                                             materials.get("floor")));
+
+  for (auto a = -11 ; a < 11 ; ++a) {
+    for (auto b = -11 ; b < 11 ; ++b) {
+      float choose_mat = rng.uniform();
+      Vector3f center{a + 0.9f * rng.uniform(), 0.2, b + 0.9f * rng.uniform()};
+
+      Vector3f reference{4, 0.2, 0};
+      if ((center - reference).norm2() > 0.9) {
+        if (choose_mat < 0.8) {
+          world_vector.push_back(
+              make_object<Sphere>(arena, center, 0.2f,
+                                  materials.generate_lambertial(textures, rng)));
+        } else if (choose_mat < 0.95) {
+          world_vector.push_back(
+              make_object<Sphere>(arena, center, 0.2f, materials.generate_metal(rng)));
+        } else {
+          world_vector.push_back(
+              make_object<Sphere>(arena, center, 0.2f, materials.generate_dielectric()));
+        }
+      }
+    }
+  }
+
+  world_vector.push_back(
+      make_object<Sphere>(arena, Vector3f{0, 1, 0}, 1.0f,
+                          materials.generate_dielectric()));
+  world_vector.push_back(
+      make_object<Sphere>(arena, Vector3f{-4, 1, 0}, 1.0f,
+                          materials.generate_lambertial(textures, rng)));
+  world_vector.push_back(
+      make_object<Sphere>(arena, Vector3f{4, 1, 0}, 1.0f,
+                          materials.generate_metal(rng)));
+
+  return world_vector;
+}
+
+Camera scene_camera(float ratio) {
+  const Vector3f lookfrom(0,2,4);
+  const Vector3f lookat(0,0.40,0);
+  const float dist_to_focus{5.0f};
+  const float aperture{0.1f};
+  const Vector3f vertical{0, 1, 0};
+
+  return Camera(lookfrom, lookat, vertical, 20, ratio, aperture, dist_to_focus);
+}
+
+std::unique_ptr<SphereSet> make_sphere_set(const HitableList::HitablePtr& objects,
+                                           bool accelerate) {
+  auto spheres = std::make_unique<SphereSet>();
+  for (const auto& object : objects) {
+    const auto& sphere = dynamic_cast<const Sphere&>(*object);
+    spheres->add(sphere.center(), sphere.radius(), sphere.material());
+  }
+  if (accelerate) {
+    spheres->accelerate();
+  }
+  return spheres;
+}
+
+} // namespace rt
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <scheduler.hpp>
+
+#ifdef USE_OMP
+#include <omp.h>
+#endif
+
+namespace rt {
+namespace {
+
+/*
+ * Spread the 32 bits of x over the even bits of the result
+ */
+std::uint64_t spread_bits(std::uint32_t v) {
+  std::uint64_t x = v;
+  x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x << 2)) & 0x3333333333333333ULL;
+  x = (x | (x << 1)) & 0x5555555555555555ULL;
+  return x;
+}
+
+std::uint64_t morton(std::uint32_t x, std::uint32_t y) {
+  return (spread_bits(y) << 1) | spread_bits(x);
+}
+
+/*
+ * Deque of tile indices. The owner pops from the front, thieves from the
+ * back, so they only contend when the deque is almost empty
+ */
+class WorkQueue {
+ public:
+  void assign(std::size_t begin, std::size_t end) {
+    for (auto i = begin ; i < end ; ++i) {
+      items_.push_back(i);
+    }
+  }
+
+  bool pop(std::size_t& item) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (items_.empty()) {
+      return false;
+    }
+    item = items_.front();
+    items_.pop_front();
+    return true;
+  }
+
+  bool steal(std::size_t& item) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (items_.empty()) {
+      return false;
+    }
+    item = items_.back();
+    items_.pop_back();
+    return true;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::deque<std::size_t> items_;
+};
+
+/*
+ * Call work(w) for every w in [0, workers) in one parallel region, the
+ * first one on the calling thread
+ */
+void run_workers(unsigned workers, Backend backend,
+                 const std::function<void(unsigned)>& work) {
+  if (workers == 1) {
+    work(0);
+    return;
+  }
+
+#ifdef USE_OMP
+  if (backend == Backend::OpenMP) {
+    #pragma omp parallel num_threads(workers)
+    {
+      // The runtime can give the region fewer threads than asked for
+      // (OMP_THREAD_LIMIT, nested regions...). The first thread then starts
+      // the missing workers on threads of their own
+      std::vector<std::thread> missing;
+      if (omp_get_thread_num() == 0) {
+        for (auto w = static_cast<unsigned>(omp_get_num_threads()) ; w < workers ; ++w) {
+          missing.emplace_back(work, w);
+        }
+      }
+      work(static_cast<unsigned>(omp_get_thread_num()));
+      for (auto& thread : missing) {
+        thread.join();
+      }
+    }
+    return;
+  }
+#else
+  static_cast<void>(backend);
+#endif
+
+  std::vector<std::thread> threads;
+  for (auto w = 1U ; w < workers ; ++w) {
+    threads.emplace_back(work, w);
+  }
+  work(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+} // Unnamed namespace
+
+std::vector<Tile> make_tiles(std::uint32_t width, std::uint32_t height,
+                             std::uint32_t tile_size) {
+  tile_size = std::max(tile_size, 1U);
+  const auto columns = (width + tile_size - 1) / tile_size;
+  const auto rows = (height + tile_size - 1) / tile_size;
+
+  std::vector<std::pair<std::uint64_t, Tile>> keyed;
+  keyed.reserve(static_cast<std::size_t>(columns) * rows);
+  for (auto ty = 0U ; ty < rows ; ++ty) {
+    for (auto tx = 0U ; tx < columns ; ++tx) {
+      const auto x0 = tx * tile_size;
+      const auto y0 = ty * tile_size;
+      keyed.emplace_back(morton(tx, ty),
+                         Tile{x0, y0, std::min(x0 + tile_size, width),
+                               std::min(y0 + tile_size, height)});
+    }
+  }
+  std::sort(keyed.begin(), keyed.end(),
+            [](const std::pair<std::uint64_t, Tile>& lhs,
+               const std::pair<std::uint64_t, Tile>& rhs) {
+              return lhs.first < rhs.first;
+            });
+
+  std::vector<Tile> tiles;
+  tiles.reserve(keyed.size());
+  for (const auto& entry : keyed) {
+    tiles.push_back(entry.second);
+  }
+  return tiles;
+}
+
+TileScheduler::TileScheduler(unsigned threads, Backend backend)
+    : threads_{threads}, backend_{backend} {
+  if (threads_ == 0) {
+#ifdef USE_OMP
+    if (backend_ == Backend::OpenMP) {
+      threads_ = static_cast<unsigned>(omp_get_max_threads());
+    }
+#endif
+    if (threads_ == 0) {
+      threads_ = std::max(std::thread::hardware_concurrency(), 1U);
+    }
+  }
+}
+
+void TileScheduler::run(const std::vector<Tile>& tiles, const TileFunction& f) const {
+  if (tiles.empty()) {
+    return;
+  }
+  const auto workers = static_cast<unsigned>(
+      std::min<std::size_t>(threads_, tiles.size()));
+
+  // Deal contiguous runs of tiles, which are neighbours in Morton order
+  auto queues = std::make_unique<WorkQueue[]>(workers);
+  for (auto w = 0U ; w < workers ; ++w) {
+    queues[w].assign(tiles.size() * w / workers, tiles.size() * (w + 1) / workers);
+  }
+
+  auto work = [&](unsigned worker) {
+    std::size_t item;
+    while (true) {
+      auto found = queues[worker].pop(item);
+      for (auto v = 1U ; !found && v < workers ; ++v) {
+        found = queues[(worker + v) % workers].steal(item);
+      }
+      // Nothing is ever added back, so all the queues are drained
+      if (!found) {
+        return;
+      }
+      f(tiles[item], worker);
+    }
+  };
+
+  run_workers(workers, backend_, work);
+}
+
+void TileScheduler::parallel(const WorkerFunction& f) const {
+  run_workers(threads_, backend_, f);
+}
+
+} // namespace rt
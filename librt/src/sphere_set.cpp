@@ -0,0 +1,430 @@
+#include <cmath>
+#include <limits>
+
+#include <light.hpp>
+#include <material.hpp>
+#include <sphere_set.hpp>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace rt {
+namespace {
+
+/*
+ * Pick the closest of the per lane results. Equal distances resolve to the
+ * lowest id, which is what testing the spheres in id order would do
+ */
+template<std::size_t N>
+bool reduce_lanes(const float (&t)[N], const std::int32_t (&id)[N], const std::int32_t (&lane_slot)[N],
+                  float& closest, std::int32_t& closest_id, std::size_t& slot) {
+  auto found = -1;
+  for (auto l = 0U ; l < N ; ++l) {
+    if (lane_slot[l] < 0) {
+      continue;
+    }
+    if (found < 0 || t[l] < t[found] || (t[l] == t[found] && id[l] < id[found])) {
+      found = l;
+    }
+  }
+  if (found < 0) {
+    return false;
+  }
+  closest = t[found];
+  closest_id = id[found];
+  slot = static_cast<std::size_t>(lane_slot[found]);
+  return true;
+}
+
+#if defined(__AVX2__)
+
+bool intersect_simd(const SphereSoA& s, const Ray& r, float t_min,
+                    std::size_t first, std::size_t count,
+                    float& closest, std::int32_t& closest_id, std::size_t& slot) {
+  const auto ox = _mm256_set1_ps(r.origin().x());
+  const auto oy = _mm256_set1_ps(r.origin().y());
+  const auto oz = _mm256_set1_ps(r.origin().z());
+  const auto dx = _mm256_set1_ps(r.dir().x());
+  const auto dy = _mm256_set1_ps(r.dir().y());
+  const auto dz = _mm256_set1_ps(r.dir().z());
+  const auto a = _mm256_set1_ps(dot(r.dir(), r.dir()));
+  const auto tmin = _mm256_set1_ps(t_min);
+  const auto sign = _mm256_set1_ps(-0.0f);
+  const auto lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const auto end = static_cast<std::int32_t>(first + count);
+  const auto vend = _mm256_set1_epi32(end);
+
+  auto best_t = _mm256_set1_ps(closest);
+  auto best_id = _mm256_set1_epi32(closest_id);
+  auto best_slot = _mm256_set1_epi32(-1);
+
+  for (auto i = static_cast<std::int32_t>(first) ; i < end ; i += 8) {
+    const auto ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(s.cx + i));
+    const auto ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(s.cy + i));
+    const auto ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(s.cz + i));
+    const auto radius = _mm256_loadu_ps(s.radius + i);
+    const auto b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)),
+                                 _mm256_mul_ps(ocz, dz));
+    const auto oc2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)),
+                                   _mm256_mul_ps(ocz, ocz));
+    const auto c = _mm256_sub_ps(oc2, _mm256_mul_ps(radius, radius));
+    const auto disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, c));
+
+    const auto slots = _mm256_add_epi32(_mm256_set1_epi32(i), lanes);
+    const auto in_range = _mm256_castsi256_ps(_mm256_cmpgt_epi32(vend, slots));
+    const auto live = _mm256_and_ps(in_range, _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GT_OQ));
+    if (_mm256_movemask_ps(live) == 0) {
+      continue;
+    }
+
+    const auto root = _mm256_sqrt_ps(disc);
+    const auto neg_b = _mm256_xor_ps(b, sign);
+    const auto t1 = _mm256_div_ps(_mm256_sub_ps(neg_b, root), a);
+    const auto t2 = _mm256_div_ps(_mm256_add_ps(neg_b, root), a);
+    const auto id = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s.id + i));
+
+    auto closer = [&](__m256 t) {
+      const auto less = _mm256_cmp_ps(t, best_t, _CMP_LT_OQ);
+      const auto tie = _mm256_and_ps(_mm256_cmp_ps(t, best_t, _CMP_EQ_OQ),
+                                     _mm256_castsi256_ps(_mm256_cmpgt_epi32(best_id, id)));
+      return _mm256_and_ps(_mm256_cmp_ps(t, tmin, _CMP_GT_OQ), _mm256_or_ps(less, tie));
+    };
+    const auto v1 = _mm256_and_ps(live, closer(t1));
+    const auto v2 = _mm256_andnot_ps(v1, _mm256_and_ps(live, closer(t2)));
+    const auto valid = _mm256_or_ps(v1, v2);
+    const auto t = _mm256_blendv_ps(t2, t1, v1);
+
+    best_t = _mm256_blendv_ps(best_t, t, valid);
+    best_id = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_id),
+                                                   _mm256_castsi256_ps(id), valid));
+    best_slot = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_slot),
+                                                     _mm256_castsi256_ps(slots), valid));
+  }
+
+  float t[8];
+  std::int32_t id[8], lane_slot[8];
+  _mm256_storeu_ps(t, best_t);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(id), best_id);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lane_slot), best_slot);
+  return reduce_lanes(t, id, lane_slot, closest, closest_id, slot);
+}
+
+#elif defined(__SSE2__)
+
+inline __m128 select(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+bool intersect_simd(const SphereSoA& s, const Ray& r, float t_min,
+                    std::size_t first, std::size_t count,
+                    float& closest, std::int32_t& closest_id, std::size_t& slot) {
+  const auto ox = _mm_set1_ps(r.origin().x());
+  const auto oy = _mm_set1_ps(r.origin().y());
+  const auto oz = _mm_set1_ps(r.origin().z());
+  const auto dx = _mm_set1_ps(r.dir().x());
+  const auto dy = _mm_set1_ps(r.dir().y());
+  const auto dz = _mm_set1_ps(r.dir().z());
+  const auto a = _mm_set1_ps(dot(r.dir(), r.dir()));
+  const auto tmin = _mm_set1_ps(t_min);
+  const auto sign = _mm_set1_ps(-0.0f);
+  const auto lanes = _mm_setr_epi32(0, 1, 2, 3);
+  const auto end = static_cast<std::int32_t>(first + count);
+  const auto vend = _mm_set1_epi32(end);
+
+  auto best_t = _mm_set1_ps(closest);
+  auto best_id = _mm_castsi128_ps(_mm_set1_epi32(closest_id));
+  auto best_slot = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+  for (auto i = static_cast<std::int32_t>(first) ; i < end ; i += 4) {
+    const auto ocx = _mm_sub_ps(ox, _mm_loadu_ps(s.cx + i));
+    const auto ocy = _mm_sub_ps(oy, _mm_loadu_ps(s.cy + i));
+    const auto ocz = _mm_sub_ps(oz, _mm_loadu_ps(s.cz + i));
+    const auto radius = _mm_loadu_ps(s.radius + i);
+    const auto b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)),
+                              _mm_mul_ps(ocz, dz));
+    const auto oc2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)),
+                                _mm_mul_ps(ocz, ocz));
+    const auto c = _mm_sub_ps(oc2, _mm_mul_ps(radius, radius));
+    const auto disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+
+    const auto slots = _mm_add_epi32(_mm_set1_epi32(i), lanes);
+    const auto in_range = _mm_castsi128_ps(_mm_cmplt_epi32(slots, vend));
+    const auto live = _mm_and_ps(in_range, _mm_cmpgt_ps(disc, _mm_setzero_ps()));
+    if (_mm_movemask_ps(live) == 0) {
+      continue;
+    }
+
+    const auto root = _mm_sqrt_ps(disc);
+    const auto neg_b = _mm_xor_ps(b, sign);
+    const auto t1 = _mm_div_ps(_mm_sub_ps(neg_b, root), a);
+    const auto t2 = _mm_div_ps(_mm_add_ps(neg_b, root), a);
+    const auto id = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s.id + i));
+
+    auto closer = [&](__m128 t) {
+      const auto less = _mm_cmplt_ps(t, best_t);
+      const auto tie = _mm_and_ps(_mm_cmpeq_ps(t, best_t),
+                                  _mm_castsi128_ps(_mm_cmplt_epi32(id, _mm_castps_si128(best_id))));
+      return _mm_and_ps(_mm_cmpgt_ps(t, tmin), _mm_or_ps(less, tie));
+    };
+    const auto v1 = _mm_and_ps(live, closer(t1));
+    const auto v2 = _mm_andnot_ps(v1, _mm_and_ps(live, closer(t2)));
+    const auto valid = _mm_or_ps(v1, v2);
+    const auto t = select(v1, t1, t2);
+
+    best_t = select(valid, t, best_t);
+    best_id = select(valid, _mm_castsi128_ps(id), best_id);
+    best_slot = select(valid, _mm_castsi128_ps(slots), best_slot);
+  }
+
+  float t[4];
+  std::int32_t id[4], lane_slot[4];
+  _mm_storeu_ps(t, best_t);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(id), _mm_castps_si128(best_id));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lane_slot), _mm_castps_si128(best_slot));
+  return reduce_lanes(t, id, lane_slot, closest, closest_id, slot);
+}
+
+#else
+
+bool intersect_simd(const SphereSoA& s, const Ray& r, float t_min,
+                    std::size_t first, std::size_t count,
+                    float& closest, std::int32_t& closest_id, std::size_t& slot) {
+  const auto a = dot(r.dir(), r.dir());
+  auto found = false;
+  for (auto i = first ; i < first + count ; ++i) {
+    const Vector3f oc = r.origin() - Vector3f{s.cx[i], s.cy[i], s.cz[i]};
+    const auto b = dot(oc, r.dir());
+    const auto c = dot(oc, oc) - s.radius[i] * s.radius[i];
+    const auto disc = b * b - a * c;
+    if (!(disc > 0)) {
+      continue;
+    }
+    auto closer = [&](float t) {
+      return t > t_min && (t < closest || (t == closest && s.id[i] < closest_id));
+    };
+    const auto root = sqrtf(disc);
+    auto t = (-b - root) / a;
+    if (!closer(t)) {
+      t = (-b + root) / a;
+      if (!closer(t)) {
+        continue;
+      }
+    }
+    closest = t;
+    closest_id = s.id[i];
+    slot = i;
+    found = true;
+  }
+  return found;
+}
+
+#endif
+
+} // Unnamed namespace
+
+bool intersect_spheres(const SphereSoA& spheres, const Ray& r, float t_min,
+                       std::size_t first, std::size_t count,
+                       float& closest, std::int32_t& closest_id, std::size_t& slot) {
+  return intersect_simd(spheres, r, t_min, first, count, closest, closest_id, slot);
+}
+
+void SphereSet::add(const Vector3f& center, float radius, MaterialId material) {
+  // Drop the padding, append, and pad again
+  cx_.resize(size_);
+  cy_.resize(size_);
+  cz_.resize(size_);
+  radius_.resize(size_);
+  id_.resize(size_);
+  material_.resize(size_);
+
+  cx_.push_back(center.x());
+  cy_.push_back(center.y());
+  cz_.push_back(center.z());
+  radius_.push_back(radius);
+  id_.push_back(static_cast<std::int32_t>(size_));
+  material_.push_back(material);
+  ++size_;
+  pad();
+
+  nodes_.clear();
+}
+
+void SphereSet::pad() {
+  const auto padded = size_ + SphereSoA::WIDTH;
+  const auto nan = std::numeric_limits<float>::quiet_NaN();
+  cx_.resize(padded, nan);
+  cy_.resize(padded, nan);
+  cz_.resize(padded, nan);
+  radius_.resize(padded, 0);
+  id_.resize(padded, std::numeric_limits<std::int32_t>::max());
+  material_.resize(padded, 0);
+}
+
+void SphereSet::accelerate(std::size_t max_leaf_size) {
+  std::vector<AABB> boxes;
+  boxes.reserve(size_);
+  for (auto i = 0U ; i < size_ ; ++i) {
+    const auto r = fabsf(radius_[i]);
+    const Vector3f center{cx_[i], cy_[i], cz_[i]};
+    boxes.emplace_back(center - Vector3f{r, r, r}, center + Vector3f{r, r, r});
+  }
+
+  std::vector<std::uint32_t> order;
+  build_bvh(boxes, max_leaf_size, nodes_, order);
+
+  // Store the spheres in leaf order. Ids keep the original position so ties
+  // still resolve like the unordered set
+  auto permute = [&](auto& array) {
+    auto copy = array;
+    for (auto i = 0U ; i < size_ ; ++i) {
+      array[i] = copy[order[i]];
+    }
+  };
+  permute(cx_);
+  permute(cy_);
+  permute(cz_);
+  permute(radius_);
+  permute(id_);
+  permute(material_);
+}
+
+bool SphereSetView::hit(const Ray& r, float t_min, float t_max, Hit& rec) const {
+  RT_STAT(++stats::local().hit_calls);
+  auto closest = t_max;
+  auto closest_id = std::int32_t{-1};
+  auto slot = std::size_t{0};
+
+  auto found = false;
+  if (nodes == nullptr) {
+    found = intersect_spheres(spheres, r, t_min, 0, size, closest, closest_id, slot);
+  } else {
+    found = bvh_traverse(nodes, r, t_min, closest,
+                         [&](std::uint32_t first, std::uint32_t count, float& leaf_closest) {
+                           return intersect_spheres(spheres, r, t_min, first, count,
+                                                    leaf_closest, closest_id, slot);
+                         });
+  }
+  if (found) {
+    fill_hit(r, closest, slot, rec);
+  }
+  return found;
+}
+
+bool SphereSetView::occluded(const Ray& r, float t_min, float t_max) const {
+  RT_STAT(++stats::local().hit_calls);
+  auto closest = t_max;
+  auto closest_id = std::int32_t{-1};
+  auto slot = std::size_t{0};
+  if (nodes == nullptr) {
+    return intersect_spheres(spheres, r, t_min, 0, size, closest, closest_id, slot);
+  }
+  return bvh_traverse<true>(nodes, r, t_min, closest,
+                            [&](std::uint32_t first, std::uint32_t count, float& leaf_closest) {
+                              return intersect_spheres(spheres, r, t_min, first, count,
+                                                       leaf_closest, closest_id, slot);
+                            });
+}
+
+std::uint32_t SphereSetView::hit_packet(const RayPacket& packet, std::uint32_t active,
+                                        float t_min, HitPacket& hits) const {
+  std::int32_t closest_id[MAX_PACKET_SIZE];
+  std::size_t slot[MAX_PACKET_SIZE];
+  Ray rays[MAX_PACKET_SIZE];
+  for_each_lane(active, [&](std::uint32_t l) {
+      closest_id[l] = -1;
+      rays[l] = packet.ray(l);
+    });
+
+  std::uint32_t mask = 0;
+  auto leaf = [&](std::uint32_t first, std::uint32_t count, std::uint32_t lanes) {
+    for_each_lane(lanes, [&](std::uint32_t l) {
+        if (intersect_spheres(spheres, rays[l], t_min, first, count,
+                              hits.t[l], closest_id[l], slot[l])) {
+          mask |= 1U << l;
+        }
+      });
+  };
+  if (nodes == nullptr) {
+    leaf(0, static_cast<std::uint32_t>(size), active);
+  } else {
+    bvh_traverse_packet(nodes, packet, active, t_min, hits.t, leaf);
+  }
+
+  for_each_lane(mask, [&](std::uint32_t l) {
+      fill_hit(rays[l], hits.t[l], slot[l], hits.hit[l]);
+    });
+  return mask;
+}
+
+std::uint32_t SphereSetView::occluded_packet(const RayPacket& packet, std::uint32_t active,
+                                             float t_min, const float* t_max) const {
+  // Blocked lanes get a closest distance no box is hit before, which takes
+  // them out of the rest of the traversal
+  float closest[MAX_PACKET_SIZE];
+  std::int32_t closest_id[MAX_PACKET_SIZE];
+  std::size_t slot[MAX_PACKET_SIZE];
+  Ray rays[MAX_PACKET_SIZE];
+  for (auto l = 0U ; l < packet.size ; ++l) {
+    closest[l] = (active >> l) & 1U ? t_max[l] : -FLT_MAX;
+  }
+  for_each_lane(active, [&](std::uint32_t l) {
+      closest_id[l] = -1;
+      rays[l] = packet.ray(l);
+    });
+
+  std::uint32_t occluded = 0;
+  auto leaf = [&](std::uint32_t first, std::uint32_t count, std::uint32_t lanes) {
+    for_each_lane(lanes, [&](std::uint32_t l) {
+        auto t = closest[l];
+        if (intersect_spheres(spheres, rays[l], t_min, first, count, t, closest_id[l], slot[l])) {
+          occluded |= 1U << l;
+          closest[l] = -FLT_MAX;
+        }
+      });
+  };
+  if (nodes == nullptr) {
+    leaf(0, static_cast<std::uint32_t>(size), active);
+  } else {
+    bvh_traverse_packet(nodes, packet, active, t_min, closest, leaf);
+  }
+  return occluded;
+}
+
+void SphereSetView::fill_hit(const Ray& r, float t, std::size_t slot, Hit& rec) const {
+  const Vector3f center{spheres.cx[slot], spheres.cy[slot], spheres.cz[slot]};
+  rec.t = t;
+  rec.p = r.point_at(t);
+  rec.normal = (rec.p - center) / spheres.radius[slot];
+  rec.material = material[slot];
+}
+
+bool SphereSetView::bounding_box(AABB& box) const {
+  if (size == 0) {
+    return false;
+  }
+  if (nodes != nullptr) {
+    box = AABB{Vector3f{nodes[0].lower[0], nodes[0].lower[1], nodes[0].lower[2]},
+               Vector3f{nodes[0].upper[0], nodes[0].upper[1], nodes[0].upper[2]}};
+    return true;
+  }
+  box = AABB{};
+  for (auto i = 0U ; i < size ; ++i) {
+    const auto r = fabsf(spheres.radius[i]);
+    const Vector3f center{spheres.cx[i], spheres.cy[i], spheres.cz[i]};
+    box.grow(AABB{center - Vector3f{r, r, r}, center + Vector3f{r, r, r}});
+  }
+  return true;
+}
+
+void SphereSetView::collect_lights(const MaterialTable& materials,
+                                   std::vector<SphereLight>& lights) const {
+  for (auto i = 0U ; i < size ; ++i) {
+    if (emits(materials, material[i])) {
+      lights.push_back(SphereLight{Vector3f{spheres.cx[i], spheres.cy[i], spheres.cz[i]},
+                                   spheres.radius[i], material[i]});
+    }
+  }
+}
+
+} // namespace rt
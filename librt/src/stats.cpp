@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include <image.hpp>
+#include <stats.hpp>
+
+namespace rt {
+namespace stats {
+namespace {
+
+const char* const KIND_NAMES[MATERIAL_KINDS] = {"lambertian", "metal", "dielectric", "light"};
+
+/*
+ * Counters of the live threads, and the sum of those of the threads that
+ * exited since the last reset
+ */
+struct Registry {
+  std::mutex mutex;
+  std::vector<ThreadCounters*> live;
+  Counters retired;
+};
+
+Registry& registry() {
+  static Registry r;
+  return r;
+}
+
+/*
+ * Black, red, yellow, white as t goes from 0 to 1
+ */
+void heat(float t, std::uint8_t* rgb) {
+  for (auto k = 0 ; k < 3 ; ++k) {
+    const auto c = std::min(std::max(3 * t - k, 0.0f), 1.0f);
+    rgb[k] = static_cast<std::uint8_t>(c * 255.99f);
+  }
+}
+
+} // Unnamed namespace
+
+void Counters::merge(const Counters& other) {
+  rays += other.rays;
+  hit_calls += other.hit_calls;
+  bvh_nodes += other.bvh_nodes;
+  for (auto k = 0U ; k < MATERIAL_KINDS ; ++k) {
+    scatter[k] += other.scatter[k];
+  }
+  for (auto d = 0U ; d < DEPTH_BINS ; ++d) {
+    depth[d] += other.depth[d];
+  }
+  tiles.insert(tiles.end(), other.tiles.begin(), other.tiles.end());
+}
+
+ThreadCounters::ThreadCounters() {
+  auto& r = registry();
+  std::lock_guard<std::mutex> lock{r.mutex};
+  r.live.push_back(this);
+}
+
+ThreadCounters::~ThreadCounters() {
+  auto& r = registry();
+  std::lock_guard<std::mutex> lock{r.mutex};
+  r.retired.merge(counters);
+  r.live.erase(std::find(r.live.begin(), r.live.end(), this));
+}
+
+void reset() {
+  auto& r = registry();
+  std::lock_guard<std::mutex> lock{r.mutex};
+  r.retired = Counters{};
+  for (auto* thread : r.live) {
+    thread->counters = Counters{};
+  }
+}
+
+Counters collect() {
+  auto& r = registry();
+  std::lock_guard<std::mutex> lock{r.mutex};
+  auto total = r.retired;
+  for (const auto* thread : r.live) {
+    total.merge(thread->counters);
+  }
+  return total;
+}
+
+void write_report(const std::string& path, const Counters& counters, double seconds) {
+  auto* out = std::fopen(path.c_str(), "w");
+  if (out == nullptr) {
+    throw std::runtime_error{"Cannot write " + path};
+  }
+
+  const auto rays = std::max<std::uint64_t>(counters.rays, 1);
+  std::fprintf(out, "{\n  \"seconds\": %.6g,\n  \"rays\": %llu,\n  \"rays_per_sec\": %.6g,\n"
+               "  \"hit_calls\": %llu,\n  \"hit_calls_per_ray\": %.4g,\n"
+               "  \"bvh_nodes\": %llu,\n  \"bvh_nodes_per_ray\": %.4g,\n",
+               seconds, static_cast<unsigned long long>(counters.rays),
+               counters.rays / seconds,
+               static_cast<unsigned long long>(counters.hit_calls),
+               static_cast<double>(counters.hit_calls) / rays,
+               static_cast<unsigned long long>(counters.bvh_nodes),
+               static_cast<double>(counters.bvh_nodes) / rays);
+
+  std::fprintf(out, "  \"scatter\": {");
+  for (auto k = 0U ; k < MATERIAL_KINDS ; ++k) {
+    std::fprintf(out, "%s\"%s\": %llu", k == 0 ? "" : ", ", KIND_NAMES[k],
+                 static_cast<unsigned long long>(counters.scatter[k]));
+  }
+  std::fprintf(out, "},\n");
+
+  // The histogram stops at the longest path
+  auto bins = DEPTH_BINS;
+  while (bins > 1 && counters.depth[bins - 1] == 0) {
+    --bins;
+  }
+  std::fprintf(out, "  \"depth_histogram\": [");
+  for (auto d = 0U ; d < bins ; ++d) {
+    std::fprintf(out, "%s%llu", d == 0 ? "" : ", ",
+                 static_cast<unsigned long long>(counters.depth[d]));
+  }
+  std::fprintf(out, "],\n");
+
+  // Busy time per worker shows load imbalance
+  std::map<unsigned, std::pair<std::size_t, double>> workers;
+  for (const auto& t : counters.tiles) {
+    ++workers[t.worker].first;
+    workers[t.worker].second += t.seconds;
+  }
+  std::fprintf(out, "  \"workers\": [");
+  auto first = true;
+  for (const auto& w : workers) {
+    std::fprintf(out, "%s\n    {\"worker\": %u, \"tiles\": %zu, \"seconds\": %.6g}",
+                 first ? "" : ",", w.first, w.second.first, w.second.second);
+    first = false;
+  }
+  std::fprintf(out, "\n  ],\n");
+
+  std::fprintf(out, "  \"tiles\": [");
+  for (std::size_t k = 0 ; k < counters.tiles.size() ; ++k) {
+    const auto& t = counters.tiles[k];
+    std::fprintf(out, "%s\n    {\"x0\": %u, \"y0\": %u, \"x1\": %u, \"y1\": %u, "
+                 "\"worker\": %u, \"seconds\": %.6g}",
+                 k == 0 ? "" : ",", t.tile.x0, t.tile.y0, t.tile.x1, t.tile.y1,
+                 t.worker, t.seconds);
+  }
+  std::fprintf(out, "\n  ]\n}\n");
+
+  const auto failed = std::ferror(out) != 0;
+  if (std::fclose(out) != 0 || failed) {
+    throw std::runtime_error{"Cannot write " + path};
+  }
+}
+
+void write_heatmap(const std::string& path, const std::vector<float>& cost,
+                   std::uint32_t width, std::uint32_t height) {
+  if (cost.empty()) {
+    return;
+  }
+  // A few pixels are much slower than the rest (timer noise, preemption),
+  // scaling to the slowest one would leave the image black
+  auto sorted = cost;
+  const auto percentile = sorted.begin() + sorted.size() * 99 / 100;
+  std::nth_element(sorted.begin(), percentile, sorted.end());
+  const auto slow = std::max(*percentile, 1.0f);
+
+  std::vector<std::uint8_t> image(cost.size() * 3);
+  for (std::size_t k = 0 ; k < cost.size() ; ++k) {
+    heat(std::min(cost[k] / slow, 1.0f), &image[k * 3]);
+  }
+
+  const auto ppm = path.size() >= 4 && path.compare(path.size() - 4, 4, ".ppm") == 0;
+  if (ppm) {
+    PPMWriter{path}.write(image, width, height);
+  } else {
+    PNGWriter{path}.write(image, width, height);
+  }
+}
+
+} // namespace stats
+} // namespace rt
@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include <camera.hpp>
+#include <film.hpp>
+#include <material.hpp>
+#include <path.hpp>
+#include <stats.hpp>
+#include <wavefront.hpp>
+
+namespace rt {
+namespace {
+
+// Bins of a wavefront: one per MaterialKind, plus the paths that missed
+constexpr std::size_t KINDS = MATERIAL_KINDS;
+constexpr std::uint8_t MISS = KINDS;
+
+std::size_t bin_index(MaterialKind kind) {
+  return static_cast<std::size_t>(kind);
+}
+
+} // Unnamed namespace
+
+void PathQueue::reserve(std::size_t n) {
+  for (auto* v : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb, &pdf}) {
+    v->reserve(n);
+  }
+  pixel.reserve(n);
+}
+
+void PathQueue::clear() {
+  for (auto* v : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb, &pdf}) {
+    v->clear();
+  }
+  pixel.clear();
+}
+
+void PathQueue::push(const Ray& r, const Vector3f& throughput, std::uint32_t p,
+                     float bounce_pdf) {
+  ox.push_back(r.origin().x());
+  oy.push_back(r.origin().y());
+  oz.push_back(r.origin().z());
+  dx.push_back(r.dir().x());
+  dy.push_back(r.dir().y());
+  dz.push_back(r.dir().z());
+  tr.push_back(throughput.x());
+  tg.push_back(throughput.y());
+  tb.push_back(throughput.z());
+  pdf.push_back(bounce_pdf);
+  pixel.push_back(p);
+}
+
+WavefrontTracer::WavefrontTracer(const Hitable& world, const Camera& cam,
+                                 const PathSettings& settings, std::size_t capacity)
+    : world_{world}, cam_{&cam}, materials_{*settings.materials}, settings_{settings}, capacity_{std::max<std::size_t>(capacity, 1)} {
+  current_.reserve(capacity_);
+  next_.reserve(capacity_);
+}
+
+void WavefrontTracer::trace(const Tile& tile, std::uint32_t width, std::uint32_t height,
+                            std::uint32_t spp, std::uint64_t seed, std::uint32_t pass,
+                            Film& film) {
+  const auto tile_width = tile.x1 - tile.x0;
+  const auto pixels = tile_width * (tile.y1 - tile.y0);
+  const auto stream_base = static_cast<std::uint64_t>(pass) * width * height;
+
+  sampler_.resize(pixels);
+  radiance_.assign(pixels, Vector3f{0, 0, 0});
+  features_.assign(film.has_features() ? pixels : 0, Features{});
+  for (auto k = 0U ; k < pixels ; ++k) {
+    const auto i = tile.y0 + k / tile_width;
+    const auto j = tile.x0 + k % tile_width;
+    const auto stream = stream_base + static_cast<std::uint64_t>(i) * width + j;
+    sampler_[k] = Sampler{Random::for_stream(seed, stream)};
+  }
+
+  const auto wave_spp = static_cast<std::uint32_t>(std::max<std::size_t>(capacity_ / pixels, 1));
+  for (auto done = 0U ; done < spp ; done += wave_spp) {
+    const auto samples = std::min(wave_spp, spp - done);
+
+    current_.clear();
+    for (auto k = 0U ; k < pixels ; ++k) {
+      const auto i = tile.y0 + k / tile_width;
+      const auto j = tile.x0 + k % tile_width;
+      for (auto s = 0U ; s < samples ; ++s) {
+        auto u = static_cast<float>(j + sampler_[k].uniform()) / width;
+        auto v = static_cast<float>(i + sampler_[k].uniform()) / height;
+        current_.push(cam_->ray(u, v, sampler_[k]), Vector3f{1, 1, 1}, k);
+      }
+    }
+
+    for (auto depth = 0 ; current_.size() > 0 ; ++depth) {
+      intersect(depth);
+      sort_by_material();
+
+      next_.clear();
+      const auto* start = bin_start_;
+      shade_lights(start[bin_index(MaterialKind::Light)],
+                   start[bin_index(MaterialKind::Light) + 1], depth);
+      scatter<scatter_lambertian>(start[bin_index(MaterialKind::Lambertian)],
+                                  start[bin_index(MaterialKind::Lambertian) + 1], depth);
+      scatter<scatter_metal>(start[bin_index(MaterialKind::Metal)],
+                             start[bin_index(MaterialKind::Metal) + 1], depth);
+      scatter<scatter_dielectric>(start[bin_index(MaterialKind::Dielectric)],
+                                  start[bin_index(MaterialKind::Dielectric) + 1], depth);
+      std::swap(current_, next_);
+    }
+  }
+
+  for (auto k = 0U ; k < pixels ; ++k) {
+    film.add(tile.x0 + k % tile_width, tile.y0 + k / tile_width, radiance_[k], spp);
+    if (!features_.empty()) {
+      film.add_features(tile.x0 + k % tile_width, tile.y0 + k / tile_width, features_[k]);
+    }
+  }
+}
+
+/*
+ * Closest hit of every path. Paths that miss end here, with the background
+ */
+void WavefrontTracer::intersect(int depth) {
+  const auto n = current_.size();
+  hits_.resize(n);
+  bin_.resize(n);
+  RT_STAT(stats::local().rays += n);
+  for (auto p = 0U ; p < n ; ++p) {
+    const auto r = current_.ray(p);
+    if (world_.hit(r, RAY_T_MIN, FLT_MAX, hits_[p])) {
+      bin_[p] = static_cast<std::uint8_t>(bin_index(materials_[hits_[p].material].kind));
+      if (depth == 0 && !features_.empty()) {
+        features_[current_.pixel[p]] += hit_features(materials_, r, hits_[p]);
+      }
+    } else {
+      if (depth == 0 && !features_.empty()) {
+        features_[current_.pixel[p]] += miss_features();
+      }
+      RT_STAT(stats::local().add_depth(depth));
+      bin_[p] = MISS;
+      radiance_[current_.pixel[p]] += current_.throughput(p) *
+          miss_color(r, settings_.background);
+    }
+  }
+}
+
+/*
+ * Counting sort of the paths that hit something by bin. It is stable, so
+ * within a bin paths stay in the order of the queue
+ */
+void WavefrontTracer::sort_by_material() {
+  std::size_t count[KINDS] = {};
+  for (const auto b : bin_) {
+    if (b != MISS) {
+      ++count[b];
+    }
+  }
+  bin_start_[0] = 0;
+  for (auto k = 0U ; k < KINDS ; ++k) {
+    bin_start_[k + 1] = bin_start_[k] + count[k];
+  }
+
+  std::size_t next[KINDS];
+  std::copy(bin_start_, bin_start_ + KINDS, next);
+  order_.resize(bin_start_[KINDS]);
+  for (auto p = 0U ; p < bin_.size() ; ++p) {
+    if (bin_[p] != MISS) {
+      order_[next[bin_[p]]++] = p;
+    }
+  }
+}
+
+/*
+ * Lights only emit: their paths end here. When the diffuse bounce before
+ * sampled the lights, what it finds is weighted against that sample
+ */
+void WavefrontTracer::shade_lights(std::size_t begin, std::size_t end, int depth) {
+  // Only the stats read the depth
+  static_cast<void>(depth);
+  RT_STAT(auto& counters = stats::local());
+  for (auto k = begin ; k < end ; ++k) {
+    RT_STAT(++counters.scatter[bin_index(MaterialKind::Light)]);
+    RT_STAT(counters.add_depth(depth + 1));
+    const auto p = order_[k];
+    const auto bounce_pdf = current_.pdf[p];
+    const auto weight = bounce_pdf > 0 ?
+        power_heuristic(bounce_pdf, settings_.lights->pdf(current_.ray(p).origin(), hits_[p])) :
+        1.0f;
+    radiance_[current_.pixel[p]] += weight * current_.throughput(p) *
+        materials_[hits_[p].material].color;
+  }
+}
+
+/*
+ * Scatter the paths of one bin, whose materials are all of the kind of
+ * Scatter. Surviving paths are queued for the next bounce. With light
+ * sampling, diffuse paths add a sample of the lights first, as in
+ * shade_path()
+ */
+template<bool (*Scatter)(const MaterialRecord&, const Ray&, const Hit&, Vector3f&, Ray&,
+                         Sampler&)>
+void WavefrontTracer::scatter(std::size_t begin, std::size_t end, int depth) {
+  RT_STAT(auto& counters = stats::local());
+  // None of the scattering kinds emits, so cut paths end with nothing more
+  if (depth >= settings_.max_depth) {
+    for (auto k = begin ; k < end ; ++k) {
+      RT_STAT(counters.add_depth(depth + 1));
+    }
+    return;
+  }
+
+  for (auto k = begin ; k < end ; ++k) {
+    const auto p = order_[k];
+    const auto& rec = hits_[p];
+    const auto pixel = current_.pixel[p];
+    auto throughput = current_.throughput(p);
+
+    Ray scattered;
+    Vector3f attenuation;
+    auto bounce_pdf = 0.0f;
+    const auto& material = materials_[rec.material];
+    RT_STAT(++counters.scatter[bin_index(material.kind)]);
+    if (Scatter == scatter_lambertian && settings_.lights != nullptr) {
+      radiance_[pixel] += throughput *
+          direct_light(material, rec, world_, *settings_.lights, sampler_[pixel]);
+      scatter_cosine(material, current_.ray(p), rec, attenuation, scattered, sampler_[pixel]);
+      bounce_pdf = std::max(0.0f, dot(rec.normal, unit_vector(scattered.dir()))) /
+          static_cast<float>(M_PI);
+    } else if (!Scatter(material, current_.ray(p), rec, attenuation, scattered,
+                        sampler_[pixel])) {
+      RT_STAT(counters.add_depth(depth + 1));
+      continue;
+    }
+    throughput *= attenuation;
+    if (russian_roulette(depth, settings_, throughput, sampler_[pixel])) {
+      next_.push(scattered, throughput, pixel, bounce_pdf);
+    } else {
+      RT_STAT(counters.add_depth(depth + 1));
+    }
+  }
+}
+
+} // namespace rt